@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <stdexcept>
 #include <string>
@@ -53,29 +54,80 @@ ostream& operator<<(ostream &out, const NetworkEndpoint &value)
 
 
 
+IpAddress::IpAddress() : _family(AddressFamily::Unknown), _bytes() {}
+
+IpAddress IpAddress::FromBytes(const string& bytes)
+{
+    IpAddress result;
+    if ( bytes.size() == 4 )
+        { result._family = AddressFamily::IPv4; }
+    else if ( bytes.size() == 16 )
+        { result._family = AddressFamily::IPv6; }
+    else if ( ! bytes.empty() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid ip address bytearray size: " + to_string( bytes.size() ) ); }
+    copy( bytes.begin(), bytes.end(), result._bytes.begin() );
+    return result;
+}
+
+AddressFamily IpAddress::family() const { return _family; }
+bool IpAddress::empty() const { return _family == AddressFamily::Unknown; }
+
+string IpAddress::Bytes() const
+{
+    switch (_family)
+    {
+        case AddressFamily::IPv4: return string( _bytes.begin(), _bytes.begin() + 4 );
+        case AddressFamily::IPv6: return string( _bytes.begin(), _bytes.end() );
+        default: return string();
+    }
+}
+
+bool IpAddress::operator==(const IpAddress& other) const
+    { return _family == other._family && _bytes == other._bytes; }
+
+bool IpAddress::operator!=(const IpAddress& other) const
+    { return ! operator==(other); }
+
+
+ostream& operator<<(ostream &out, const IpAddress &value)
+    { return out << value.ToString(); }
+
+
+
+
 // NodeContact::NodeContact() {}
     
 NodeContact::NodeContact(const NodeContact& other) :
     _address(other._address), _nodePort(other._nodePort), _clientPort(other._clientPort) {}
 
-NodeContact::NodeContact(const Address& address, TcpPort nodePort, TcpPort clientPort) :
+NodeContact::NodeContact(const IpAddress& address, TcpPort nodePort, TcpPort clientPort) :
     _address(address), _nodePort(nodePort), _clientPort(clientPort) {}
 
+NodeContact::NodeContact(const Address& address, TcpPort nodePort, TcpPort clientPort) :
+    _address( IpAddress::FromString(address) ), _nodePort(nodePort), _clientPort(clientPort) {}
+
 
-const Address& NodeContact::address() const { return _address; }
+const IpAddress& NodeContact::ipAddress() const { return _address; }
+Address NodeContact::address() const { return _address.ToString(); }
 TcpPort NodeContact::nodePort() const { return _nodePort; }
 TcpPort NodeContact::clientPort() const { return _clientPort; }
 
 NetworkEndpoint NodeContact::nodeEndpoint() const
-    { return NetworkEndpoint(_address, _nodePort); }
+    { return NetworkEndpoint( address(), _nodePort ); }
 
 NetworkEndpoint NodeContact::clientEndpoint() const
-    { return NetworkEndpoint(_address, _clientPort); }
+    { return NetworkEndpoint( address(), _clientPort ); }
 
 
-void NodeContact::address(const Address& address)
+void NodeContact::address(const IpAddress& address)
     { _address = address; }
 
+void NodeContact::address(const Address& address)
+    { _address = IpAddress::FromString(address); }
+
+string NodeContact::AddressBytes() const
+    { return _address.Bytes(); }
+
 bool NodeContact::operator==(const NodeContact& other) const
 {
     return  _address    == other._address &&
@@ -153,29 +205,158 @@ bool ServiceInfo::operator!=(const ServiceInfo& other) const
 
 
 
+ServiceTable::ServiceTable() : _present(0), _ports(), _customData() {}
+
+ServiceTable::ServiceTable(initializer_list<ServiceInfo> services) :
+    _present(0), _ports(), _customData()
+{
+    for (const auto &service : services)
+        { set(service); }
+}
+
+
+size_t ServiceTable::Slot(ServiceType type)
+{
+    size_t slot = static_cast<size_t>(type);
+    if (slot >= SLOT_COUNT)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Unknown service type"); }
+    return slot;
+}
+
+const string& ServiceTable::CustomData(ServiceType type) const
+{
+    static const string NoData;
+    for (const auto &entry : _customData)
+    {
+        if (entry.first == type)
+            { return entry.second; }
+    }
+    return NoData;
+}
+
+
+size_t ServiceTable::size() const
+{
+    size_t result = 0;
+    for (uint32_t bits = _present; bits != 0; bits &= bits - 1)
+        { ++result; }
+    return result;
+}
+
+bool ServiceTable::empty() const
+    { return _present == 0; }
+
+size_t ServiceTable::count(ServiceType type) const
+{
+    size_t slot = static_cast<size_t>(type);
+    return slot < SLOT_COUNT && ( _present & (1u << slot) ) ? 1 : 0;
+}
+
+ServiceTable::const_iterator ServiceTable::find(ServiceType type) const
+    { return count(type) ? const_iterator( this, static_cast<size_t>(type) ) : end(); }
+
+ServiceInfo ServiceTable::at(ServiceType type) const
+{
+    if ( ! count(type) )
+        { throw out_of_range("Service is not present"); }
+    return ServiceInfo( type, _ports[ Slot(type) ], CustomData(type) );
+}
+
+
+void ServiceTable::set(const ServiceInfo& service)
+{
+    size_t slot = Slot( service.type() );
+    erase( service.type() );
+    _present |= 1u << slot;
+    _ports[slot] = service.port();
+    if ( ! service.customData().empty() )
+    {
+        auto position = _customData.begin();
+        while ( position != _customData.end() && position->first < service.type() )
+            { ++position; }
+        _customData.emplace( position, service.type(), service.customData() );
+    }
+}
+
+void ServiceTable::erase(ServiceType type)
+{
+    if ( ! count(type) )
+        { return; }
+    size_t slot = Slot(type);
+    _present &= ~(1u << slot);
+    _ports[slot] = 0;
+    for (auto position = _customData.begin(); position != _customData.end(); ++position)
+    {
+        if (position->first == type)
+        {
+            _customData.erase(position);
+            break;
+        }
+    }
+}
+
+
+ServiceTable::const_iterator ServiceTable::begin() const
+    { return const_iterator(this, 0); }
+
+ServiceTable::const_iterator ServiceTable::end() const
+    { return const_iterator(this, SLOT_COUNT); }
+
+
+bool ServiceTable::operator==(const ServiceTable& other) const
+{
+    // NOTE ports of missing services are always zero, so arrays can be compared as a whole
+    return _present    == other._present &&
+           _ports      == other._ports &&
+           _customData == other._customData;
+}
+
+bool ServiceTable::operator!=(const ServiceTable& other) const
+    { return ! operator==(other); }
+
+
+
+
+struct NodeInfo::Data
+{
+    NodeId      id;
+    GpsLocation location;
+    NodeContact contact;
+    Services    services;
+    
+    Data( const NodeId &id, const GpsLocation &location,
+          const NodeContact &contact, const Services &services ) :
+        id(id), location(location), contact(contact), services(services) {}
+};
+
+
 NodeInfo::NodeInfo(const NodeInfo& other) :
-    _id(other._id), _location(other._location), _contact(other._contact),
-    _services(other._services) {}
+    _data(other._data) {}
 
 NodeInfo::NodeInfo( const NodeId &id, const GpsLocation &location,
                     const NodeContact &contact, const Services &services ) :
-    _id(id), _location(location), _contact(contact), _services(services) {}
+    _data( make_shared<const Data>(id, location, contact, services) ) {}
+
 
+const NodeId&       NodeInfo::id()       const { return _data->id; }
+const GpsLocation&  NodeInfo::location() const { return _data->location; }
+const NodeContact&  NodeInfo::contact()  const { return _data->contact; }
+const NodeInfo::Services& NodeInfo::services() const { return _data->services; }
 
-const NodeId&       NodeInfo::id()       const { return _id; }
-const GpsLocation&  NodeInfo::location() const { return _location; }
-const NodeContact&  NodeInfo::contact()  const { return _contact; }
-const NodeInfo::Services& NodeInfo::services() const { return _services; }
+void NodeInfo::contact(const NodeContact& contact)
+    { _data = make_shared<const Data>( _data->id, _data->location, contact, _data->services ); }
 
-NodeContact& NodeInfo::contact() { return _contact; }
-NodeInfo::Services& NodeInfo::services() { return _services; }
+void NodeInfo::services(const Services& services)
+    { _data = make_shared<const Data>( _data->id, _data->location, _data->contact, services ); }
 
 bool NodeInfo::operator==(const NodeInfo& other) const
 {
-    return _id       == other._id &&
-           _location == other._location &&
-           _contact  == other._contact &&
-           _services == other._services;
+    if (_data == other._data)
+        { return true; }
+    return _data->id       == other._data->id &&
+           _data->location == other._data->location &&
+           _data->contact  == other._data->contact &&
+           _data->services == other._data->services;
 }
 
 bool NodeInfo::operator!=(const NodeInfo& other) const
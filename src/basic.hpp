@@ -1,10 +1,16 @@
 #ifndef __LOCNET_BASIC_TYPES_H__
 #define __LOCNET_BASIC_TYPES_H__
 
+#include <array>
 #include <exception>
 #include <functional>
+#include <initializer_list>
+#include <iterator>
 #include <iostream>
+#include <memory>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 
 
@@ -36,6 +42,7 @@ enum class ErrorCode : uint16_t
     // Problems with outgoing messages
     ERROR_CONNECTION = 96,          // Failed to connect to another peer
     ERROR_BAD_RESPONSE = 97,        // Consumed service (i.e. remote network node) returned unexpected response message
+    ERROR_TIMEOUT = 98,             // Another peer did not answer in time
     
     // Problems inside the server 
     ERROR_INTERNAL = 128,           // Implementation problem: this shouldn't happen, we are not well propared for this error.
@@ -82,36 +89,79 @@ std::ostream& operator<<(std::ostream& out, const NetworkEndpoint &value);
 
 
 
+enum class AddressFamily : uint8_t
+{
+    Unknown = 0,
+    IPv4    = 4,
+    IPv6    = 6,
+};
+
+
+// Binary IPv4 or IPv6 address in network byte order as used in protocol messages,
+// or an empty address if not known yet. Text format is needed only for logging, storage and connecting.
+class IpAddress
+{
+    AddressFamily               _family;
+    std::array<uint8_t, 16>     _bytes;
+    
+public:
+    
+    IpAddress(); // Empty address
+    
+    // Accepts 0 (empty), 4 (IPv4) or 16 (IPv6) bytes, throws otherwise
+    static IpAddress FromBytes(const std::string &bytes);
+    
+    AddressFamily family() const;
+    bool empty() const;
+    std::string Bytes() const;
+    
+    bool operator==(const IpAddress &other) const;
+    bool operator!=(const IpAddress &other) const;
+    
+    // NOTE Following functions are implemented in network.cpp as being library-specific (currently with asio)
+    // Parses the text format, empty text results an empty address
+    static IpAddress FromString(const Address &address);
+    Address ToString() const;
+};
+
+std::ostream& operator<<(std::ostream& out, const IpAddress &value);
+
+
+
 // Data holder class for contact data of a single (remote) node of the network to be advertised.
 class NodeContact
 {
-    Address     _address;
+    IpAddress   _address;
     TcpPort     _nodePort;
     TcpPort     _clientPort;
 
 public:
     
     NodeContact(const NodeContact &other);
+    NodeContact(const IpAddress &address, TcpPort nodePort, TcpPort clientPort);
+    // NOTE parses the address, throws if it's not a valid IP address
     NodeContact(const Address &address, TcpPort nodePort, TcpPort clientPort);
     
-    const Address& address() const;
+    const IpAddress& ipAddress() const;
+    Address address() const;
     TcpPort nodePort() const;
     TcpPort clientPort() const;
     
     NetworkEndpoint nodeEndpoint() const;
     NetworkEndpoint clientEndpoint() const;
     
+    void address(const IpAddress &address);
     void address(const Address &address);
     
     bool operator==(const NodeContact &other) const;
     bool operator!=(const NodeContact &other) const;
     
+    std::string AddressBytes() const;
+    
     // NOTE Following functions are implemented in network.cpp as being library-specific (currently with asio)
     // TODO consider splitting class into an interface here and an implementation in network
     static Address AddressFromBytes(const std::string &bytes);
     static std::string AddressToBytes(const Address &address);
-    
-    std::string AddressBytes() const;
 };
 
 std::ostream& operator<<(std::ostream& out, const NodeContact &value);
@@ -192,21 +242,95 @@ public:
 
 
 
+// Set of services provided by a node, at most one for each ServiceType.
+// Ports are kept in a fixed array indexed by service type and a bitmask of present services,
+// custom data is stored out of line only for services having any.
+// Services are iterated in increasing order of their type.
+class ServiceTable
+{
+    // NOTE must be greater than the highest value of ServiceType and fit into the bitmask
+    static const size_t SLOT_COUNT = 17;
+    
+    typedef std::vector< std::pair<ServiceType, std::string> > CustomDataList;
+    
+    uint32_t                            _present;
+    std::array<TcpPort, SLOT_COUNT>     _ports;
+    CustomDataList                      _customData; // NOTE sorted by service type
+    
+    static size_t Slot(ServiceType type);
+    const std::string& CustomData(ServiceType type) const;
+    
+public:
+    
+    class const_iterator : public std::iterator<std::forward_iterator_tag, ServiceInfo>
+    {
+        const ServiceTable *_table;
+        size_t              _slot;
+        
+        void SkipMissing()
+        {
+            while ( _slot < SLOT_COUNT && ! ( _table->_present & (1u << _slot) ) )
+                { ++_slot; }
+        }
+        
+    public:
+        
+        // NOTE defined here to be inlined, iteration is used on hot paths like message serialization
+        const_iterator(const ServiceTable *table, size_t slot) :
+            _table(table), _slot(slot) { SkipMissing(); }
+        
+        // NOTE fields can be accessed directly without creating a ServiceInfo object
+        ServiceType type() const { return static_cast<ServiceType>(_slot); }
+        TcpPort port() const { return _table->_ports[_slot]; }
+        const std::string& customData() const { return _table->CustomData( type() ); }
+        
+        ServiceInfo operator*() const { return ServiceInfo( type(), port(), customData() ); }
+        const_iterator& operator++() { ++_slot; SkipMissing(); return *this; }
+        bool operator==(const const_iterator &other) const
+            { return _table == other._table && _slot == other._slot; }
+        bool operator!=(const const_iterator &other) const
+            { return ! operator==(other); }
+    };
+    
+    ServiceTable();
+    ServiceTable(std::initializer_list<ServiceInfo> services);
+    
+    size_t size() const;
+    bool empty() const;
+    size_t count(ServiceType type) const;
+    const_iterator find(ServiceType type) const;
+    // Throws if the service is not present
+    ServiceInfo at(ServiceType type) const;
+    
+    // Adds the service or replaces the one already present with the same type
+    void set(const ServiceInfo &service);
+    void erase(ServiceType type);
+    
+    const_iterator begin() const;
+    const_iterator end() const;
+    
+    bool operator==(const ServiceTable &other) const;
+    bool operator!=(const ServiceTable &other) const;
+};
+
+
+
 // Data holder class for complete node information exposed to the network,
 // including node identity, network contact and position.
+// Node data is immutable and shared by all copies, so copying nodes (e.g. returning them
+// from queries or converting to and from NodeDbEntry) costs only a reference count increment.
+// Setters replace the shared data of this object only, other copies are not affected.
 // TODO will we also need a public key here later as part of the identity?
 class NodeInfo
 {
 public:
 
-    typedef std::unordered_map<ServiceType, ServiceInfo, EnumHasher> Services;
+    typedef ServiceTable Services;
 
 private:
     
-    NodeId      _id;
-    GpsLocation _location;
-    NodeContact _contact;
-    Services    _services;
+    struct Data;
+    std::shared_ptr<const Data> _data;
     
 public:
     
@@ -219,8 +343,8 @@ public:
     const NodeContact& contact() const;
     const Services& services() const;
     
-    Services& services();
-    NodeContact& contact();
+    void contact(const NodeContact &contact);
+    void services(const Services &services);
     
     bool operator==(const NodeInfo &other) const;
     bool operator!=(const NodeInfo &other) const;
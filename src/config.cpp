@@ -86,7 +86,6 @@ size_t Config::neighbourhoodTargetSize() const
     { return isTestMode() ? 3 : NEIGHBOURHOOD_TARGET_SIZE; }
 
 
-
 #ifdef _WIN32
 
 string GetWindowsDirectory(int folderId = CSIDL_APPDATA, bool createDir = true)
@@ -149,6 +148,14 @@ static const string DESC_OPTIONAL_DEFAULT = "Optional, default value: ";
 static const string DEFAULT_CONFIG_FILE = GetApplicationDataDirectory() + "iop-locnet.cfg";
 static const string DEFAULT_DBPATH      = GetApplicationDataDirectory() + "locnet.sqlite";
 static const string DEFAULT_LOGPATH     = GetApplicationDataDirectory() + "debug.log";
+static const string DBENGINE_SPATIALITE = "spatialite";
+static const string DBENGINE_INMEMORY   = "memory";
+static const string DEFAULT_NOTIFICATION_DELAY_MS   = "200";
+static const string DEFAULT_NOTIFICATION_BATCH_SIZE = "100";
+static const string DEFAULT_DISCOVERY_CONCURRENCY   = "8";
+static const string DEFAULT_NETWORK_TIMEOUT_SECS    = "10";
+static const string DEFAULT_RENEWAL_MARGIN_SECS     = "21600";
+static const string DEFAULT_RENEWALS_PER_SECOND     = "10";
 //const string DBFILE_PATH = ":memory:"; // NOTE in-memory storage without a db file
 //const string DBFILE_PATH = "file:locnet.sqlite"; // NOTE this may be any file URL
 
@@ -166,7 +173,14 @@ static const char *OPTNAME_LONGITUDE    = "--longitude";
 static const char *OPTNAME_SEEDNODE     = "--seednode";
 
 static const char *OPTNAME_DBPATH       = "--dbpath";
+static const char *OPTNAME_DBENGINE     = "--dbengine";
 static const char *OPTNAME_LOGPATH      = "--logpath";
+static const char *OPTNAME_NOTIFY_DELAY = "--notifydelay";
+static const char *OPTNAME_NOTIFY_BATCH = "--notifybatch";
+static const char *OPTNAME_CONNECTIONS  = "--connections";
+static const char *OPTNAME_TIMEOUT      = "--timeout";
+static const char *OPTNAME_RENEW_MARGIN = "--renewmargin";
+static const char *OPTNAME_RENEW_RATE   = "--renewrate";
 static const char *OPTNAME_TESTMODE     = "--test";
 
 static const vector<NetworkEndpoint> DefaultSeedNodes {
@@ -223,6 +237,28 @@ bool EzParserConfig::Initialize(int argc, const char *argv[])
         DESC_OPTIONAL_DEFAULT + DEFAULT_LOGPATH ).c_str(), OPTNAME_LOGPATH);
     _optParser.add(DEFAULT_DBPATH.c_str(), false, 1, 0, ( "Path to db file. " +
         DESC_OPTIONAL_DEFAULT + DEFAULT_DBPATH ).c_str(), OPTNAME_DBPATH);
+    _optParser.add(DBENGINE_SPATIALITE.c_str(), false, 1, 0, ( "Storage engine of the node map, either '" +
+        DBENGINE_SPATIALITE + "' to query the db file or '" + DBENGINE_INMEMORY + "' to serve queries "
+        "from memory and write the db file in the background. " +
+        DESC_OPTIONAL_DEFAULT + DBENGINE_SPATIALITE ).c_str(), OPTNAME_DBENGINE);
+    _optParser.add(DEFAULT_NOTIFICATION_DELAY_MS.c_str(), false, 1, 0, ( "Milliseconds to collect neighbourhood "
+        "changes for local services to be sent in a single notification. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_NOTIFICATION_DELAY_MS ).c_str(), OPTNAME_NOTIFY_DELAY);
+    _optParser.add(DEFAULT_NOTIFICATION_BATCH_SIZE.c_str(), false, 1, 0, ( "Maximum number of neighbourhood "
+        "changes sent in a single notification. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_NOTIFICATION_BATCH_SIZE ).c_str(), OPTNAME_NOTIFY_BATCH);
+    _optParser.add(DEFAULT_DISCOVERY_CONCURRENCY.c_str(), false, 1, 0, ( "Maximum number of nodes "
+        "contacted in parallel while discovering the network or renewing relations. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_DISCOVERY_CONCURRENCY ).c_str(), OPTNAME_CONNECTIONS);
+    _optParser.add(DEFAULT_NETWORK_TIMEOUT_SECS.c_str(), false, 1, 0, ( "Seconds to wait for connecting to "
+        "another node, sending or receiving a message before giving up. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_NETWORK_TIMEOUT_SECS ).c_str(), OPTNAME_TIMEOUT);
+    _optParser.add(DEFAULT_RENEWAL_MARGIN_SECS.c_str(), false, 1, 0, ( "Seconds before expiration "
+        "to renew relations with other nodes. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_RENEWAL_MARGIN_SECS ).c_str(), OPTNAME_RENEW_MARGIN);
+    _optParser.add(DEFAULT_RENEWALS_PER_SECOND.c_str(), false, 1, 0, ( "Maximum number of relations "
+        "renewed per second. " +
+        DESC_OPTIONAL_DEFAULT + DEFAULT_RENEWALS_PER_SECOND ).c_str(), OPTNAME_RENEW_RATE);
     
     // Perform parsing, first from command line ...
     _optParser.parse(argc, argv);
@@ -274,6 +310,57 @@ bool EzParserConfig::Initialize(int argc, const char *argv[])
     _optParser.get(OPTNAME_LOGPATH)->getString(_logPath);
     _optParser.get(OPTNAME_DBPATH)->getString(_dbPath);
     
+    string dbEngine;
+    _optParser.get(OPTNAME_DBENGINE)->getString(dbEngine);
+    if (dbEngine == DBENGINE_SPATIALITE)
+        { _dbEngine = DatabaseEngine::SpatiaLite; }
+    else if (dbEngine == DBENGINE_INMEMORY)
+        { _dbEngine = DatabaseEngine::InMemory; }
+    else
+    {
+        cerr << "Unknown database engine " << dbEngine << endl;
+        return false;
+    }
+    
+    unsigned long notificationDelayMs;
+    _optParser.get(OPTNAME_NOTIFY_DELAY)->getULong(notificationDelayMs);
+    _notificationDelay = chrono::milliseconds(notificationDelayMs);
+    
+    unsigned long notificationBatchSize;
+    _optParser.get(OPTNAME_NOTIFY_BATCH)->getULong(notificationBatchSize);
+    _notificationBatchSize = notificationBatchSize;
+    
+    unsigned long discoveryConcurrency;
+    _optParser.get(OPTNAME_CONNECTIONS)->getULong(discoveryConcurrency);
+    if (discoveryConcurrency == 0)
+    {
+        cerr << "Number of parallel connections must be positive" << endl;
+        return false;
+    }
+    _discoveryConcurrency = discoveryConcurrency;
+    
+    unsigned long networkTimeoutSecs;
+    _optParser.get(OPTNAME_TIMEOUT)->getULong(networkTimeoutSecs);
+    _networkTimeout = chrono::seconds(networkTimeoutSecs);
+    
+    unsigned long renewalMarginSecs;
+    _optParser.get(OPTNAME_RENEW_MARGIN)->getULong(renewalMarginSecs);
+    _renewalMargin = chrono::seconds(renewalMarginSecs);
+    if ( _renewalMargin >= _dbExpirationPeriod )
+    {
+        cerr << "Renewal margin must be shorter than the expiration period" << endl;
+        return false;
+    }
+    
+    unsigned long renewalsPerSecond;
+    _optParser.get(OPTNAME_RENEW_RATE)->getULong(renewalsPerSecond);
+    if (renewalsPerSecond == 0)
+    {
+        cerr << "Renewal rate must be positive" << endl;
+        return false;
+    }
+    _renewalsPerSecond = renewalsPerSecond;
+    
     unsigned long nodePort;
     _optParser.get(OPTNAME_NODE_PORT)->getULong(nodePort);
     _nodePort = nodePort;
@@ -314,6 +401,9 @@ const string& EzParserConfig::logPath() const
 const string& EzParserConfig::dbPath() const
     { return _dbPath; }
 
+DatabaseEngine EzParserConfig::dbEngine() const
+    { return _dbEngine; }
+
 const NodeInfo& EzParserConfig::myNodeInfo() const
     { return *_myNodeInfo; }
 
@@ -332,5 +422,23 @@ chrono::duration<uint32_t> EzParserConfig::dbExpirationPeriod() const
 chrono::duration<uint32_t> EzParserConfig::discoveryPeriod() const
     { return isTestMode() ? chrono::duration<uint32_t>(chrono::seconds(15)) : _discoveryPeriod; }
 
+chrono::milliseconds EzParserConfig::notificationDelay() const
+    { return _notificationDelay; }
+
+size_t EzParserConfig::notificationBatchSize() const
+    { return _notificationBatchSize; }
+
+size_t EzParserConfig::discoveryConcurrency() const
+    { return _discoveryConcurrency; }
+
+chrono::duration<uint32_t> EzParserConfig::networkTimeout() const
+    { return _networkTimeout; }
+
+chrono::duration<uint32_t> EzParserConfig::renewalMargin() const
+    { return isTestMode() ? chrono::duration<uint32_t>(chrono::seconds(60)) : _renewalMargin; }
+
+size_t EzParserConfig::renewalsPerSecond() const
+    { return _renewalsPerSecond; }
+
 
 }
\ No newline at end of file
@@ -13,6 +13,15 @@ namespace LocNet
 
 
 
+// Storage engine of the node map
+enum class DatabaseEngine : uint8_t
+{
+    SpatiaLite  = 1, // Queries are served by SpatiaLite from the database file
+    InMemory    = 2, // Queries are served from memory, changes are written to the database file in the background
+};
+
+
+
 // Abstract base class for project configuration.
 // Built with the singleton pattern.
 class Config
@@ -53,9 +62,23 @@ public:
     
     virtual const std::string& logPath() const = 0;
     virtual const std::string& dbPath() const = 0;
+    virtual DatabaseEngine dbEngine() const = 0;
     virtual std::chrono::duration<uint32_t> dbMaintenancePeriod() const = 0;
     virtual std::chrono::duration<uint32_t> dbExpirationPeriod() const = 0;
     virtual std::chrono::duration<uint32_t> discoveryPeriod() const = 0;
+    
+    // Neighbourhood changes are collected at most for this delay to be sent in a single notification
+    virtual std::chrono::milliseconds notificationDelay() const = 0;
+    virtual size_t notificationBatchSize() const = 0;
+    
+    // Number of nodes contacted in parallel while discovering the network or renewing relations
+    virtual size_t discoveryConcurrency() const = 0;
+    // Connecting to a node, sending or receiving a message fails if not completed in this period
+    virtual std::chrono::duration<uint32_t> networkTimeout() const = 0;
+    
+    // Relations are renewed this period before they would expire, at most at the given rate
+    virtual std::chrono::duration<uint32_t> renewalMargin() const = 0;
+    virtual size_t renewalsPerSecond() const = 0;
 };
 
 
@@ -78,6 +101,13 @@ class EzParserConfig : public Config
     GpsCoordinate   _longitude;
     std::string     _logPath;
     std::string     _dbPath;
+    DatabaseEngine  _dbEngine;
+    std::chrono::milliseconds _notificationDelay;
+    size_t          _notificationBatchSize;
+    size_t          _discoveryConcurrency;
+    std::chrono::duration<uint32_t> _networkTimeout;
+    std::chrono::duration<uint32_t> _renewalMargin;
+    size_t          _renewalsPerSecond;
     std::vector<NetworkEndpoint> _seedNodes;
     
     std::unique_ptr<NodeInfo> _myNodeInfo;
@@ -94,9 +124,16 @@ public:
     
     const std::string& logPath() const override;
     const std::string& dbPath() const override;
+    DatabaseEngine dbEngine() const override;
     std::chrono::duration<uint32_t> dbMaintenancePeriod() const override;
     std::chrono::duration<uint32_t> dbExpirationPeriod() const override;
     std::chrono::duration<uint32_t> discoveryPeriod() const override;
+    std::chrono::milliseconds notificationDelay() const override;
+    size_t notificationBatchSize() const override;
+    size_t discoveryConcurrency() const override;
+    std::chrono::duration<uint32_t> networkTimeout() const override;
+    std::chrono::duration<uint32_t> renewalMargin() const override;
+    size_t renewalsPerSecond() const override;
 };
 
 
@@ -0,0 +1,145 @@
+#include <cmath>
+
+#include "geodesy.hpp"
+
+using namespace std;
+
+
+
+namespace LocNet
+{
+
+
+static const double DEGREE_TO_RADIAN     = M_PI / 180.;
+
+static const double MEAN_EARTH_RADIUS_KM = 6371.0088;
+
+// WGS84 ellipsoid parameters, same as used by SpatiaLite
+static const double WGS84_MAJOR_AXIS_KM  = 6378.137;
+static const double WGS84_FLATTENING     = 1 / 298.257223563;
+static const double WGS84_MINOR_AXIS_KM  = WGS84_MAJOR_AXIS_KM * (1 - WGS84_FLATTENING);
+
+static const size_t VINCENTY_MAX_ITERATIONS = 100;
+static const double VINCENTY_PRECISION      = 1e-12;
+
+
+
+// Terms depending only on the starting point, reused by batch calculations
+struct GeodesicOrigin
+{
+    double latitude;
+    double longitude;
+    double cosLatitude;
+    double sinReducedLatitude;
+    double cosReducedLatitude;
+
+    GeodesicOrigin(const GpsLocation &location) :
+        latitude ( location.latitude()  * DEGREE_TO_RADIAN ),
+        longitude( location.longitude() * DEGREE_TO_RADIAN ),
+        cosLatitude( cos(latitude) )
+    {
+        double reducedLatitude = atan( (1 - WGS84_FLATTENING) * tan(latitude) );
+        sinReducedLatitude = sin(reducedLatitude);
+        cosReducedLatitude = cos(reducedLatitude);
+    }
+};
+
+
+
+double HaversineDistanceKm(const GeodesicOrigin &from, const GpsLocation &to)
+{
+    double latitude  = to.latitude()  * DEGREE_TO_RADIAN;
+    double longitude = to.longitude() * DEGREE_TO_RADIAN;
+
+    double sinHalfDeltaLat = sin( (latitude  - from.latitude)  / 2 );
+    double sinHalfDeltaLon = sin( (longitude - from.longitude) / 2 );
+    double a = sinHalfDeltaLat * sinHalfDeltaLat +
+        from.cosLatitude * cos(latitude) * sinHalfDeltaLon * sinHalfDeltaLon;
+    return 2 * MEAN_EARTH_RADIUS_KM * atan2( sqrt(a), sqrt(1 - a) );
+}
+
+
+
+// See https://en.wikipedia.org/wiki/Vincenty%27s_formulae for the inverse problem
+double VincentyDistanceKm(const GeodesicOrigin &from, const GpsLocation &to)
+{
+    const double f = WGS84_FLATTENING;
+
+    double reducedLatitude = atan( (1 - f) * tan( to.latitude() * DEGREE_TO_RADIAN ) );
+    double sinU1 = from.sinReducedLatitude;
+    double cosU1 = from.cosReducedLatitude;
+    double sinU2 = sin(reducedLatitude);
+    double cosU2 = cos(reducedLatitude);
+
+    double deltaLon = to.longitude() * DEGREE_TO_RADIAN - from.longitude;
+    double lambda = deltaLon;
+    double sinSigma, cosSigma, sigma, cosSqAlpha, cos2SigmaM;
+    for (size_t iteration = 0; ; ++iteration)
+    {
+        if (iteration >= VINCENTY_MAX_ITERATIONS)
+            { return HaversineDistanceKm(from, to); }
+
+        double sinLambda = sin(lambda);
+        double cosLambda = cos(lambda);
+        double crossTerm = cosU1 * sinU2 - sinU1 * cosU2 * cosLambda;
+        sinSigma = sqrt( cosU2 * sinLambda * cosU2 * sinLambda + crossTerm * crossTerm );
+        if (sinSigma == 0)
+            { return 0; } // coincident points
+
+        cosSigma = sinU1 * sinU2 + cosU1 * cosU2 * cosLambda;
+        sigma = atan2(sinSigma, cosSigma);
+        double sinAlpha = cosU1 * cosU2 * sinLambda / sinSigma;
+        cosSqAlpha = 1 - sinAlpha * sinAlpha;
+        // NOTE cosSqAlpha is zero for points on the equator
+        cos2SigmaM = cosSqAlpha != 0 ? cosSigma - 2 * sinU1 * sinU2 / cosSqAlpha : 0;
+
+        double C = f / 16 * cosSqAlpha * ( 4 + f * (4 - 3 * cosSqAlpha) );
+        double previousLambda = lambda;
+        lambda = deltaLon + (1 - C) * f * sinAlpha * ( sigma + C * sinSigma *
+            ( cos2SigmaM + C * cosSigma * (-1 + 2 * cos2SigmaM * cos2SigmaM) ) );
+        if ( fabs(lambda - previousLambda) < VINCENTY_PRECISION )
+            { break; }
+    }
+
+    const double a = WGS84_MAJOR_AXIS_KM;
+    const double b = WGS84_MINOR_AXIS_KM;
+    double uSq = cosSqAlpha * (a * a - b * b) / (b * b);
+    double A = 1 + uSq / 16384 * ( 4096 + uSq * ( -768 + uSq * (320 - 175 * uSq) ) );
+    double B = uSq / 1024 * ( 256 + uSq * ( -128 + uSq * (74 - 47 * uSq) ) );
+    double deltaSigma = B * sinSigma * ( cos2SigmaM + B / 4 *
+        ( cosSigma * (-1 + 2 * cos2SigmaM * cos2SigmaM) -
+          B / 6 * cos2SigmaM * (-3 + 4 * sinSigma * sinSigma) * (-3 + 4 * cos2SigmaM * cos2SigmaM) ) );
+    return b * A * (sigma - deltaSigma);
+}
+
+
+
+double DistanceKm(const GeodesicOrigin &from, const GpsLocation &to, GeodesicModel model)
+{
+    switch (model)
+    {
+        case GeodesicModel::Spherical:   return HaversineDistanceKm(from, to);
+        case GeodesicModel::Ellipsoidal: return VincentyDistanceKm(from, to);
+        default: throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Unknown geodesic model");
+    }
+}
+
+
+
+Distance GeodesicDistanceKm(const GpsLocation &one, const GpsLocation &other, GeodesicModel model)
+    { return DistanceKm( GeodesicOrigin(one), other, model ); }
+
+
+
+vector<Distance> GeodesicDistancesKm(const GpsLocation &from, const vector<GpsLocation> &to, GeodesicModel model)
+{
+    GeodesicOrigin origin(from);
+    vector<Distance> result;
+    result.reserve( to.size() );
+    for (const auto &location : to)
+        { result.push_back( DistanceKm(origin, location, model) ); }
+    return result;
+}
+
+
+} // namespace LocNet
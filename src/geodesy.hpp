@@ -0,0 +1,41 @@
+#ifndef __LOCNET_GEODESY_H__
+#define __LOCNET_GEODESY_H__
+
+#include <vector>
+
+#include "basic.hpp"
+
+
+
+namespace LocNet
+{
+
+
+// Earth models available for distance calculations
+enum class GeodesicModel : uint8_t
+{
+    // Great-circle distance on a sphere of the mean Earth radius using the haversine formula.
+    // Cheap, but differs from the ellipsoidal distance by up to 0.6%.
+    Spherical   = 1,
+    // Geodesic distance on the WGS84 ellipsoid using Vincenty's inverse formula.
+    // This is the same calculation as SpatiaLite's Distance(one, other, 1), results agree within 1 meter.
+    Ellipsoidal = 2,
+};
+
+
+// Distance calculations done natively without touching the database.
+// NOTE Vincenty's iteration does not converge for nearly antipodal points
+//      (where SpatiaLite returns NULL), the spherical distance is returned for those instead.
+Distance GeodesicDistanceKm( const GpsLocation &one, const GpsLocation &other,
+                             GeodesicModel model = GeodesicModel::Ellipsoidal );
+
+// Batch variant measuring distances of many points from the same origin.
+// Terms depending only on the origin are calculated only once.
+std::vector<Distance> GeodesicDistancesKm( const GpsLocation &from, const std::vector<GpsLocation> &to,
+                                           GeodesicModel model = GeodesicModel::Ellipsoidal );
+
+
+} // namespace LocNet
+
+
+#endif // __LOCNET_GEODESY_H__
@@ -1,13 +1,18 @@
 #include <algorithm>
 #include <cmath>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <limits>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <unordered_set>
 
 #include <easylogging++.h>
 
 #include "config.hpp"
+#include "geodesy.hpp"
 #include "locnet.hpp"
 
 using namespace std;
@@ -23,6 +28,64 @@ const size_t   INIT_NEIGHBOURHOOD_QUERY_NODE_COUNT  = 10;
 
 const size_t   PERIODIC_DISCOVERY_ATTEMPT_COUNT     = 5;
 
+// Changes of this node arriving within this period are sent to neighbours in a single renewal
+const chrono::milliseconds NEIGHBOUR_RENEWAL_COALESCE_PERIOD = chrono::milliseconds(500);
+
+// Number of parallel requests, delay before asking the next candidate and limit of all requests
+// including slow ones while looking up closest nodes
+const size_t   NEIGHBOURHOOD_LOOKUP_PARALLELISM     = 3;
+const chrono::milliseconds NEIGHBOURHOOD_LOOKUP_HEDGE_DELAY = chrono::milliseconds(500);
+const size_t   NEIGHBOURHOOD_LOOKUP_MAX_IN_FLIGHT   = 2 * NEIGHBOURHOOD_LOOKUP_PARALLELISM;
+
+// Part of the renewal margin used to randomly bring renewals forward
+const float    RENEWAL_JITTER_RATE                  = 0.25;
+// The renewal schedule is reloaded from the database this many times during a renewal margin
+const size_t   RENEWAL_REFRESH_DIVISOR              = 4;
+
+// Delay before contacting the next seed while previous ones have not answered yet
+const chrono::milliseconds SEED_RACE_STAGGER_PERIOD = chrono::milliseconds(250);
+
+
+
+AbortSignal::AbortSignal() :
+    _mutex(), _raised(false), _nextHandlerId(1), _handlers() {}
+
+
+bool AbortSignal::raised() const
+{
+    lock_guard<mutex> guard(_mutex);
+    return _raised;
+}
+
+
+void AbortSignal::Raise()
+{
+    lock_guard<mutex> guard(_mutex);
+    if (_raised)
+        { return; }
+    _raised = true;
+    for (const auto &handler : _handlers)
+        { handler.second(); }
+}
+
+
+size_t AbortSignal::AddHandler(function<void()> handler)
+{
+    lock_guard<mutex> guard(_mutex);
+    if (_raised)
+        { handler(); }
+    size_t handlerId = _nextHandlerId++;
+    _handlers.emplace( handlerId, move(handler) );
+    return handlerId;
+}
+
+
+void AbortSignal::RemoveHandler(size_t handlerId)
+{
+    lock_guard<mutex> guard(_mutex);
+    _handlers.erase(handlerId);
+}
+
 
 
 random_device Node::_randomDevice;
@@ -30,7 +93,9 @@ random_device Node::_randomDevice;
 
 Node::Node( shared_ptr<ISpatialDatabase> spatialDb,
             std::shared_ptr<INodeConnectionFactory> connectionFactory) :
-    _spatialDb(spatialDb), _connectionFactory(connectionFactory)
+    _spatialDb(spatialDb), _connectionFactory(connectionFactory),
+    _admissionMutex(), _pendingColleagues(), _pendingNeighbours(), _neighbourRenewalMutex(), _neighbourRenewalRequested(),
+    _neighbourRenewalPending(false), _shutdownRequested(false), _neighbourRenewalThread()
 {
     if (_spatialDb == nullptr) {
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No spatial database instantiated");
@@ -41,6 +106,18 @@ Node::Node( shared_ptr<ISpatialDatabase> spatialDb,
 }
 
 
+Node::~Node()
+{
+    {
+        lock_guard<mutex> renewalGuard(_neighbourRenewalMutex);
+        _shutdownRequested = true;
+    }
+    _neighbourRenewalRequested.notify_all();
+    if ( _neighbourRenewalThread.joinable() )
+        { _neighbourRenewalThread.join(); }
+}
+
+
 void Node::EnsureMapFilled()
 {
     const vector<NetworkEndpoint> &seedNodes = Config::Instance().seedNodes();
@@ -48,7 +125,10 @@ void Node::EnsureMapFilled()
     {
         LOG(INFO) << "Map is empty, discovering the network";
         
+        auto bootstrapStarted = chrono::steady_clock::now();
         bool discoverySucceeded = InitializeWorld(seedNodes) && InitializeNeighbourhood();
+        LOG(INFO) << "Network discovery took " << chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - bootstrapStarted ).count() << " ms, node count is " << GetNodeCount();
         if (! discoverySucceeded)
             { LOG(WARNING) << "Failed to properly discover the full network, current node count is " << GetNodeCount(); }
         if ( GetNodeCount() <= 1 )
@@ -79,10 +159,12 @@ GpsLocation Node::RegisterService(const ServiceInfo& serviceInfo)
 //     }
     
     NodeDbEntry entry = _spatialDb->ThisNode();
-    entry.services()[ serviceInfo.type() ] = serviceInfo;
+    NodeInfo::Services services = entry.services();
+    services.set(serviceInfo);
+    entry.services(services);
     _spatialDb->Update(entry);
     
-    RenewNeighbours();
+    ScheduleNeighbourRenewal();
     return GetNodeInfo().location();
 }
 
@@ -95,10 +177,47 @@ void Node::DeregisterService(ServiceType serviceType)
 //     }
     
     NodeDbEntry entry = _spatialDb->ThisNode();
-    entry.services().erase(serviceType);
+    NodeInfo::Services services = entry.services();
+    services.erase(serviceType);
+    entry.services(services);
     _spatialDb->Update(entry);
     
-    RenewNeighbours();
+    ScheduleNeighbourRenewal();
+}
+
+
+// NOTE renewal would block the response to the local service until all neighbours are contacted,
+//      so it's done by a background thread, started on first use. Requests arriving while waiting
+//      are coalesced into a single renewal, requests arriving while renewing trigger another one.
+void Node::ScheduleNeighbourRenewal()
+{
+    lock_guard<mutex> renewalGuard(_neighbourRenewalMutex);
+    _neighbourRenewalPending = true;
+    if ( _neighbourRenewalThread.joinable() )
+    {
+        _neighbourRenewalRequested.notify_all();
+        return;
+    }
+    
+    _neighbourRenewalThread = thread( [this]
+    {
+        unique_lock<mutex> renewalLock(_neighbourRenewalMutex);
+        while (true)
+        {
+            _neighbourRenewalRequested.wait( renewalLock,
+                [this] { return _neighbourRenewalPending || _shutdownRequested; } );
+            if ( _neighbourRenewalRequested.wait_for( renewalLock, NEIGHBOUR_RENEWAL_COALESCE_PERIOD,
+                    [this] { return _shutdownRequested; } ) )
+                { return; }
+            
+            _neighbourRenewalPending = false;
+            renewalLock.unlock();
+            try { RenewNeighbours(); }
+            catch (exception &e)
+                { LOG(WARNING) << "Failed to renew neighbours: " << e.what(); }
+            renewalLock.lock();
+        }
+    } );
 }
 
 
@@ -110,13 +229,15 @@ void Node::RemoveListener(const SessionId &sessionId)
 
 
 
-void Node::DetectedExternalAddress(const Address& address)
+void Node::DetectedExternalAddress(const IpAddress& address)
 {
     NodeDbEntry myEntry = _spatialDb->ThisNode();
-    if ( myEntry.contact().address() != address && ! address.empty() )
+    if ( myEntry.contact().ipAddress() != address && ! address.empty() )
     {
         LOG(INFO) << "Detected external IP address " << address;
-        myEntry.contact().address(address);
+        NodeContact contact = myEntry.contact();
+        contact.address(address);
+        myEntry.contact(contact);
         _spatialDb->Update(myEntry);
         
         // TODO normally we should immediately start distributing updated node info,
@@ -214,7 +335,7 @@ vector<NodeInfo> Node::GetClosestNodesByDistance(const GpsLocation& location,
 
 Distance Node::GetBubbleSize(const GpsLocation& location) const
 {
-    Distance distance = _spatialDb->GetDistanceKm( _spatialDb->ThisNode().location(), location );
+    Distance distance = GeodesicDistanceKm( _spatialDb->ThisNode().location(), location );
     Distance bubbleSize = log10(distance + 2500.) * 501. - 1700.;
     return bubbleSize;
 }
@@ -240,23 +361,52 @@ bool Node::BubbleOverlaps(const GpsLocation& newNodeLocation, const string &node
     Distance newNodeBubbleSize       = GetBubbleSize(newNodeLocation);
     
     // If sum of bubble sizes greater than distance of points, the bubbles overlap
-    Distance newNodeDistanceFromClosestNode = _spatialDb->GetDistanceKm(newNodeLocation, myClosesNodeLocation);
+    Distance newNodeDistanceFromClosestNode = GeodesicDistanceKm(newNodeLocation, myClosesNodeLocation);
     return myClosestNodeBubbleSize + newNodeBubbleSize > newNodeDistanceFromClosestNode;
 }
 
 
+// NOTE must be called with _admissionMutex locked
+bool Node::PendingBubbleOverlaps(const GpsLocation &newNodeLocation) const
+{
+    Distance newNodeBubbleSize = GetBubbleSize(newNodeLocation);
+    for (const auto &pending : _pendingColleagues)
+    {
+        if ( GetBubbleSize(pending.second) + newNodeBubbleSize >
+             GeodesicDistanceKm(newNodeLocation, pending.second) )
+            { return true; }
+    }
+    return false;
+}
+
+
 
-shared_ptr<INodeMethods> Node::SafeConnectTo(const NetworkEndpoint& endpoint)
+bool Node::IsConnectable(const NetworkEndpoint& endpoint) const
 {
     // There is no point in connecting to ourselves
     if ( endpoint == _spatialDb->ThisNode().contact().nodeEndpoint() ||
          ( endpoint.isLoopback() && ! Config::Instance().isTestMode() ) )
     {
         LOG(TRACE) << "Address " << endpoint << " is self or local, refusing";
-        return shared_ptr<INodeMethods>();
+        return false;
     }
+    return true;
+}
+
+
+shared_ptr<INodeMethods> Node::SafeConnectTo( const NetworkEndpoint& endpoint,
+                                              shared_ptr<AbortSignal> abort, bool *timedOut )
+{
+    if (! IsConnectable(endpoint) )
+        { return shared_ptr<INodeMethods>(); }
     
-    try { return _connectionFactory->ConnectTo(endpoint); }
+    try { return _connectionFactory->ConnectTo(endpoint, abort); }
+    catch (LocationNetworkError &e)
+    {
+        LOG(INFO) << "Failed to connect to " << endpoint << ": " << e.what();
+        if ( timedOut != nullptr && e.code() == ErrorCode::ERROR_TIMEOUT )
+            { *timedOut = true; }
+    }
     catch (exception &e)
         { LOG(INFO) << "Failed to connect to " << endpoint << ": " << e.what(); }
     return shared_ptr<INodeMethods>();
@@ -264,8 +414,12 @@ shared_ptr<INodeMethods> Node::SafeConnectTo(const NetworkEndpoint& endpoint)
 
 
 
-bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethods> nodeConnection)
+bool Node::SafeStoreNode( const NodeDbEntry& plannedEntry, shared_ptr<INodeMethods> nodeConnection,
+                          shared_ptr<AbortSignal> abort, bool *timedOut )
 {
+    if (timedOut != nullptr)
+        { *timedOut = false; }
+    
     try
     {
         NodeDbEntry myNode = _spatialDb->ThisNode();
@@ -280,17 +434,32 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
         }
      
         // Validate if node is acceptable
-        shared_ptr<NodeDbEntry> storedInfo = _spatialDb->Load( plannedEntry.id() );
+        shared_ptr<NodeDbEntry> storedInfo = _spatialDb->Load( plannedEntry.id(), ServiceDetails::Excluded );
         if ( storedInfo && storedInfo->relationType() == NodeRelationType::Self )
         {
             LOG(TRACE) << "Attempt to overwrite self, refusing";
             throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Forbidden operation: must not overwrite self here");
         }
         
+        // Colleague bubbles and neighbour places are reserved until stored
+        // to keep parallel admissions from overlapping or exceeding the neighbour limit
+        unique_ptr<scope_exit> releaseReservation;
+        
         switch ( plannedEntry.relationType() )
         {
             case NodeRelationType::Colleague:
             {
+                lock_guard<mutex> admissionGuard(_admissionMutex);
+                
+                // The same node is being accepted by another thread right now
+                if ( find_if( _pendingColleagues.begin(), _pendingColleagues.end(),
+                        [&plannedEntry] (const pair<NodeId, GpsLocation> &pending)
+                            { return pending.first == plannedEntry.id(); } ) != _pendingColleagues.end() )
+                {
+                    LOG(TRACE) << "Node is already being accepted, refusing colleague";
+                    return false;
+                }
+                
                 if (storedInfo != nullptr)
                 {
                     // Existing colleague info may be upgraded to neighbour but not vica versa
@@ -301,7 +470,8 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
                     }
                     if ( storedInfo->location() != plannedEntry.location() ) {
                         // Node must not be moved away to a position that overlaps with anything other than itself
-                        if ( BubbleOverlaps( plannedEntry.location(), plannedEntry.id() ) )
+                        if ( BubbleOverlaps( plannedEntry.location(), plannedEntry.id() ) ||
+                             PendingBubbleOverlaps( plannedEntry.location() ) )
                         {
                             LOG(TRACE) << "Bubble of changed node location would overlap, refusing colleague";
                             return false;
@@ -310,51 +480,96 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
                 }
                 else {
                     // New node must not overlap with other colleagues
-                    if ( BubbleOverlaps( plannedEntry.location() ) )
+                    if ( BubbleOverlaps( plannedEntry.location() ) ||
+                         PendingBubbleOverlaps( plannedEntry.location() ) )
                     {
                         LOG(TRACE) << "Node bubble would overlap, refusing colleague";
                         return false;
                     }
                 }
+                
+                _pendingColleagues.emplace_back( plannedEntry.id(), plannedEntry.location() );
+                NodeId reservedId = plannedEntry.id();
+                releaseReservation.reset( new scope_exit( [this, reservedId]
+                {
+                    lock_guard<mutex> admissionGuard(_admissionMutex);
+                    _pendingColleagues.erase( remove_if( _pendingColleagues.begin(), _pendingColleagues.end(),
+                        [&reservedId] (const pair<NodeId, GpsLocation> &pending)
+                            { return pending.first == reservedId; } ), _pendingColleagues.end() );
+                } ) );
                 break;
             }
             
             case NodeRelationType::Neighbour:
             {
+                // NOTE neighbours are kept ordered by distance in the database, so admission needs only
+                //      a single lookup instead of listing and sorting the whole neighbourhood
                 size_t neighbourhoodTargetSize = Config::Instance().neighbourhoodTargetSize();
-                vector<NodeInfo> neighboursByDistance( GetNeighbourNodesByDistance() );
                 if (storedInfo == nullptr || storedInfo->relationType() == NodeRelationType::Colleague)
                 {
                     // Received a new neighbour request
-                    if ( neighboursByDistance.size() >= neighbourhoodTargetSize )
+                    lock_guard<mutex> admissionGuard(_admissionMutex);
+                    
+                    // The same node is being accepted by another thread right now
+                    if ( find_if( _pendingNeighbours.begin(), _pendingNeighbours.end(),
+                            [&plannedEntry] (const pair<NodeId, GpsLocation> &pending)
+                                { return pending.first == plannedEntry.id(); } ) != _pendingNeighbours.end() )
+                    {
+                        LOG(TRACE) << "Node is already being accepted, refusing neighbour";
+                        return false;
+                    }
+                    
+                    // Neighbours being accepted in parallel and closer than this node take their places first
+                    Distance plannedDistance = GeodesicDistanceKm( myNode.location(), plannedEntry.location() );
+                    size_t pendingCloserCount = count_if( _pendingNeighbours.begin(), _pendingNeighbours.end(),
+                        [&myNode, plannedDistance] (const pair<NodeId, GpsLocation> &pending)
+                            { return GeodesicDistanceKm( myNode.location(), pending.second ) <= plannedDistance; } );
+                    if (pendingCloserCount >= neighbourhoodTargetSize)
+                    {
+                        LOG(TRACE) << neighbourhoodTargetSize << " closer neighbours are being accepted, refusing to add new";
+                        return false;
+                    }
+                    
+                    // NOTE a single lookup, no neighbour at the last free position means the limit is not reached.
+                    //      Checking the count first could race with neighbours expiring meanwhile.
+                    shared_ptr<NodeDbEntry> limitNeighbour = _spatialDb->GetNeighbourByRank(
+                        neighbourhoodTargetSize - 1 - pendingCloserCount );
+                    if (limitNeighbour != nullptr)
                     {
                         // Neighbour limit is exceeded by adding a new neighbour, but if it is closer
                         // than an old neighbour within the limit then we can temporarily break the limit
                         // and will later refuse renewal of the faraway old neighbour to let it expire
-                        const NodeInfo &limitNeighbour = neighboursByDistance[neighbourhoodTargetSize - 1];
                         LOG(TRACE) << "We have reached the neighbour limit " << neighbourhoodTargetSize
-                                   << ", farthest neighbour within limit is " << limitNeighbour;
-                        if ( _spatialDb->GetDistanceKm( myNode.location(), limitNeighbour.location() ) <=
-                             _spatialDb->GetDistanceKm( myNode.location(), plannedEntry.location() ) )
+                                   << ", farthest neighbour within limit is " << *limitNeighbour;
+                        if ( GeodesicDistanceKm( myNode.location(), limitNeighbour->location() ) <= plannedDistance )
                         {
                             LOG(TRACE) << neighbourhoodTargetSize << " closer neighbours found, refusing to add new";
                             return false;
                         }
                     }
+                    
+                    _pendingNeighbours.emplace_back( plannedEntry.id(), plannedEntry.location() );
+                    NodeId reservedId = plannedEntry.id();
+                    releaseReservation.reset( new scope_exit( [this, reservedId]
+                    {
+                        lock_guard<mutex> admissionGuard(_admissionMutex);
+                        _pendingNeighbours.erase( remove_if( _pendingNeighbours.begin(), _pendingNeighbours.end(),
+                            [&reservedId] (const pair<NodeId, GpsLocation> &pending)
+                                { return pending.first == reservedId; } ), _pendingNeighbours.end() );
+                    } ) );
                 }
                 else
                 {
                     // Renewal of an old neighbour
-                    auto neighbourIter = find_if( neighboursByDistance.begin(), neighboursByDistance.end(),
-                        [plannedEntry] (const NodeInfo &neighbour) { return neighbour.id() == plannedEntry.id(); } );
-                    if ( neighbourIter == neighboursByDistance.end() )
+                    size_t neighbourIndex = 0;
+                    try { neighbourIndex = _spatialDb->GetNeighbourRank( plannedEntry.id() ); }
+                    catch (exception&)
                     {
                         LOG(ERROR) << "Implementation problem: stored neighbour is not found in neighbour list";
                         throw LocationNetworkError(ErrorCode::ERROR_CONCEPTUAL, "Please report this to the developers");
                     }
                     // Don't care about location change here. IF moved too far away we will expire it
                     // at the next renewal request when it's at its new place in the neighbour list.
-                    size_t neighbourIndex = distance( neighboursByDistance.begin(), neighbourIter );
                     if (neighbourIndex >= neighbourhoodTargetSize)
                     {
                          LOG(TRACE) << neighbourhoodTargetSize << " neighbours limit reached, refusing to renew neighbour nr. " << neighbourIndex;
@@ -376,7 +591,7 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
         {
             // If no connection argument is specified, try connecting to candidate node
             if (nodeConnection == nullptr)
-                { nodeConnection = SafeConnectTo( plannedEntry.contact().nodeEndpoint() ); }
+                { nodeConnection = SafeConnectTo( plannedEntry.contact().nodeEndpoint(), abort, timedOut ); }
             if (nodeConnection == nullptr)
             {
                 LOG(TRACE) << "Failed to connect to remote node to ask for permission, refusing";
@@ -438,6 +653,12 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
         }
         return true;
     }
+    catch (LocationNetworkError &e)
+    {
+        LOG(ERROR) << "Unexpected error validating and storing node: " << e.what();
+        if ( timedOut != nullptr && e.code() == ErrorCode::ERROR_TIMEOUT )
+            { *timedOut = true; }
+    }
     catch (exception &e)
     {
         LOG(ERROR) << "Unexpected error validating and storing node: " << e.what();
@@ -448,64 +669,170 @@ bool Node::SafeStoreNode(const NodeDbEntry& plannedEntry, shared_ptr<INodeMethod
 
 
 
+struct SeedAnswer
+{
+    NetworkEndpoint                 contact;
+    shared_ptr<INodeMethods>        connection;
+    NodeInfo                        info;
+    size_t                          nodeCount;
+    vector<NodeInfo>                candidates;
+    shared_ptr<AbortSignal>         abort;
+};
+
+
+struct SeedRace
+{
+    mutex                   raceMutex;
+    condition_variable      attemptFinished;
+    size_t                  failedCount = 0;
+    bool                    finished    = false;
+    shared_ptr<SeedAnswer>  winner;
+    shared_ptr<SeedAnswer>  fallback;   // First seed answering without any nodes to start with
+};
+
+
+void Node::RaceSeed( shared_ptr<SeedRace> race, const NetworkEndpoint &seedContact,
+                     size_t randomNodeCount, shared_ptr<AbortSignal> abort )
+{
+    auto abandoned = [&race, &abort]
+    {
+        if ( abort->raised() )
+            { return true; }
+        lock_guard<mutex> raceGuard(race->raceMutex);
+        return race->finished || race->winner;
+    };
+    
+    try
+    {
+        shared_ptr<INodeMethods> seedConnection = SafeConnectTo(seedContact, abort);
+        if (! seedConnection)
+            { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "failed to connect"); }
+        if ( abandoned() )
+            { return; }
+        
+        // Query both total node count and an initial list of random nodes to start with
+        NodeInfo seedInfo = seedConnection->GetNodeInfo();
+        size_t nodeCount = seedConnection->GetNodeCount();
+        LOG(DEBUG) << "Node count on seed " << seedContact << " is " << nodeCount;
+        vector<NodeInfo> candidates;
+        if (! abandoned() )
+            { candidates = seedConnection->GetRandomNodes( min(randomNodeCount, nodeCount), Neighbours::Included ); }
+        
+        shared_ptr<SeedAnswer> answer( new SeedAnswer{
+            seedContact, seedConnection, seedInfo, nodeCount, candidates, abort } );
+        
+        lock_guard<mutex> raceGuard(race->raceMutex);
+        if (race->finished)
+            { return; }
+        
+        // If got a reasonable response from a seed server, stop contacting other seeds
+        if ( nodeCount > 0 && ! candidates.empty() )
+        {
+            if (! race->winner)
+                { race->winner = answer; }
+        }
+        else
+        {
+            if (! race->fallback)
+                { race->fallback = answer; }
+            ++race->failedCount;
+        }
+        race->attemptFinished.notify_all();
+        return;
+    }
+    catch (exception &e)
+    {
+        if ( abort->raised() )
+            { return; }
+        LOG(WARNING) << "Failed to bootstrap from seed node " << seedContact
+                     << ": " << e.what() << ", trying other seeds";
+    }
+    
+    lock_guard<mutex> raceGuard(race->raceMutex);
+    ++race->failedCount;
+    race->attemptFinished.notify_all();
+}
+
+
 bool Node::InitializeWorld(const vector<NetworkEndpoint> &seedNodes)
 {
     LOG(DEBUG) << "Discovering world map for colleagues";
+    auto discoveryStarted = chrono::steady_clock::now();
     const size_t INIT_WORLD_RANDOM_NODE_COUNT = 2 * Config::Instance().neighbourhoodTargetSize();
     
-    // Initialize random generator and utility variables
-    uniform_int_distribution<int> fromRange( 0, seedNodes.size() - 1 );
+    // Contact seeds in random order
+    vector<NetworkEndpoint> shuffledSeeds;
+    for (const auto &seedContact : seedNodes)
+    {
+        if ( IsConnectable(seedContact) )
+            { shuffledSeeds.push_back(seedContact); }
+    }
+    shuffle( shuffledSeeds.begin(), shuffledSeeds.end(), _randomDevice );
+    
+    // NOTE seeds are raced against each other: the next seed is contacted when the previous ones
+    //      failed or did not answer in a short period, and the first good answer is used.
+    //      Slower attempts are aborted and joined before going on with the chosen seed.
+    shared_ptr<SeedRace> race( new SeedRace() );
     vector<NetworkEndpoint> triedNodes;
+    vector<shared_ptr<AbortSignal>> attemptAborts;
+    vector<thread> attemptThreads;
+    scope_exit joinAttempts( [&attemptAborts, &attemptThreads]
+    {
+        for (auto &abort : attemptAborts)
+            { abort->Raise(); }
+        for (auto &attempt : attemptThreads)
+            { attempt.join(); }
+    } );
+    
+    for (const auto &seedContact : shuffledSeeds)
+    {
+        triedNodes.push_back(seedContact);
+        shared_ptr<AbortSignal> abort( new AbortSignal() );
+        attemptAborts.push_back(abort);
+        attemptThreads.emplace_back( [this, race, seedContact, INIT_WORLD_RANDOM_NODE_COUNT, abort]
+            { RaceSeed(race, seedContact, INIT_WORLD_RANDOM_NODE_COUNT, abort); } );
+        
+        unique_lock<mutex> raceLock(race->raceMutex);
+        race->attemptFinished.wait_for( raceLock, SEED_RACE_STAGGER_PERIOD,
+            [&race, &triedNodes] { return race->winner || race->failedCount == triedNodes.size(); } );
+        if (race->winner)
+            { break; }
+    }
+    
+    shared_ptr<SeedAnswer> seedAnswer;
+    {
+        unique_lock<mutex> raceLock(race->raceMutex);
+        race->attemptFinished.wait( raceLock,
+            [&race, &triedNodes] { return race->winner || race->failedCount == triedNodes.size(); } );
+        race->finished = true;
+        seedAnswer = race->winner ? race->winner : race->fallback;
+    }
+    
+    // Stop the losing attempts, but keep the connection of the chosen seed open
+    for (size_t attemptIdx = 0; attemptIdx < attemptThreads.size(); ++attemptIdx)
+    {
+        if ( ! seedAnswer || attemptAborts[attemptIdx] != seedAnswer->abort )
+            { attemptAborts[attemptIdx]->Raise(); }
+        attemptThreads[attemptIdx].join();
+    }
+    attemptThreads.clear();
+    attemptAborts.clear();
     
     size_t nodeCountAtSeed = 0;
     vector<NodeInfo> randomColleagueCandidates;
-    while ( triedNodes.size() < seedNodes.size() )
+    if (seedAnswer)
     {
-        // Select random node from hardwired seed node list
-        // TODO it would be better to create a permutation of the seedNodes vector and just iterate on it
-        size_t selectedSeedNodeIdx = fromRange(_randomDevice);
-        const NetworkEndpoint& selectedSeedContact = seedNodes[selectedSeedNodeIdx];
-                
-        // If node has been already tried and failed, choose another one
-        auto it = find( triedNodes.begin(), triedNodes.end(), selectedSeedContact );
-        if ( it != triedNodes.end() )
-            { continue; }
+        LOG(DEBUG) << "Using seed node " << seedAnswer->contact << " with node count " << seedAnswer->nodeCount;
         
-        try
-        {
-            triedNodes.push_back(selectedSeedContact);
-            
-            // Try connecting to selected seed node
-            shared_ptr<INodeMethods> seedNodeConnection = SafeConnectTo(selectedSeedContact);
-            if (seedNodeConnection == nullptr)
-                { continue; }
-            
-            // Try to add seed node to our network (no matter if fails)
-            NodeInfo seedInfo = seedNodeConnection->GetNodeInfo();
-            SafeStoreNode( NodeDbEntry(seedInfo, NodeRelationType::Colleague, NodeContactRoleType::Initiator),
-                           seedNodeConnection );
-            
-            // Query both total node count and an initial list of random nodes to start with
-            LOG(DEBUG) << "Getting node count from initial seed";
-            nodeCountAtSeed = seedNodeConnection->GetNodeCount();
-            LOG(DEBUG) << "Node count on seed is " << nodeCountAtSeed;
-            randomColleagueCandidates = seedNodeConnection->GetRandomNodes(
-                min(INIT_WORLD_RANDOM_NODE_COUNT, nodeCountAtSeed), Neighbours::Included );
-            
-            // If got a reasonable response from a seed server, stop contacting other seeds
-            if ( nodeCountAtSeed > 0 && ! randomColleagueCandidates.empty() )
-                { break; }
-        }
-        catch (exception &e)
-        {
-            LOG(WARNING) << "Failed to bootstrap from seed node " << selectedSeedContact
-                         << ": " << e.what() << ", trying other seeds";
-        }
+        // Try to add seed node to our network (no matter if fails)
+        SafeStoreNode( NodeDbEntry(seedAnswer->info, NodeRelationType::Colleague, NodeContactRoleType::Initiator),
+                       seedAnswer->connection );
+        nodeCountAtSeed = seedAnswer->nodeCount;
+        randomColleagueCandidates = seedAnswer->candidates;
     }
     
     // Check if all seed nodes tried and failed
-    if ( nodeCountAtSeed == 0 && randomColleagueCandidates.empty() &&
-         triedNodes.size() == seedNodes.size() )
+    if ( nodeCountAtSeed == 0 && randomColleagueCandidates.empty() )
     {
         LOG(ERROR) << "All seed nodes have been tried and failed";
         return false;
@@ -521,17 +848,40 @@ bool Node::InitializeWorld(const vector<NetworkEndpoint> &seedNodes)
     {
         if ( ! randomColleagueCandidates.empty() )
         {
-            // Pick a single node from the candidate list and try to make it a colleague node
-            NodeInfo nodeInfo( randomColleagueCandidates.back() );
-            randomColleagueCandidates.pop_back();
-            
-            // Check if we tried it already
-            if ( find( triedNodes.begin(), triedNodes.end(), nodeInfo.contact().nodeEndpoint() ) != triedNodes.end() )
-                { continue; }
-            
-            triedNodes.push_back( nodeInfo.contact().nodeEndpoint() );
+            // NOTE handshakes mostly wait for the network, so candidates are contacted in parallel
+            //      while the bubble reservations of SafeStoreNode keep admissions consistent
+            mutex candidateMutex;
+            auto pickCandidate = [&] () -> shared_ptr<NodeInfo>
+            {
+                lock_guard<mutex> candidateGuard(candidateMutex);
+                while ( ! randomColleagueCandidates.empty() && GetNodeCount() < targetNodeCount )
+                {
+                    shared_ptr<NodeInfo> candidate( new NodeInfo( randomColleagueCandidates.back() ) );
+                    randomColleagueCandidates.pop_back();
+                    
+                    // Check if we tried it already
+                    if ( find( triedNodes.begin(), triedNodes.end(), candidate->contact().nodeEndpoint() ) != triedNodes.end() )
+                        { continue; }
+                    
+                    triedNodes.push_back( candidate->contact().nodeEndpoint() );
+                    return candidate;
+                }
+                return shared_ptr<NodeInfo>();
+            };
             
-            SafeStoreNode( NodeDbEntry(nodeInfo, NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+            size_t workerCount = min( max<size_t>( Config::Instance().discoveryConcurrency(), 1 ), randomColleagueCandidates.size() );
+            vector<thread> workers;
+            for (size_t workerIdx = 0; workerIdx < workerCount; ++workerIdx)
+            {
+                workers.emplace_back( [this, &pickCandidate]
+                {
+                    // Pick nodes from the candidate list one by one and try to make them colleague nodes
+                    for ( shared_ptr<NodeInfo> candidate = pickCandidate(); candidate; candidate = pickCandidate() )
+                        { SafeStoreNode( NodeDbEntry(*candidate, NodeRelationType::Colleague, NodeContactRoleType::Initiator) ); }
+                } );
+            }
+            for (auto &worker : workers)
+                { worker.join(); }
         }
         else // We ran out of colleague candidates, try pick some more randomly
         {
@@ -562,107 +912,239 @@ bool Node::InitializeWorld(const vector<NetworkEndpoint> &seedNodes)
         }
     }
     
-    LOG(DEBUG) << "World discovery finished with total node count " << GetNodeCount();
+    LOG(INFO) << "World discovery finished with total node count " << GetNodeCount() << " in "
+              << chrono::duration_cast<chrono::milliseconds>( chrono::steady_clock::now() - discoveryStarted ).count() << " ms";
     return true;
 }
 
 
 
-bool Node::InitializeNeighbourhood()
+// Closest nodes to a location found so far by an iterative lookup and the state of requests
+struct ClosestNodeLookup
 {
-    LOG(DEBUG) << "Discovering neighbourhood";
+    NodeId                  myNodeId;
+    GpsLocation             myLocation;
+    
+    mutex                   lookupMutex;
+    condition_variable      answered;
+    bool                    finished = false;
     
+    set<pair<Distance, NodeId>>             ordered;
+    unordered_map<NodeId, NodeInfo>         known;
+    unordered_set<NodeId>                   contacted;
+    unordered_map<NodeId, chrono::steady_clock::time_point> inFlight;
+    
+    ClosestNodeLookup(const NodeId &myNodeId, const GpsLocation &myLocation) :
+        myNodeId(myNodeId), myLocation(myLocation) {}
+    
+    void Add(const NodeInfo &node)
+    {
+        if ( node.id() == myNodeId || known.find( node.id() ) != known.end() )
+            { return; }
+        known.emplace( node.id(), node );
+        ordered.emplace( GeodesicDistanceKm( myLocation, node.location() ), node.id() );
+    }
+};
+
+
+void Node::QueryClosestNodes( shared_ptr<ClosestNodeLookup> lookup, const NodeInfo &node,
+                              shared_ptr<AbortSignal> abort )
+{
+    vector<NodeInfo> closestNodes;
+    try
+    {
+        shared_ptr<INodeMethods> connection = SafeConnectTo( node.contact().nodeEndpoint(), abort );
+        if (! connection)
+            { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "failed to connect"); }
+        closestNodes = connection->GetClosestNodesByDistance( lookup->myLocation,
+            numeric_limits<Distance>::max(), INIT_NEIGHBOURHOOD_QUERY_NODE_COUNT, Neighbours::Included );
+        if ( closestNodes.empty() )
+            { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Node returned empty node list result"); }
+    }
+    catch (exception &e)
+    {
+        if (! abort->raised() )
+            { LOG(WARNING) << "Failed to fetch closest nodes from " << node.id() << ": " << e.what(); }
+    }
+    
+    lock_guard<mutex> lookupGuard(lookup->lookupMutex);
+    lookup->inFlight.erase( node.id() );
+    if (! lookup->finished)
+    {
+        for (const auto &closestNode : closestNodes)
+            { lookup->Add(closestNode); }
+    }
+    lookup->answered.notify_all();
+}
+
+
+vector<NodeInfo> Node::LookupClosestNodes(size_t resultCount)
+{
     NodeDbEntry myNode = _spatialDb->ThisNode();
-    vector<NodeInfo> newClosestNodes = GetClosestNodesByDistance(
-        myNode.location(), numeric_limits<Distance>::max(), 2, Neighbours::Included);
-    if ( newClosestNodes.size() >= 1 && newClosestNodes[0] != GetNodeInfo() )
+    vector<NodeInfo> localClosestNodes = GetClosestNodesByDistance(
+        myNode.location(), numeric_limits<Distance>::max(), resultCount + 1, Neighbours::Included);
+    if ( localClosestNodes.size() >= 1 && localClosestNodes[0] != GetNodeInfo() )
     {
         LOG(ERROR) << "Implementation problem: assumption failed";
         throw LocationNetworkError(ErrorCode::ERROR_CONCEPTUAL, "Please report this to the developers");
     }
-    if ( newClosestNodes.size() < 2 ) // First node is self
+    
+    // NOTE Kademlia-style iterative lookup: the closest nodes known so far are asked for even closer nodes,
+    //      a few of them in parallel, until all the closest ones are asked. A request not answered in
+    //      a short period does not hold up the lookup, the next best candidate is asked instead.
+    //      Requests still running when the lookup finishes are aborted and joined.
+    shared_ptr<ClosestNodeLookup> lookup( new ClosestNodeLookup( myNode.id(), myNode.location() ) );
+    shared_ptr<AbortSignal> lookupAbort( new AbortSignal() );
+    vector<thread> queries;
+    scope_exit joinQueries( [&lookupAbort, &queries]
     {
-        LOG(DEBUG) << "No other nodes are available beyond self, cannot get neighbour candidates";
-        return false;
-    }
+        lookupAbort->Raise();
+        for (auto &query : queries)
+            { query.join(); }
+    } );
     
-    // Repeat asking the currently closest node for an even closer node until no new node discovered
-    NodeInfo newClosestNode = newClosestNodes[1];
-    NodeInfo oldClosestNode = newClosestNode;
-    do {
-        LOG(TRACE) << "Closest node known so far: " << newClosestNode;
-        oldClosestNode = newClosestNode;
-        try
+    vector<NodeInfo> lookupResult;
+    unique_lock<mutex> lookupLock(lookup->lookupMutex);
+    for (const auto &node : localClosestNodes)
+        { lookup->Add(node); }
+    
+    while (true)
+    {
+        auto now = chrono::steady_clock::now();
+        size_t activeCount = count_if( lookup->inFlight.begin(), lookup->inFlight.end(),
+            [now] (const pair<const NodeId, chrono::steady_clock::time_point> &request)
+                { return now - request.second < NEIGHBOURHOOD_LOOKUP_HEDGE_DELAY; } );
+        
+        // Collect closest known nodes not asked yet
+        vector<NodeId> candidateIds;
+        size_t rank = 0;
+        for (const auto &entry : lookup->ordered)
         {
-            shared_ptr<INodeMethods> closestNodeConnection = SafeConnectTo( newClosestNode.contact().nodeEndpoint() );
-            if (closestNodeConnection == nullptr) {
-                // TODO consider what better to do if closest node is not reachable?
-                continue;
-            }
-            
-            newClosestNodes = closestNodeConnection->GetClosestNodesByDistance(
-                myNode.location(), numeric_limits<Distance>::max(), 2, Neighbours::Included);
-            if ( newClosestNodes.empty() )
-                { throw LocationNetworkError(ErrorCode::ERROR_BAD_RESPONSE, "Node returned empty node list result"); }
-                
-            if ( newClosestNodes.front().id() != myNode.id() )
-                { newClosestNode = newClosestNodes[0]; }
-            else if ( newClosestNodes.size() > 1 )
-                { newClosestNode = newClosestNodes[1]; }
+            if (rank++ >= resultCount)
+                { break; }
+            if ( lookup->contacted.find(entry.second) == lookup->contacted.end() )
+                { candidateIds.push_back(entry.second); }
         }
-        catch (exception &e) {
-            LOG(WARNING) << "Failed to fetch neighbours: " << e.what();
-            // TODO consider what else to do here
+        if ( candidateIds.empty() && activeCount == 0 )
+            { break; }
+        
+        for (const auto &candidateId : candidateIds)
+        {
+            // Slow requests are not waited for, but they still count against the total request limit
+            if ( activeCount >= NEIGHBOURHOOD_LOOKUP_PARALLELISM ||
+                 lookup->inFlight.size() >= NEIGHBOURHOOD_LOOKUP_MAX_IN_FLIGHT )
+                { break; }
+            lookup->contacted.insert(candidateId);
+            
+            const NodeInfo &candidate = lookup->known.at(candidateId);
+            if (! IsConnectable( candidate.contact().nodeEndpoint() ) )
+                { continue; }
+            LOG(TRACE) << "Asking node for closer nodes: " << candidate;
+            lookup->inFlight.emplace(candidateId, now);
+            ++activeCount;
+            
+            queries.emplace_back( [this, lookup, candidate, lookupAbort]
+                { QueryClosestNodes(lookup, candidate, lookupAbort); } );
         }
+        
+        lookup->answered.wait_for(lookupLock, NEIGHBOURHOOD_LOOKUP_HEDGE_DELAY);
     }
-    while ( oldClosestNode.id() != newClosestNode.id() );
     
-    deque<NodeInfo> nodesToAskQueue{newClosestNode};
-    unordered_set<string> askedNodeIds;
+    lookup->finished = true;
+    for (const auto &entry : lookup->ordered)
+    {
+        if ( lookupResult.size() >= resultCount )
+            { break; }
+        lookupResult.push_back( lookup->known.at(entry.second) );
+    }
+    lookupLock.unlock();
+    return lookupResult;
+}
+
+
+bool Node::InitializeNeighbourhood()
+{
+    LOG(DEBUG) << "Discovering neighbourhood";
     
-    // Try to fill neighbourhood map until limit reached or no new nodes left to ask
-    vector<NodeInfo> neighbourCandidates;
-    while ( neighbourCandidates.size() < Config::Instance().neighbourhoodTargetSize() &&
-            ! nodesToAskQueue.empty() )
+    NodeDbEntry myNode = _spatialDb->ThisNode();
+    vector<NodeInfo> lookupResult = LookupClosestNodes( Config::Instance().neighbourhoodTargetSize() );
+    if ( lookupResult.empty() )
     {
-        // Get next candidate
-        NodeInfo neighbourCandidate = nodesToAskQueue.front();
-        nodesToAskQueue.pop_front();
-        
-        // Skip it if has been processed already
-        auto askedIt = find( askedNodeIds.begin(), askedNodeIds.end(), neighbourCandidate.id() );
-        if ( askedIt != askedNodeIds.end() )
-            { continue; }
-            
-        try
+        LOG(DEBUG) << "No other nodes are available beyond self, cannot get neighbour candidates";
+        return false;
+    }
+    LOG(TRACE) << "Closest node found: " << lookupResult.front();
+    
+    // Try to fill neighbourhood map starting from the closest nodes until no new nodes left to ask
+    mutex queueMutex;
+    condition_variable queueChanged;
+    deque<NodeInfo> nodesToAskQueue( lookupResult.begin(), lookupResult.end() );
+    unordered_set<NodeId> queuedNodeIds{ myNode.id() };
+    for (const auto &node : lookupResult)
+        { queuedNodeIds.insert( node.id() ); }
+    size_t busyWorkerCount = 0;
+    
+    auto askNodes = [&] ()
+    {
+        unique_lock<mutex> queueLock(queueMutex);
+        while (true)
         {
-            // Try connecting to the node
-            shared_ptr<INodeMethods> candidateConnection = SafeConnectTo( neighbourCandidate.contact().nodeEndpoint() );
-            if (candidateConnection == nullptr)
-                { continue; }
-                
-            // Try to add node as neighbour, reusing connection
-            SafeStoreNode( NodeDbEntry(neighbourCandidate, NodeRelationType::Neighbour, NodeContactRoleType::Initiator),
-                           candidateConnection );
+            queueChanged.wait( queueLock, [&] { return ! nodesToAskQueue.empty() || busyWorkerCount == 0; } );
+            if ( nodesToAskQueue.empty() )
+            {
+                queueChanged.notify_all();
+                return;
+            }
             
-            // Get its neighbours closest to us
-            vector<NodeInfo> newNeighbourCandidates = candidateConnection->GetClosestNodesByDistance(
-                myNode.location(), numeric_limits<Distance>::max(),
-                INIT_NEIGHBOURHOOD_QUERY_NODE_COUNT, Neighbours::Included );
+            // Get next candidate
+            NodeInfo neighbourCandidate = nodesToAskQueue.front();
+            nodesToAskQueue.pop_front();
+            ++busyWorkerCount;
+            queueLock.unlock();
             
-            // Mark current node as processed and append its new neighbours to our todo list
-            askedNodeIds.insert( neighbourCandidate.id() );
-            nodesToAskQueue.insert( nodesToAskQueue.end(),
-                newNeighbourCandidates.begin(), newNeighbourCandidates.end() );
-        }
-        catch (exception &e) {
-            LOG(WARNING) << "Failed to add neighbour node: " << e.what();
-            // TODO consider what else to do here?
+            vector<NodeInfo> newNeighbourCandidates;
+            try
+            {
+                // Try connecting to the node
+                shared_ptr<INodeMethods> candidateConnection = SafeConnectTo( neighbourCandidate.contact().nodeEndpoint() );
+                if (candidateConnection != nullptr)
+                {
+                    // Try to add node as neighbour, reusing connection
+                    SafeStoreNode( NodeDbEntry(neighbourCandidate, NodeRelationType::Neighbour, NodeContactRoleType::Initiator),
+                                   candidateConnection );
+                    
+                    // Get its neighbours closest to us
+                    newNeighbourCandidates = candidateConnection->GetClosestNodesByDistance(
+                        myNode.location(), numeric_limits<Distance>::max(),
+                        INIT_NEIGHBOURHOOD_QUERY_NODE_COUNT, Neighbours::Included );
+                }
+            }
+            catch (exception &e) {
+                LOG(WARNING) << "Failed to add neighbour node: " << e.what();
+                // TODO consider what else to do here?
+            }
+            
+            // Append new nodes to our todo list
+            queueLock.lock();
+            for (const auto &newCandidate : newNeighbourCandidates)
+            {
+                if ( queuedNodeIds.insert( newCandidate.id() ).second )
+                    { nodesToAskQueue.push_back(newCandidate); }
+            }
+            --busyWorkerCount;
+            queueChanged.notify_all();
         }
-    }
+    };
+    
+    size_t workerCount = max<size_t>( Config::Instance().discoveryConcurrency(), 1 );
+    vector<thread> workers;
+    for (size_t workerIdx = 0; workerIdx < workerCount; ++workerIdx)
+        { workers.emplace_back(askNodes); }
+    for (auto &worker : workers)
+        { worker.join(); }
     
     LOG(DEBUG) << "Neighbourhood discovery finished with total node count " << GetNodeCount()
-               << ", neighbourhood size is " << _spatialDb->GetNeighbourNodesByDistance().size();
+               << ", neighbourhood size is " << _spatialDb->GetNodeCount(NodeRelationType::Neighbour);
     return true;
 }
 
@@ -677,23 +1159,114 @@ void Node::ExpireOldNodes()
 
 
 
-void Node::RenewNodeRelations()
+RelationRenewalStats Node::RenewNodeRelations()
+    { return RenewNodeRelations( _spatialDb->GetNodes(NodeContactRoleType::Initiator) ); }
+
+
+RelationRenewalStats Node::RenewNodeRelations(const vector<NodeDbEntry> &nodesToContact)
 {
-    vector<NodeDbEntry> nodesToContact( _spatialDb->GetNodes(NodeContactRoleType::Initiator) );
+    return RenewNodeRelations( nodesToContact,
+        chrono::duration_cast<chrono::milliseconds>( Config::Instance().dbMaintenancePeriod() ) );
+}
+
+
+RelationRenewalStats Node::RenewNodeRelations( const vector<NodeDbEntry> &nodesToContact,
+                                               chrono::milliseconds cycleLimit )
+{
+    auto cycleStarted = chrono::steady_clock::now();
+    auto cycleDeadline = cycleStarted + cycleLimit;
+    
     LOG(DEBUG) << "We have " << nodesToContact.size() << " relations to renew";
-    for (auto const &node : nodesToContact)
+    
+    // NOTE renewals mostly wait for remote nodes, so they are run by a bounded pool of workers.
+    //      Nodes not contacted before the next maintenance cycle is due are left for that cycle,
+    //      renewals still in progress at that time are aborted.
+    RelationRenewalStats stats;
+    mutex statsMutex;
+    condition_variable workerFinished;
+    size_t nextNodeIdx = 0;
+    size_t runningWorkerCount = 0;
+    shared_ptr<AbortSignal> cycleAbort( new AbortSignal() );
+    auto renewNodes = [&] ()
     {
-        try
+        scope_exit workerDone( [&]
         {
-            bool renewed = SafeStoreNode(node);
-            LOG(DEBUG) << "Attempted renewing relation with node " << node.id() << ", result: " << renewed;
+            lock_guard<mutex> statsGuard(statsMutex);
+            --runningWorkerCount;
+            workerFinished.notify_all();
+        } );
+        
+        while (true)
+        {
+            size_t nodeIdx;
+            {
+                lock_guard<mutex> statsGuard(statsMutex);
+                if ( nextNodeIdx >= nodesToContact.size() )
+                    { return; }
+                if ( chrono::steady_clock::now() >= cycleDeadline )
+                {
+                    stats.timedOut += nodesToContact.size() - nextNodeIdx;
+                    nextNodeIdx = nodesToContact.size();
+                    return;
+                }
+                nodeIdx = nextNodeIdx++;
+            }
+            
+            const NodeDbEntry &node = nodesToContact[nodeIdx];
+            bool renewed = false;
+            bool attemptTimedOut = false;
+            try
+            {
+                renewed = SafeStoreNode( node, shared_ptr<INodeMethods>(), cycleAbort, &attemptTimedOut );
+                LOG(DEBUG) << "Attempted renewing relation with node " << node.id() << ", result: " << renewed;
+            }
+            catch (exception &e)
+            {
+                LOG(WARNING) << "Unexpected error renewing relation with node "
+                             << node.id() << " : " << e.what();
+            }
+            
+            // Renewals cut off by the cycle deadline did not time out on their own, but count as such
+            if ( ! renewed && cycleAbort->raised() )
+                { attemptTimedOut = true; }
+            
+            lock_guard<mutex> statsGuard(statsMutex);
+            if (renewed)
+                { ++stats.succeeded; }
+            else if (attemptTimedOut)
+                { ++stats.timedOut; }
+            else { ++stats.failed; }
         }
-        catch (exception &e)
+    };
+    
+    size_t workerCount = min( max<size_t>( Config::Instance().discoveryConcurrency(), 1 ), nodesToContact.size() );
+    vector<thread> workers;
+    for (size_t workerIdx = 0; workerIdx < workerCount; ++workerIdx)
+    {
+        {
+            lock_guard<mutex> statsGuard(statsMutex);
+            ++runningWorkerCount;
+        }
+        workers.emplace_back(renewNodes);
+    }
+    
+    {
+        unique_lock<mutex> statsLock(statsMutex);
+        if ( ! workerFinished.wait_until( statsLock, cycleDeadline,
+                [&runningWorkerCount] { return runningWorkerCount == 0; } ) )
         {
-            LOG(WARNING) << "Unexpected error renewing relation with node "
-                         << node.id() << " : " << e.what();
+            LOG(WARNING) << "Relation renewal cycle deadline passed, aborting renewals in progress";
+            statsLock.unlock();
+            cycleAbort->Raise();
         }
     }
+    for (auto &worker : workers)
+        { worker.join(); }
+    
+    stats.duration = chrono::duration_cast<chrono::milliseconds>( chrono::steady_clock::now() - cycleStarted );
+    LOG(INFO) << "Renewed " << stats.succeeded << " of " << nodesToContact.size() << " relations in "
+              << stats.duration.count() << " ms, failed: " << stats.failed << ", timed out: " << stats.timedOut;
+    return stats;
 }
 
 
@@ -705,7 +1278,6 @@ void Node::RenewNeighbours()
     {
         try
         {
-            // TODO this should not block the response message, should just post tasks to the io_service to be executed later.
             bool updated = SafeStoreNode( NodeDbEntry(neighbour,
                 NodeRelationType::Neighbour, NodeContactRoleType::Initiator) );
             LOG(DEBUG) << "Attempted updating changed self info on neighbour " << neighbour.id() << ", result: " << updated;
@@ -764,7 +1336,7 @@ void Node::DiscoverUnknownAreas()
 //      if both available. This might help rejoining a splitted network.
             
             // If we already know this node, nothing to do here, renewals will keep it alive
-            shared_ptr<NodeInfo> storedInfo = _spatialDb->Load( newClosestNode.id() );
+            shared_ptr<NodeInfo> storedInfo = _spatialDb->Load( newClosestNode.id(), ServiceDetails::Excluded );
             if (storedInfo != nullptr)
             {
                 LOG(DEBUG) << "Closest node is already present: " << *storedInfo;
@@ -798,4 +1370,72 @@ void Node::DiscoverUnknownAreas()
 
 
 
+RelationRenewalScheduler::RelationRenewalScheduler(
+        shared_ptr<ISpatialDatabase> spatialDb, shared_ptr<Node> node,
+        chrono::seconds margin, size_t renewalsPerSecond ) :
+    _spatialDb(spatialDb), _node(node), _margin(margin), _renewalsPerSecond(renewalsPerSecond),
+    _random( random_device()() ), _dueTimes(), _nextRefresh( chrono::steady_clock::now() )
+{
+    if (_spatialDb == nullptr || _node == nullptr)
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No node or spatial database to schedule renewals for"); }
+    if (_renewalsPerSecond == 0)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Renewal rate must be positive"); }
+}
+
+
+// NOTE relations renewed or created since the last refresh are picked up with their new expiration here,
+//      failed renewals are retried at the next refresh while they are still due
+void RelationRenewalScheduler::Refresh()
+{
+    uniform_int_distribution<time_t> jitter( 0, static_cast<time_t>( _margin.count() * RENEWAL_JITTER_RATE ) );
+    
+    _dueTimes.clear();
+    for ( const auto &expiration : _spatialDb->GetExpirations(NodeContactRoleType::Initiator) )
+    {
+        if ( expiration.second == numeric_limits<time_t>::max() )
+            { continue; }
+        _dueTimes.emplace( expiration.second - _margin.count() - jitter(_random), expiration.first );
+    }
+    _nextRefresh = chrono::steady_clock::now() + _margin / RENEWAL_REFRESH_DIVISOR;
+    LOG(DEBUG) << "Scheduled " << _dueTimes.size() << " relations for renewal";
+}
+
+
+chrono::milliseconds RelationRenewalScheduler::RenewDueRelations()
+{
+    auto tickStarted = chrono::steady_clock::now();
+    if (tickStarted >= _nextRefresh)
+        { Refresh(); }
+    
+    // Collect relations due, but not more than allowed to be contacted in a second
+    time_t now = chrono::system_clock::to_time_t( chrono::system_clock::now() );
+    vector<NodeDbEntry> dueNodes;
+    while ( ! _dueTimes.empty() && _dueTimes.begin()->first <= now && dueNodes.size() < _renewalsPerSecond )
+    {
+        NodeId nodeId = _dueTimes.begin()->second;
+        _dueTimes.erase( _dueTimes.begin() );
+        
+        shared_ptr<NodeDbEntry> node = _spatialDb->Load(nodeId);
+        if ( node && node->roleType() == NodeContactRoleType::Initiator )
+            { dueNodes.push_back(*node); }
+    }
+    if ( ! dueNodes.empty() )
+        { _node->RenewNodeRelations(dueNodes); }
+    
+    // Wait for the next due time or refresh, but keep the rate limit of a batch per second
+    chrono::milliseconds untilNextTick = chrono::duration_cast<chrono::milliseconds>(
+        tickStarted + chrono::seconds(1) - chrono::steady_clock::now() );
+    chrono::milliseconds wait = chrono::duration_cast<chrono::milliseconds>(
+        _nextRefresh - chrono::steady_clock::now() );
+    if ( ! _dueTimes.empty() )
+        { wait = min( wait, chrono::milliseconds( chrono::seconds( _dueTimes.begin()->first - now ) ) ); }
+    return max( { wait, untilNextTick, chrono::milliseconds::zero() } );
+}
+
+
+size_t RelationRenewalScheduler::scheduledCount() const
+    { return _dueTimes.size(); }
+
+
+
 } // namespace LocNet
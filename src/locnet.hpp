@@ -1,7 +1,12 @@
 #ifndef __LOCNET_BUSINESS_LOGIC_H__
 #define __LOCNET_BUSINESS_LOGIC_H__
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <random>
+#include <set>
+#include <thread>
 #include <unordered_map>
 
 #include "spatialdb.hpp"
@@ -83,6 +88,31 @@ public:
 };
 
 
+// Signal to make blocking operations running on other threads fail early,
+// e.g. remote calls of requests that are not needed anymore.
+// NOTE handlers are called with the signal locked, they must not block or use the signal.
+//      Removing a handler waits until its running call is finished.
+class AbortSignal
+{
+    mutable std::mutex  _mutex;
+    bool                _raised;
+    size_t              _nextHandlerId;
+    std::unordered_map<size_t, std::function<void()>> _handlers;
+    
+public:
+    
+    AbortSignal();
+    
+    bool raised() const;
+    void Raise();
+    
+    // Handler is called when the signal is raised, or right away if it was already raised
+    size_t AddHandler(std::function<void()> handler);
+    void RemoveHandler(size_t handlerId);
+};
+
+
+
 // Factory interface to return callable node methods for potentially remote nodes,
 // hiding away the exact way and complexity of communication.
 class INodeConnectionFactory
@@ -91,11 +121,27 @@ public:
     
     virtual ~INodeConnectionFactory() {}
     
-    virtual std::shared_ptr<INodeMethods> ConnectTo(const NetworkEndpoint &endpoint) = 0;
+    // Connecting and calls of the returned connection fail soon after the optional abort signal is raised
+    virtual std::shared_ptr<INodeMethods> ConnectTo( const NetworkEndpoint &endpoint,
+        std::shared_ptr<AbortSignal> abort = std::shared_ptr<AbortSignal>() ) = 0;
+};
+
+
+
+// Outcome of a maintenance cycle renewing relations initiated by this node
+struct RelationRenewalStats
+{
+    size_t succeeded = 0;
+    size_t failed    = 0;
+    size_t timedOut  = 0;   // Peers not answering in time or not contacted before the cycle deadline
+    std::chrono::milliseconds duration = std::chrono::milliseconds::zero();
 };
 
 
 
+struct SeedRace;
+struct ClosestNodeLookup;
+
 // Implementation of all provided interfaces in a single class
 class Node : public ILocalServiceMethods, public IClientMethods, public INodeMethods
 {
@@ -104,29 +150,59 @@ class Node : public ILocalServiceMethods, public IClientMethods, public INodeMet
     std::shared_ptr<ISpatialDatabase>       _spatialDb;
     std::shared_ptr<INodeConnectionFactory> _connectionFactory;
     
+    // Colleagues being accepted in parallel, their bubbles must not overlap either.
+    // Neighbours being accepted in parallel take places within the neighbour limit.
+    std::mutex                                      _admissionMutex;
+    std::vector<std::pair<NodeId, GpsLocation>>     _pendingColleagues;
+    std::vector<std::pair<NodeId, GpsLocation>>     _pendingNeighbours;
+    
+    // Neighbours are renewed in the background after changes of this node, requests are coalesced
+    std::mutex                  _neighbourRenewalMutex;
+    std::condition_variable     _neighbourRenewalRequested;
+    bool                        _neighbourRenewalPending;
+    bool                        _shutdownRequested;
+    std::thread                 _neighbourRenewalThread;
     
-    std::shared_ptr<INodeMethods> SafeConnectTo(const NetworkEndpoint &endpoint);
+    void ScheduleNeighbourRenewal();
+    
+    
+    bool IsConnectable(const NetworkEndpoint &endpoint) const;
+    // Failures are logged and reported as a null connection or false, timeouts are flagged separately if asked for
+    std::shared_ptr<INodeMethods> SafeConnectTo( const NetworkEndpoint &endpoint,
+        std::shared_ptr<AbortSignal> abort = std::shared_ptr<AbortSignal>(), bool *timedOut = nullptr );
     bool SafeStoreNode( const NodeDbEntry &entry,
-        std::shared_ptr<INodeMethods> nodeConnection = std::shared_ptr<INodeMethods>() );
+        std::shared_ptr<INodeMethods> nodeConnection = std::shared_ptr<INodeMethods>(),
+        std::shared_ptr<AbortSignal> abort = std::shared_ptr<AbortSignal>(), bool *timedOut = nullptr );
     
-    bool InitializeWorld(const std::vector<NetworkEndpoint> &seedNodes);
-    bool InitializeNeighbourhood();
+    void RaceSeed( std::shared_ptr<SeedRace> race, const NetworkEndpoint &seedContact,
+                   size_t randomNodeCount, std::shared_ptr<AbortSignal> abort );
+    void QueryClosestNodes( std::shared_ptr<ClosestNodeLookup> lookup, const NodeInfo &node,
+                            std::shared_ptr<AbortSignal> abort );
     
     Distance GetBubbleSize(const GpsLocation &location) const;
     bool BubbleOverlaps(const GpsLocation &newNodeLocation,
                         const std::string &nodeIdToIgnore = "") const;
+    bool PendingBubbleOverlaps(const GpsLocation &newNodeLocation) const;
     
 public:
     
     Node( std::shared_ptr<ISpatialDatabase> spatialDb,
           std::shared_ptr<INodeConnectionFactory> connectionFactory );
+    ~Node();
 
     void EnsureMapFilled();
+    bool InitializeWorld(const std::vector<NetworkEndpoint> &seedNodes);
+    bool InitializeNeighbourhood();
+    // Iterative lookup of the nodes closest to this node in the network
+    std::vector<NodeInfo> LookupClosestNodes(size_t resultCount);
     
-    void DetectedExternalAddress(const Address &address);
+    void DetectedExternalAddress(const IpAddress &address);
     
     void ExpireOldNodes();
-    void RenewNodeRelations();
+    RelationRenewalStats RenewNodeRelations();
+    RelationRenewalStats RenewNodeRelations(const std::vector<NodeDbEntry> &nodesToContact);
+    RelationRenewalStats RenewNodeRelations( const std::vector<NodeDbEntry> &nodesToContact,
+                                             std::chrono::milliseconds cycleLimit );
     void RenewNeighbours();
     void DiscoverUnknownAreas();
     
@@ -159,6 +235,34 @@ public:
 };
 
 
+// Renews relations initiated by this node one by one a margin before they would expire.
+// Due times are randomly brought forward a bit and renewals are rate limited to spread
+// connections evenly over time instead of renewing all relations in periodic bursts.
+class RelationRenewalScheduler
+{
+    std::shared_ptr<ISpatialDatabase>   _spatialDb;
+    std::shared_ptr<Node>               _node;
+    std::chrono::seconds                _margin;
+    size_t                              _renewalsPerSecond;
+    std::mt19937                        _random;
+    
+    std::set<std::pair<time_t, NodeId>>     _dueTimes;
+    std::chrono::steady_clock::time_point   _nextRefresh;
+    
+    void Refresh();
+    
+public:
+    
+    RelationRenewalScheduler( std::shared_ptr<ISpatialDatabase> spatialDb, std::shared_ptr<Node> node,
+                              std::chrono::seconds margin, size_t renewalsPerSecond );
+    
+    // Renews relations that are due, returns the period to wait before calling again
+    std::chrono::milliseconds RenewDueRelations();
+    size_t scheduledCount() const;
+};
+
+
+
 } // namespace LocNet
 
 
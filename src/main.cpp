@@ -43,10 +43,12 @@ int main(int argc, const char *argv[])
         NodeInfo myNodeInfo( config.myNodeInfo() );
         LOG(INFO) << "Initializing server with node info: " << myNodeInfo;
         
-        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase(
-            myNodeInfo, config.dbPath(), config.dbExpirationPeriod() ) );
+        shared_ptr<ISpatialDatabase> geodb;
+        if ( config.dbEngine() == DatabaseEngine::InMemory )
+            { geodb.reset( new MemorySpatialDatabase( myNodeInfo, config.dbPath(), config.dbExpirationPeriod() ) ); }
+        else { geodb.reset( new SpatiaLiteDatabase( myNodeInfo, config.dbPath(), config.dbExpirationPeriod() ) ); }
 
-        TcpStreamConnectionFactory *connFactPtr = new TcpStreamConnectionFactory();
+        TcpStreamConnectionFactory *connFactPtr = new TcpStreamConnectionFactory( config.networkTimeout() );
         shared_ptr<INodeConnectionFactory> connectionFactory(connFactPtr);
         shared_ptr<Node> node( new Node(geodb, connectionFactory) );
 
@@ -57,7 +59,7 @@ int main(int argc, const char *argv[])
         ProtoBufDispatchingTcpServer nodeTcpServer(
             myNodeInfo.contact().nodePort(), nodeDispatcherFactory );
         
-        connFactPtr->detectedIpCallback( [node](const Address &addr)
+        connFactPtr->detectedIpCallback( [node](const IpAddress &addr)
             { node->DetectedExternalAddress(addr); } );
         node->EnsureMapFilled();
 
@@ -85,19 +87,33 @@ int main(int argc, const char *argv[])
         signal(SIGINT,  signalHandler);
         signal(SIGTERM, signalHandler);
         
-        // start threads for periodic db maintenance (relation renewal and expiration) and discovery
-        thread dbMaintenanceThread( [&ShutdownRequested, &config, node]
+        // start threads for db maintenance (relation renewal and periodic expiration) and periodic discovery
+        thread dbMaintenanceThread( [&ShutdownRequested, &config, geodb, node]
         {
+            RelationRenewalScheduler renewalScheduler( geodb, node,
+                config.renewalMargin(), config.renewalsPerSecond() );
+            auto nextExpiration = chrono::steady_clock::now() + config.dbMaintenancePeriod();
+            chrono::milliseconds wait = chrono::seconds(1);
             while (! ShutdownRequested)
             {
                 try
                 {
-                    this_thread::sleep_for( config.dbMaintenancePeriod() );
-                    node->RenewNodeRelations();
-                    node->ExpireOldNodes();
+                    this_thread::sleep_for(wait);
+                    wait = renewalScheduler.RenewDueRelations();
+                    
+                    auto now = chrono::steady_clock::now();
+                    if (now >= nextExpiration)
+                    {
+                        node->ExpireOldNodes();
+                        nextExpiration = now + config.dbMaintenancePeriod();
+                    }
+                    wait = min( wait, chrono::duration_cast<chrono::milliseconds>(nextExpiration - now) );
                 }
                 catch (exception &ex)
-                    { LOG(ERROR) << "Maintenance failed: " << ex.what(); }
+                {
+                    LOG(ERROR) << "Maintenance failed: " << ex.what();
+                    wait = chrono::seconds(1);
+                }
             }
         } );
         dbMaintenanceThread.detach();
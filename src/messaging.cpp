@@ -38,6 +38,7 @@ iop::locnet::Status Converter::ToProtoBuf(ErrorCode value)
         case ErrorCode::ERROR_BAD_RESPONSE:         return iop::locnet::Status::ERROR_INTERNAL;
         case ErrorCode::ERROR_CONCEPTUAL:           return iop::locnet::Status::ERROR_INTERNAL;
         case ErrorCode::ERROR_CONNECTION:           return iop::locnet::Status::ERROR_INTERNAL;
+        case ErrorCode::ERROR_TIMEOUT:              return iop::locnet::Status::ERROR_INTERNAL;
         case ErrorCode::ERROR_INTERNAL:             return iop::locnet::Status::ERROR_INTERNAL;
         case ErrorCode::ERROR_INVALID_VALUE:        return iop::locnet::Status::ERROR_INVALID_VALUE;
         case ErrorCode::ERROR_BAD_STATE:            return iop::locnet::Status::ERROR_INTERNAL;
@@ -115,24 +116,30 @@ NodeInfo Converter::FromProtoBuf(const iop::locnet::NodeInfo& value)
     {
         const iop::locnet::ServiceInfo &sourceService = value.services(idx);
         ServiceInfo service = FromProtoBuf(sourceService);
-        services[ service.type() ] = service;
+        services.set(service);
     }
     
     return NodeInfo( value.nodeid(), FromProtoBuf( value.location() ), NodeContact(
-        NodeContact::AddressFromBytes( contact.ipaddress() ), contact.nodeport(), contact.clientport() ),
+        IpAddress::FromBytes( contact.ipaddress() ), contact.nodeport(), contact.clientport() ),
         services );
 }
 
 
 
-void Converter::FillProtoBuf(iop::locnet::ServiceInfo *target, const ServiceInfo &source)
+// NOTE works with both ServiceInfo and service table iterators, so services of a node
+//      are filled without creating a ServiceInfo object for each of them
+template <typename ServiceSource>
+static void FillServiceInfo(iop::locnet::ServiceInfo *target, const ServiceSource &source)
 {
-    target->set_type( ToProtoBuf( source.type() ) );
+    target->set_type( Converter::ToProtoBuf( source.type() ) );
     target->set_port( source.port() );
     if ( ! source.customData().empty() )
         { target->set_servicedata( source.customData() ); }
 }
 
+void Converter::FillProtoBuf(iop::locnet::ServiceInfo *target, const ServiceInfo &source)
+    { FillServiceInfo(target, source); }
+
 iop::locnet::ServiceInfo* Converter::ToProtoBuf(const ServiceInfo &info)
 {
     auto result = new iop::locnet::ServiceInfo();
@@ -155,11 +162,9 @@ void Converter::FillProtoBuf(
     targetContact->set_clientport( sourceContact.clientPort() );
     targetContact->set_ipaddress( sourceContact.AddressBytes() );
     
-    for ( const auto &serviceEntry : source.services() )
-    {
-        iop::locnet::ServiceInfo *targetService = target->add_services();
-        FillProtoBuf(targetService, serviceEntry.second);
-    }
+    const NodeInfo::Services &services = source.services();
+    for (auto service = services.begin(); service != services.end(); ++service)
+        { FillServiceInfo( target->add_services(), service ); }
 }
 
 iop::locnet::NodeInfo* Converter::ToProtoBuf(const NodeInfo &info)
@@ -548,7 +553,7 @@ unique_ptr<iop::locnet::Response> IncomingRequestDispatcher::Dispatch(const iop:
 
 
 NodeMethodsProtoBufClient::NodeMethodsProtoBufClient(
-    std::shared_ptr<IProtoBufRequestDispatcher> dispatcher, std::function<void(const Address&)> detectedIpCallback) :
+    std::shared_ptr<IProtoBufRequestDispatcher> dispatcher, std::function<void(const IpAddress&)> detectedIpCallback) :
     _dispatcher(dispatcher), _detectedIpCallback(detectedIpCallback)
 {
     if (! _dispatcher)
@@ -610,7 +615,7 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptColleague(const NodeInfo&
     {
         const string &address = response->remotenode().acceptcolleague().remoteipaddress();
         if ( ! address.empty() )
-            { _detectedIpCallback( NodeContact::AddressFromBytes(address) ); }
+            { _detectedIpCallback( IpAddress::FromBytes(address) ); }
     }
     return result;
 }
@@ -637,7 +642,7 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::RenewColleague(const NodeInfo& n
     {
         const string &address = response->remotenode().renewcolleague().remoteipaddress();
         if ( ! address.empty() )
-            { _detectedIpCallback( NodeContact::AddressFromBytes(address) ); }
+            { _detectedIpCallback( IpAddress::FromBytes(address) ); }
     }
     return result;
 }
@@ -664,7 +669,7 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::AcceptNeighbour(const NodeInfo&
     {
         const string &address = response->remotenode().acceptneighbour().remoteipaddress();
         if ( ! address.empty() )
-            { _detectedIpCallback( NodeContact::AddressFromBytes(address) ); }
+            { _detectedIpCallback( IpAddress::FromBytes(address) ); }
     }
     return result;
 }
@@ -691,7 +696,7 @@ shared_ptr<NodeInfo> NodeMethodsProtoBufClient::RenewNeighbour(const NodeInfo& n
     {
         const string &address = response->remotenode().renewneighbour().remoteipaddress();
         if ( ! address.empty() )
-            { _detectedIpCallback( NodeContact::AddressFromBytes(address) ); }
+            { _detectedIpCallback( IpAddress::FromBytes(address) ); }
     }
     return result;
 }
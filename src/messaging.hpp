@@ -124,12 +124,12 @@ public:
 class NodeMethodsProtoBufClient : public INodeMethods
 {
     std::shared_ptr<IProtoBufRequestDispatcher> _dispatcher;
-    std::function<void(const Address&)> _detectedIpCallback;
+    std::function<void(const IpAddress&)> _detectedIpCallback;
     
 public:
     
     NodeMethodsProtoBufClient(std::shared_ptr<IProtoBufRequestDispatcher> dispatcher,
-                              std::function<void(const Address&)> detectedIpCallback);
+                              std::function<void(const IpAddress&)> detectedIpCallback);
     
     NodeInfo GetNodeInfo() const override;
     size_t GetNodeCount() const override;
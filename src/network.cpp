@@ -1,5 +1,11 @@
+#include <array>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 
 #include "config.hpp"
 #include "network.hpp"
@@ -35,53 +41,58 @@ bool NetworkEndpoint::isLoopback() const
     catch (...) { return false; }
 }
 
-Address NodeContact::AddressFromBytes(const std::string &bytes)
+IpAddress IpAddress::FromString(const Address &addr)
 {
-    if ( bytes.empty() )
-        { return Address(); }
-    else if ( bytes.size() == sizeof(address_v4::bytes_type) )
+    if ( addr.empty() )
+        { return IpAddress(); }
+    
+    asio::error_code error;
+    auto ipAddress( address::from_string(addr, error) );
+    if (error)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid ip address: " + addr); }
+    
+    string bytes;
+    if ( ipAddress.is_v4() )
     {
-        address_v4::bytes_type v4AddrBytes;
-        copy( &bytes.front(), &bytes.front() + v4AddrBytes.size(), v4AddrBytes.data() );
-        address_v4 ipv4(v4AddrBytes);
-        return ipv4.to_string();
+        auto v4Bytes = ipAddress.to_v4().to_bytes();
+        bytes.assign( v4Bytes.begin(), v4Bytes.end() );
     }
-    else if ( bytes.size() == sizeof(address_v6::bytes_type) )
+    else if ( ipAddress.is_v6() )
     {
-        address_v6::bytes_type v6AddrBytes;
-        copy( &bytes.front(), &bytes.front() + v6AddrBytes.size(), v6AddrBytes.data() );
-        address_v6 ipv6(v6AddrBytes);
-        return ipv6.to_string();
+        auto v6Bytes = ipAddress.to_v6().to_bytes();
+        bytes.assign( v6Bytes.begin(), v6Bytes.end() );
     }
-    else { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Invalid ip address bytearray size: " + bytes.size()); }
+    else { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Unknown type of address: " + addr); }
+    return FromBytes(bytes);
 }
 
 
-string NodeContact::AddressToBytes(const Address &addr)
+Address IpAddress::ToString() const
 {
-    string result;
-    if ( addr.empty() )
-        { return result; }
-    
-    auto ipAddress( address::from_string(addr) );
-    if ( ipAddress.is_v4() )
-    {
-        auto bytes = ipAddress.to_v4().to_bytes();
-        for (uint8_t byte : bytes)
-            { result.push_back(byte); }
-    }
-    else if ( ipAddress.is_v6() )
+    switch (_family)
     {
-        auto bytes = ipAddress.to_v6().to_bytes();
-        for (uint8_t byte : bytes)
-            { result.push_back(byte); }
+        case AddressFamily::IPv4:
+        {
+            address_v4::bytes_type v4AddrBytes;
+            copy( _bytes.begin(), _bytes.begin() + v4AddrBytes.size(), v4AddrBytes.begin() );
+            return address_v4(v4AddrBytes).to_string();
+        }
+        case AddressFamily::IPv6:
+        {
+            address_v6::bytes_type v6AddrBytes;
+            copy( _bytes.begin(), _bytes.begin() + v6AddrBytes.size(), v6AddrBytes.begin() );
+            return address_v6(v6AddrBytes).to_string();
+        }
+        default: return Address();
     }
-    else { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Unknown type of address: " + addr); }
-    return result;
 }
 
-string  NodeContact::AddressBytes() const
-    { return AddressToBytes(_address); }
+
+Address NodeContact::AddressFromBytes(const std::string &bytes)
+    { return IpAddress::FromBytes(bytes).ToString(); }
+
+string NodeContact::AddressToBytes(const Address &addr)
+    { return IpAddress::FromString(addr).Bytes(); }
 
 
 
@@ -155,6 +166,8 @@ void ProtoBufDispatchingTcpServer::AsyncAcceptHandler(
         {
             shared_ptr<IProtoBufRequestDispatcher> dispatcher(
                 _dispatcherFactory->Create(session) );
+            // NOTE converted only once per session instead of for every message
+            const string remoteAddressBytes = NodeContact::AddressToBytes( session->remoteAddress() );
 
             bool endMessageLoop = false;
             while ( ! endMessageLoop && ! IoService::Instance().Server().stopped() )
@@ -195,19 +208,19 @@ void ProtoBufDispatchingTcpServer::AsyncAcceptHandler(
                     {
                         if ( request->remotenode().has_acceptcolleague() ) {
                             request->mutable_remotenode()->mutable_acceptcolleague()->mutable_requestornodeinfo()->mutable_contact()->set_ipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                         else if ( request->remotenode().has_renewcolleague() ) {
                             request->mutable_remotenode()->mutable_renewcolleague()->mutable_requestornodeinfo()->mutable_contact()->set_ipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                         else if ( request->remotenode().has_acceptneighbour() ) {
                             request->mutable_remotenode()->mutable_acceptneighbour()->mutable_requestornodeinfo()->mutable_contact()->set_ipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                         else if ( request->remotenode().has_renewneighbour() ) {
                             request->mutable_remotenode()->mutable_renewneighbour()->mutable_requestornodeinfo()->mutable_contact()->set_ipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                     }
                     
@@ -218,19 +231,19 @@ void ProtoBufDispatchingTcpServer::AsyncAcceptHandler(
                     {
                         if ( response->remotenode().has_acceptcolleague() ) {
                             response->mutable_remotenode()->mutable_acceptcolleague()->set_remoteipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                         else if ( response->remotenode().has_renewcolleague() ) {
                             response->mutable_remotenode()->mutable_renewcolleague()->set_remoteipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                         else if ( response->remotenode().has_acceptneighbour() ) {
                             response->mutable_remotenode()->mutable_acceptneighbour()->set_remoteipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                         else if ( response->remotenode().has_renewneighbour() ) {
                             response->mutable_remotenode()->mutable_renewneighbour()->set_remoteipaddress(
-                                NodeContact::AddressToBytes( session->remoteAddress() ) );
+                                remoteAddressBytes );
                         }
                     }
                 }
@@ -278,7 +291,7 @@ void ProtoBufDispatchingTcpServer::AsyncAcceptHandler(
 
 
 ProtoBufTcpStreamSession::ProtoBufTcpStreamSession(shared_ptr<tcp::socket> socket) :
-    _socket(socket), _id(), _remoteAddress(), _socketWriteMutex(), _nextRequestId(1) // , _socketReadMutex()
+    _ioService(), _timeout(), _abort(), _abortHandlerId(0), _socket(socket), _id(), _remoteAddress(), _socketWriteMutex(), _nextRequestId(1) // , _socketReadMutex()
 {
     if (! _socket)
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "No socket instantiated"); }
@@ -290,15 +303,46 @@ ProtoBufTcpStreamSession::ProtoBufTcpStreamSession(shared_ptr<tcp::socket> socke
 }
 
 
-ProtoBufTcpStreamSession::ProtoBufTcpStreamSession(const NetworkEndpoint &endpoint) :
-    _socket( new tcp::socket( IoService::Instance().Server() ) ),
+ProtoBufTcpStreamSession::ProtoBufTcpStreamSession( const NetworkEndpoint &endpoint,
+        chrono::milliseconds timeout, shared_ptr<AbortSignal> abort ) :
+    _ioService( new asio::io_service() ), _timeout(timeout), _abort(abort), _abortHandlerId(0),
+    _socket( new tcp::socket(*_ioService) ),
     _id( endpoint.address() + ":" + to_string( endpoint.port() ) ),
     _remoteAddress( endpoint.address() ), _socketWriteMutex(), _nextRequestId(1) // , _socketReadMutex()
 {
-    tcp::resolver resolver( IoService::Instance().Server() );
-    tcp::resolver::query query( endpoint.address(), to_string( endpoint.port() ) );
-    tcp::resolver::iterator addressIter = resolver.resolve(query);
-    try { asio::connect(*_socket, addressIter); }
+    // NOTE the socket is not thread-safe, it's closed by the thread running the operation in progress
+    if (_abort)
+    {
+        _abortHandlerId = _abort->AddHandler( [this]
+        {
+            _ioService->post( [this]
+            {
+                asio::error_code ignored;
+                _socket->close(ignored);
+            } );
+        } );
+    }
+    scope_error removeAbortHandler( [this]
+        { if (_abort) { _abort->RemoveHandler(_abortHandlerId); } } );
+    
+    // NOTE resolving and connecting share a single deadline
+    Deadline deadline = NextDeadline();
+    try
+    {
+        shared_ptr<vector<tcp::endpoint>> targets = ResolveUntil(endpoint, deadline);
+        RunWithTimeout( "connecting", deadline, [this, targets] (CompletionHandler handler)
+        {
+            asio::async_connect( *_socket, targets->cbegin(), targets->cend(),
+                [handler] (const asio::error_code &ec, vector<tcp::endpoint>::const_iterator) { handler(ec); } );
+        } );
+    }
+    catch (LocationNetworkError &lnex)
+    {
+        // NOTE keep timeouts distinguishable from other connection failures
+        ErrorCode code = lnex.code() == ErrorCode::ERROR_TIMEOUT ? ErrorCode::ERROR_TIMEOUT : ErrorCode::ERROR_CONNECTION;
+        throw LocationNetworkError(code, "Failed connecting to " +
+            endpoint.address() + ":" + to_string( endpoint.port() ) + " with error: " + lnex.what() );
+    }
     catch (exception &ex) { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "Failed connecting to " +
         endpoint.address() + ":" + to_string( endpoint.port() ) + " with error: " + ex.what() ); }
     LOG(DEBUG) << "Connected to " << endpoint;
@@ -308,10 +352,158 @@ ProtoBufTcpStreamSession::ProtoBufTcpStreamSession(const NetworkEndpoint &endpoi
 
 ProtoBufTcpStreamSession::~ProtoBufTcpStreamSession()
 {
+    if (_abort)
+        { _abort->RemoveHandler(_abortHandlerId); }
     LOG(DEBUG) << "Session " << id() << " closed";
 }
 
 
+// NOTE name lookups cannot be cancelled, neither synchronous nor asynchronous ones of asio.
+//      Lookups are run on a separate thread instead which is abandoned when the deadline passes.
+shared_ptr<vector<tcp::endpoint>> ProtoBufTcpStreamSession::ResolveUntil(
+    const NetworkEndpoint &endpoint, Deadline deadline)
+{
+    asio::error_code parseError;
+    asio::ip::address address = asio::ip::address::from_string( endpoint.address(), parseError );
+    if (! parseError)
+        { return make_shared<vector<tcp::endpoint>>( 1, tcp::endpoint( address, endpoint.port() ) ); }
+    
+    struct Lookup
+    {
+        mutex                   lock;
+        condition_variable      finished;
+        bool                    done    = false;
+        bool                    aborted = false;
+        asio::error_code        error;
+        vector<tcp::endpoint>   targets;
+    };
+    shared_ptr<Lookup> lookup = make_shared<Lookup>();
+    thread( [lookup, endpoint]
+    {
+        asio::io_service ioService;
+        tcp::resolver resolver(ioService);
+        asio::error_code error;
+        tcp::resolver::iterator addressIter = resolver.resolve(
+            tcp::resolver::query( endpoint.address(), to_string( endpoint.port() ) ), error );
+        
+        lock_guard<mutex> guard(lookup->lock);
+        lookup->error = error;
+        for (; ! error && addressIter != tcp::resolver::iterator(); ++addressIter)
+            { lookup->targets.push_back( addressIter->endpoint() ); }
+        lookup->done = true;
+        lookup->finished.notify_all();
+    } ).detach();
+    
+    size_t abortHandlerId = 0;
+    if (_abort)
+    {
+        abortHandlerId = _abort->AddHandler( [lookup]
+        {
+            lock_guard<mutex> guard(lookup->lock);
+            lookup->aborted = true;
+            lookup->finished.notify_all();
+        } );
+    }
+    scope_exit removeAbortHandler( [this, abortHandlerId]
+        { if (_abort) { _abort->RemoveHandler(abortHandlerId); } } );
+    
+    unique_lock<mutex> guard(lookup->lock);
+    auto isDone = [lookup] { return lookup->done || lookup->aborted; };
+    if (deadline == Deadline::max())
+        { lookup->finished.wait(guard, isDone); }
+    else if ( ! lookup->finished.wait_until(guard, deadline, isDone) )
+        { throw LocationNetworkError(ErrorCode::ERROR_TIMEOUT, "Session " + id() + " timed out resolving address"); }
+    if (! lookup->done)
+        { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "Session " + id() + " aborted resolving address"); }
+    
+    if (lookup->error)
+        { throw asio::system_error(lookup->error); }
+    if ( lookup->targets.empty() )
+        { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "No address found for " + endpoint.address() ); }
+    return make_shared<vector<tcp::endpoint>>( lookup->targets );
+}
+
+
+ProtoBufTcpStreamSession::Deadline ProtoBufTcpStreamSession::NextDeadline() const
+{
+    return _timeout > chrono::milliseconds::zero() ?
+        chrono::steady_clock::now() + _timeout : Deadline::max();
+}
+
+
+// NOTE blocking socket operations cannot be cancelled, so operations of client connections are run
+//      asynchronously on a private io_service while the caller blocks and waits for their completion
+void ProtoBufTcpStreamSession::RunWithTimeout( const string &operationName, Deadline deadline,
+                                               function<void(CompletionHandler)> startOperation )
+{
+    if ( _abort && _abort->raised() )
+        { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "Session " + id() + " aborted " + operationName); }
+    
+    asio::error_code result = asio::error::would_block;
+    startOperation( [&result] (const asio::error_code &ec) { result = ec; } );
+    
+    bool timedOut = false;
+    asio::steady_timer timer(*_ioService);
+    if ( deadline != Deadline::max() )
+    {
+        timer.expires_at(deadline);
+        timer.async_wait( [this, &timedOut] (const asio::error_code &ec)
+        {
+            if (ec)
+                { return; }
+            timedOut = true;
+            asio::error_code ignored;
+            _socket->close(ignored);
+        } );
+    }
+    
+    _ioService->reset();
+    while (result == asio::error::would_block)
+        { _ioService->run_one(); }
+    timer.cancel();
+    _ioService->run();
+    
+    if (timedOut)
+        { throw LocationNetworkError(ErrorCode::ERROR_TIMEOUT, "Session " + id() + " timed out " + operationName); }
+    if ( result && _abort && _abort->raised() )
+        { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "Session " + id() + " aborted " + operationName); }
+    if (result)
+        { throw asio::system_error(result); }
+}
+
+
+void ProtoBufTcpStreamSession::Read(asio::mutable_buffers_1 buffer, Deadline deadline)
+{
+    if (! _ioService)
+    {
+        asio::read(*_socket, buffer);
+        return;
+    }
+    RunWithTimeout( "receiving message", deadline, [this, buffer] (CompletionHandler handler)
+    {
+        asio::async_read( *_socket, buffer,
+            [handler] (const asio::error_code &ec, size_t) { handler(ec); } );
+    } );
+}
+
+
+template <typename ConstBufferSequence>
+void ProtoBufTcpStreamSession::Write(const ConstBufferSequence &buffers)
+{
+    if (! _ioService)
+    {
+        asio::write(*_socket, buffers);
+        return;
+    }
+    RunWithTimeout( "sending message", NextDeadline(), [this, &buffers] (CompletionHandler handler)
+    {
+        asio::async_write( *_socket, buffers,
+            [handler] (const asio::error_code &ec, size_t) { handler(ec); } );
+    } );
+}
+
+
+
 const SessionId& ProtoBufTcpStreamSession::id() const
     { return _id; }
 
@@ -336,9 +528,12 @@ iop::locnet::MessageWithHeader* ProtoBufTcpStreamSession::ReceiveMessage()
         { throw LocationNetworkError(ErrorCode::ERROR_BAD_STATE,
             "Session " + id() + " connection is already closed, cannot read message"); }
         
+    // NOTE the whole message must arrive in time, not just each of its parts
+    Deadline deadline = NextDeadline();
+    
     // Allocate a buffer for the message header and read it
     string messageBytes(MessageHeaderSize, 0);
-    asio::read( *_socket, asio::buffer(messageBytes) );
+    Read( asio::buffer(messageBytes), deadline );
 
     // Extract message size from the header to know how many bytes to read
     uint32_t bodySize = GetMessageSizeFromHeader( &messageBytes[MessageSizeOffset] );
@@ -348,7 +543,7 @@ iop::locnet::MessageWithHeader* ProtoBufTcpStreamSession::ReceiveMessage()
     
     // Extend buffer to fit remaining message size and read it
     messageBytes.resize(MessageHeaderSize + bodySize, 0);
-    asio::read( *_socket, asio::buffer(&messageBytes[0] + MessageHeaderSize, bodySize) );
+    Read( asio::buffer(&messageBytes[0] + MessageHeaderSize, bodySize), deadline );
 
     // Deserialize message from receive buffer, avoid leaks for failing cases with RAII-based unique_ptr
     unique_ptr<iop::locnet::MessageWithHeader> message( new iop::locnet::MessageWithHeader() );
@@ -376,7 +571,8 @@ void ProtoBufTcpStreamSession::SendMessage(iop::locnet::MessageWithHeader& messa
     message.set_header(1);
     message.set_header( message.ByteSize() - MessageHeaderSize );
     
-    asio::write( *_socket, asio::buffer( message.SerializeAsString() ) );
+    string messageBytes = message.SerializeAsString();
+    Write( asio::buffer(messageBytes) );
     
     string msgDebugStr;
     google::protobuf::TextFormat::PrintToString(message, &msgDebugStr);
@@ -384,6 +580,64 @@ void ProtoBufTcpStreamSession::SendMessage(iop::locnet::MessageWithHeader& messa
 }
 
 
+string RequestMessagePrefix(uint32_t messageId, size_t serializedRequestSize)
+{
+    using google::protobuf::io::CodedOutputStream;
+    using google::protobuf::internal::WireFormatLite;
+    
+    // NOTE field layout must match iop::locnet::MessageWithHeader and iop::locnet::Message
+    uint32_t requestSize = static_cast<uint32_t>(serializedRequestSize);
+    uint32_t bodySize = 1 + CodedOutputStream::VarintSize32(requestSize) + requestSize;
+    if (messageId != 0)
+        { bodySize += 1 + CodedOutputStream::VarintSize32(messageId); }
+    uint32_t messageSize = 1 + CodedOutputStream::VarintSize32(bodySize) + bodySize;
+    
+    // NOTE tags are single bytes, varints take at most 5 bytes
+    array<uint8_t, MessageHeaderSize + 4 + 3 * 5> prefix;
+    uint8_t *target = prefix.data();
+    target = CodedOutputStream::WriteTagToArray( WireFormatLite::MakeTag(
+        iop::locnet::MessageWithHeader::kHeaderFieldNumber, WireFormatLite::WIRETYPE_FIXED32 ), target );
+    target = CodedOutputStream::WriteLittleEndian32ToArray(messageSize, target);
+    target = CodedOutputStream::WriteTagToArray( WireFormatLite::MakeTag(
+        iop::locnet::MessageWithHeader::kBodyFieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED ), target );
+    target = CodedOutputStream::WriteVarint32ToArray(bodySize, target);
+    if (messageId != 0)
+    {
+        target = CodedOutputStream::WriteTagToArray( WireFormatLite::MakeTag(
+            iop::locnet::Message::kIdFieldNumber, WireFormatLite::WIRETYPE_VARINT ), target );
+        target = CodedOutputStream::WriteVarint32ToArray(messageId, target);
+    }
+    target = CodedOutputStream::WriteTagToArray( WireFormatLite::MakeTag(
+        iop::locnet::Message::kRequestFieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED ), target );
+    target = CodedOutputStream::WriteVarint32ToArray(requestSize, target);
+    return string( reinterpret_cast<const char*>( prefix.data() ), target - prefix.data() );
+}
+
+
+
+// NOTE the shared request parts are written directly after the prefix without being copied
+void ProtoBufTcpStreamSession::SendRequest(const SerializedParts &serializedRequest)
+{
+    size_t requestSize = 0;
+    for (const auto &part : serializedRequest)
+        { requestSize += part->size(); }
+    
+    lock_guard<mutex> writeGuard(_socketWriteMutex);
+    
+    string prefix = RequestMessagePrefix(_nextRequestId, requestSize);
+    ++_nextRequestId;
+    
+    vector<asio::const_buffer> buffers;
+    buffers.reserve( serializedRequest.size() + 1 );
+    buffers.push_back( asio::buffer(prefix) );
+    for (const auto &part : serializedRequest)
+        { buffers.push_back( asio::buffer(*part) ); }
+    Write(buffers);
+    
+    LOG(TRACE) << "Session " << id() << " sent serialized request of " << requestSize << " bytes";
+}
+
+
 // void ProtoBufTcpStreamSession::KeepAlive()
 // {
 //     _stream.expires_after(KeepAliveStreamExpirationPeriod);
@@ -435,17 +689,22 @@ unique_ptr<iop::locnet::Response> ProtoBufRequestNetworkDispatcher::Dispatch(con
 
 
 
-void TcpStreamConnectionFactory::detectedIpCallback(function<void(const Address&)> detectedIpCallback)
+TcpStreamConnectionFactory::TcpStreamConnectionFactory(chrono::milliseconds timeout) :
+    _detectedIpCallback(), _timeout(timeout) {}
+
+
+void TcpStreamConnectionFactory::detectedIpCallback(function<void(const IpAddress&)> detectedIpCallback)
 {
     _detectedIpCallback = detectedIpCallback;
     LOG(DEBUG) << "Callback for detecting external IP address is set " << static_cast<bool>(_detectedIpCallback); 
 }
 
 
-shared_ptr<INodeMethods> TcpStreamConnectionFactory::ConnectTo(const NetworkEndpoint& endpoint)
+shared_ptr<INodeMethods> TcpStreamConnectionFactory::ConnectTo(
+    const NetworkEndpoint& endpoint, shared_ptr<AbortSignal> abort )
 {
     LOG(DEBUG) << "Connecting to " << endpoint;
-    shared_ptr<IProtoBufNetworkSession> session( new ProtoBufTcpStreamSession(endpoint) );
+    shared_ptr<IProtoBufNetworkSession> session( new ProtoBufTcpStreamSession(endpoint, _timeout, abort) );
     shared_ptr<IProtoBufRequestDispatcher> dispatcher( new ProtoBufRequestNetworkDispatcher(session) );
     shared_ptr<INodeMethods> result( new NodeMethodsProtoBufClient(dispatcher, _detectedIpCallback) );
     return result;
@@ -491,6 +750,204 @@ shared_ptr<IProtoBufRequestDispatcher> CombinedRequestDispatcherFactory::Create(
 
 
 
+// Appends the tag and length of a length delimited field, its contents are to be appended separately
+static void AppendField(string &target, int fieldNumber, size_t fieldSize)
+{
+    using google::protobuf::io::CodedOutputStream;
+    using google::protobuf::internal::WireFormatLite;
+    
+    uint8_t prefix[10];
+    uint8_t *end = CodedOutputStream::WriteTagToArray(
+        WireFormatLite::MakeTag(fieldNumber, WireFormatLite::WIRETYPE_LENGTH_DELIMITED), prefix );
+    end = CodedOutputStream::WriteVarint32ToArray( static_cast<uint32_t>(fieldSize), end );
+    target.append( reinterpret_cast<const char*>(prefix), end - prefix );
+}
+
+
+// NOTE every listener is notified about the same change in a row by the same thread,
+//      so the last serialized change of each type is cached to serialize a change only once
+//      and share the same bytes between all sessions. Bytes include the field tag and length
+//      of the change inside the notification, so they can be sent as they are.
+shared_ptr<const string> SerializeNeighbourhoodChange(NeighbourhoodChangeType changeType, const NodeDbEntry &node)
+{
+    struct SerializedChange
+    {
+        NodeDbEntry              node;
+        shared_ptr<const string> bytes;
+    };
+    static thread_local array<unique_ptr<SerializedChange>, 3> lastChanges;
+    
+    // NOTE copies of an entry share their data, so this comparison is usually cheap
+    unique_ptr<SerializedChange> &lastChange = lastChanges.at( static_cast<size_t>(changeType) );
+    if ( lastChange && lastChange->node == node )
+        { return lastChange->bytes; }
+    
+    iop::locnet::NeighbourhoodChange change;
+    switch (changeType)
+    {
+        case NeighbourhoodChangeType::Added:
+            Converter::FillProtoBuf( change.mutable_addednodeinfo(), node );
+            break;
+        case NeighbourhoodChangeType::Updated:
+            Converter::FillProtoBuf( change.mutable_updatednodeinfo(), node );
+            break;
+        case NeighbourhoodChangeType::Removed:
+            change.set_removednodeid( node.id() );
+            break;
+    }
+    
+    string changeBytes = change.SerializeAsString();
+    shared_ptr<string> bytes = make_shared<string>();
+    AppendField( *bytes, iop::locnet::NeighbourhoodChangedNotificationRequest::kChangesFieldNumber, changeBytes.size() );
+    bytes->append(changeBytes);
+    lastChange.reset( new SerializedChange{ node, bytes } );
+    return bytes;
+}
+
+
+
+NeighbourhoodChangeBatch::NeighbourhoodChangeBatch() :
+    _changes(), _positions(), _size(0) {}
+
+
+void NeighbourhoodChangeBatch::Add(NeighbourhoodChangeType changeType, const NodeDbEntry &node)
+{
+    auto position = _positions.find( node.id() );
+    if ( position == _positions.end() )
+    {
+        _positions.emplace( node.id(), _changes.size() );
+        _changes.push_back( Change{ changeType, SerializeNeighbourhoodChange(changeType, node) } );
+        ++_size;
+        return;
+    }
+    
+    Change &pending = _changes[position->second];
+    if ( pending.changeType == NeighbourhoodChangeType::Added )
+    {
+        if ( changeType == NeighbourhoodChangeType::Removed )
+        {
+            // Peer has never been notified about this node, nothing to send
+            pending.bytes.reset();
+            _positions.erase(position);
+            --_size;
+            return;
+        }
+        // Peer still has to be notified about the node as new, just with its latest data
+        changeType = NeighbourhoodChangeType::Added;
+    }
+    else if ( pending.changeType == NeighbourhoodChangeType::Removed &&
+              changeType == NeighbourhoodChangeType::Added )
+        // Peer already knows about this node, so its removal and return is only an update
+        { changeType = NeighbourhoodChangeType::Updated; }
+    
+    pending.changeType = changeType;
+    pending.bytes = SerializeNeighbourhoodChange(changeType, node);
+}
+
+
+size_t NeighbourhoodChangeBatch::size() const
+    { return _size; }
+
+bool NeighbourhoodChangeBatch::empty() const
+    { return _size == 0; }
+
+
+SerializedParts NeighbourhoodChangeBatch::SerializeRequest() const
+{
+    using google::protobuf::io::CodedOutputStream;
+    
+    SerializedParts result(1);
+    size_t changesSize = 0;
+    for (const auto &change : _changes)
+    {
+        if (change.bytes)
+        {
+            result.push_back(change.bytes);
+            changesSize += change.bytes->size();
+        }
+    }
+    
+    // NOTE field layout must match iop::locnet::Request, fields are written in field number order.
+    //      Only the prefix is built here, the shared change bytes follow it without being copied.
+    size_t localServiceSize = 1 + CodedOutputStream::VarintSize32( static_cast<uint32_t>(changesSize) ) + changesSize;
+    const string version{1,0,0};
+    shared_ptr<string> prefix = make_shared<string>();
+    AppendField( *prefix, iop::locnet::Request::kVersionFieldNumber, version.size() );
+    prefix->append(version);
+    AppendField( *prefix, iop::locnet::Request::kLocalServiceFieldNumber, localServiceSize );
+    AppendField( *prefix, iop::locnet::LocalServiceRequest::kNeighbourhoodChangedFieldNumber, changesSize );
+    result.front() = prefix;
+    return result;
+}
+
+
+
+// Collects changes for a single session and sends them in batches.
+// Changes are sent after a configurable delay from the first pending change
+// or immediately when the configured maximum batch size is reached.
+class CoalescingNotificationQueue : public enable_shared_from_this<CoalescingNotificationQueue>
+{
+    shared_ptr<IProtoBufNetworkSession> _session;
+    chrono::milliseconds                _delay;
+    size_t                              _maxBatchSize;
+    
+    mutex                               _mutex;
+    NeighbourhoodChangeBatch            _batch;
+    bool                                _flushScheduled;
+    asio::steady_timer                  _timer;
+    // NOTE keeps batches in order, taking and sending a batch must not be interleaved
+    mutex                               _flushMutex;
+    
+    void Flush()
+    {
+        lock_guard<mutex> flushLock(_flushMutex);
+        NeighbourhoodChangeBatch batch;
+        {
+            lock_guard<mutex> lock(_mutex);
+            swap(batch, _batch);
+            _flushScheduled = false;
+        }
+        if ( batch.empty() )
+            { return; }
+        
+        LOG(TRACE) << "Session " << _session->id() << " is notified about " << batch.size() << " changes";
+        _session->SendRequest( batch.SerializeRequest() );
+    }
+    
+public:
+    
+    CoalescingNotificationQueue(shared_ptr<IProtoBufNetworkSession> session) :
+        _session(session), _delay( Config::Instance().notificationDelay() ),
+        _maxBatchSize( max<size_t>( Config::Instance().notificationBatchSize(), 1 ) ),
+        _mutex(), _batch(), _flushScheduled(false),
+        _timer( IoService::Instance().Server() ), _flushMutex() {}
+    
+    void Add(NeighbourhoodChangeType changeType, const NodeDbEntry &node)
+    {
+        lock_guard<mutex> lock(_mutex);
+        _batch.Add(changeType, node);
+        
+        shared_ptr<CoalescingNotificationQueue> self( shared_from_this() );
+        if ( _batch.size() >= _maxBatchSize || _delay.count() == 0 )
+        {
+            // TODO this is a potentially long lasting operation that should not block the same queue
+            //      as socket accepts and other fast operations. Thus notifications should be done in
+            //      the ClientReactor but it's somehow blocked for some strange reason.
+            IoService::Instance().Server().post( [self] { self->Flush(); } );
+            _flushScheduled = true;
+        }
+        else if (! _flushScheduled)
+        {
+            _timer.expires_from_now(_delay);
+            _timer.async_wait( [self] (const asio::error_code &ec)
+                { if (! ec) { self->Flush(); } } );
+            _flushScheduled = true;
+        }
+    }
+};
+
+
+
 ProtoBufTcpStreamChangeListenerFactory::ProtoBufTcpStreamChangeListenerFactory(
         shared_ptr<IProtoBufNetworkSession> session) :
     _session(session) {}
@@ -514,7 +971,8 @@ ProtoBufTcpStreamChangeListener::ProtoBufTcpStreamChangeListener(
         shared_ptr<IProtoBufNetworkSession> session,
         shared_ptr<ILocalServiceMethods> localService ) :
         // shared_ptr<IProtoBufRequestDispatcher> dispatcher ) :
-    _sessionId(), _localService(localService), _session(session) //, _dispatcher(dispatcher)
+    _sessionId(), _localService(localService), _session(session), //, _dispatcher(dispatcher)
+    _notifications( make_shared<CoalescingNotificationQueue>(session) )
 {
     //session->KeepAlive();
 }
@@ -549,84 +1007,28 @@ const SessionId& ProtoBufTcpStreamChangeListener::sessionId() const
 
 
 
-void ProtoBufTcpStreamChangeListener::AddedNode(const NodeDbEntry& node)
+void ProtoBufTcpStreamChangeListener::Notify(NeighbourhoodChangeType changeType, const NodeDbEntry& node)
 {
-    if ( node.relationType() == NodeRelationType::Neighbour )
+    if ( node.relationType() != NodeRelationType::Neighbour )
+        { return; }
+    
+    try { _notifications->Add(changeType, node); }
+    catch (exception &ex)
     {
-        try
-        {
-            iop::locnet::Request req;
-            iop::locnet::NeighbourhoodChange *change =
-                req.mutable_localservice()->mutable_neighbourhoodchanged()->add_changes();
-            iop::locnet::NodeInfo *info = change->mutable_addednodeinfo();
-            Converter::FillProtoBuf(info, node);
-            
-            shared_ptr<IProtoBufNetworkSession> session(_session);
-            shared_ptr<iop::locnet::MessageWithHeader> msgToSend( RequestToMessage(req) );
-            // TODO this is a potentially long lasting operation that should not block the same queue
-            //      as socket accepts and other fast operations. Thus notifications should be done in
-            //      the ClientReactor but it's somehow blocked for some strange reason.
-            IoService::Instance().Server().post(
-                [session, msgToSend] { session->SendMessage(*msgToSend); } );
-        }
-        catch (exception &ex)
-        {
-            LOG(ERROR) << "Failed to send change notification: " << ex.what();
-            Deregister();
-        }
+        LOG(ERROR) << "Failed to send change notification: " << ex.what();
+        Deregister();
     }
 }
 
 
-void ProtoBufTcpStreamChangeListener::UpdatedNode(const NodeDbEntry& node)
-{
-    if ( node.relationType() == NodeRelationType::Neighbour )
-    {
-        try
-        {
-            iop::locnet::Request req;
-            iop::locnet::NeighbourhoodChange *change =
-                req.mutable_localservice()->mutable_neighbourhoodchanged()->add_changes();
-            iop::locnet::NodeInfo *info = change->mutable_updatednodeinfo();
-            Converter::FillProtoBuf(info, node);
-            
-            shared_ptr<IProtoBufNetworkSession> session(_session);
-            shared_ptr<iop::locnet::MessageWithHeader> msgToSend( RequestToMessage(req) );
-            IoService::Instance().Server().post(
-                [session, msgToSend] { session->SendMessage(*msgToSend); } );
-        }
-        catch (exception &ex)
-        {
-            LOG(ERROR) << "Failed to send change notification: " << ex.what();
-            Deregister();
-        }
-    }
-}
+void ProtoBufTcpStreamChangeListener::AddedNode(const NodeDbEntry& node)
+    { Notify(NeighbourhoodChangeType::Added, node); }
 
+void ProtoBufTcpStreamChangeListener::UpdatedNode(const NodeDbEntry& node)
+    { Notify(NeighbourhoodChangeType::Updated, node); }
 
 void ProtoBufTcpStreamChangeListener::RemovedNode(const NodeDbEntry& node)
-{
-    if ( node.relationType() == NodeRelationType::Neighbour )
-    {
-        try
-        {
-            iop::locnet::Request req;
-            iop::locnet::NeighbourhoodChange *change =
-                req.mutable_localservice()->mutable_neighbourhoodchanged()->add_changes();
-            change->set_removednodeid( node.id() );
-         
-            shared_ptr<IProtoBufNetworkSession> session(_session);
-            shared_ptr<iop::locnet::MessageWithHeader> msgToSend( RequestToMessage(req) );
-            IoService::Instance().Server().post(
-                [session, msgToSend] { session->SendMessage(*msgToSend); } );
-        }
-        catch (exception &ex)
-        {
-            LOG(ERROR) << "Failed to send change notification: " << ex.what();
-            Deregister();
-        }
-    }
-}
+    { Notify(NeighbourhoodChangeType::Removed, node); }
 
 
 
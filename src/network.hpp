@@ -1,9 +1,12 @@
 #ifndef __LOCNET_ASIO_NETWORK_H__
 #define __LOCNET_ASIO_NETWORK_H__
 
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define ASIO_STANDALONE
 #include <asio.hpp>
@@ -81,6 +84,10 @@ public:
 // TODO this would be more independent if would send/receive byte arrays,
 //      but receiving a message we have to be aware of the message header
 //      to know how many bytes to read, it cannot be determined in advance.
+// Serialized bytes split into parts that are only concatenated on the wire, so parts can be shared
+typedef std::vector<std::shared_ptr<const std::string>> SerializedParts;
+
+
 class IProtoBufNetworkSession
 {
 public:
@@ -92,6 +99,8 @@ public:
     
     virtual iop::locnet::MessageWithHeader* ReceiveMessage() = 0;
     virtual void SendMessage(iop::locnet::MessageWithHeader &message) = 0;
+    // Sends an already serialized request, only message framing and id are added per session
+    virtual void SendRequest(const SerializedParts &serializedRequest) = 0;
 
 // TODO Would be nice and more convenient to implement using these methods,
 //      but they do not seem to nicely fit ASIO
@@ -102,6 +111,12 @@ public:
 
 
 
+// Serialized MessageWithHeader fields preceding the given request, i.e. the message is
+// the concatenation of these bytes and the request serialized separately.
+std::string RequestMessagePrefix(uint32_t messageId, size_t serializedRequestSize);
+
+
+
 // Factory interface to create a dispatcher object for a session.
 // Implemented specifically for the keepalive feature, otherwise would not be needed.
 class IProtoBufRequestDispatcherFactory
@@ -183,6 +198,11 @@ public:
 //      Maybe boost stackful coroutines could be useful here, but we shouldn't depend on boost.
 class ProtoBufTcpStreamSession : public IProtoBufNetworkSession
 {
+    // NOTE only client connections have their own io_service to run operations with a timeout
+    std::unique_ptr<asio::io_service>       _ioService;
+    std::chrono::milliseconds               _timeout;
+    std::shared_ptr<AbortSignal>            _abort;
+    size_t                                  _abortHandlerId;
     std::shared_ptr<asio::ip::tcp::socket>  _socket;
     SessionId                               _id;
     Address                                 _remoteAddress;
@@ -193,12 +213,28 @@ class ProtoBufTcpStreamSession : public IProtoBufNetworkSession
     //      This still may be useful for debugging if we have any doubts about this statement being true.
     //std::mutex                              _socketReadMutex;
     
+    typedef std::function<void(const asio::error_code&)> CompletionHandler;
+    typedef std::chrono::steady_clock::time_point Deadline;
+    // Deadline of an operation started now, or the maximum time point without a timeout
+    Deadline NextDeadline() const;
+    std::shared_ptr<std::vector<asio::ip::tcp::endpoint>> ResolveUntil(
+        const NetworkEndpoint &endpoint, Deadline deadline );
+    void RunWithTimeout( const std::string &operationName, Deadline deadline,
+                         std::function<void(CompletionHandler)> startOperation );
+    void Read (asio::mutable_buffers_1 buffer, Deadline deadline);
+    template <typename ConstBufferSequence>
+    void Write(const ConstBufferSequence &buffers);
+    
 public:
 
     // Server connection to client with accepted socket
     ProtoBufTcpStreamSession(std::shared_ptr<asio::ip::tcp::socket> socket);
-    // Client connection to server, endpoint resolution to be done
-    ProtoBufTcpStreamSession(const NetworkEndpoint &endpoint);
+    // Client connection to server, endpoint resolution to be done.
+    // Connecting including name resolution, sending and receiving a message
+    // fails if not completed within a nonzero timeout or after the abort signal is raised.
+    ProtoBufTcpStreamSession( const NetworkEndpoint &endpoint,
+                              std::chrono::milliseconds timeout = std::chrono::milliseconds::zero(),
+                              std::shared_ptr<AbortSignal> abort = std::shared_ptr<AbortSignal>() );
     ~ProtoBufTcpStreamSession();
     
     const SessionId& id() const override;
@@ -206,6 +242,7 @@ public:
     
     iop::locnet::MessageWithHeader* ReceiveMessage() override;
     void SendMessage(iop::locnet::MessageWithHeader &message) override;
+    void SendRequest(const SerializedParts &serializedRequest) override;
     
 // TODO implement these
 //     void KeepAlive() override;
@@ -234,13 +271,17 @@ public:
 // Connection factory that creates a blocking TCP stream to communicate with remote node.
 class TcpStreamConnectionFactory : public INodeConnectionFactory
 {
-    std::function<void(const Address&)> _detectedIpCallback;
+    std::function<void(const IpAddress&)> _detectedIpCallback;
+    std::chrono::milliseconds             _timeout;
     
 public:
     
-    std::shared_ptr<INodeMethods> ConnectTo(const NetworkEndpoint &address) override;
+    TcpStreamConnectionFactory(std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+    
+    std::shared_ptr<INodeMethods> ConnectTo( const NetworkEndpoint &address,
+        std::shared_ptr<AbortSignal> abort = std::shared_ptr<AbortSignal>() ) override;
     
-    void detectedIpCallback(std::function<void(const Address&)> detectedIpCallback);
+    void detectedIpCallback(std::function<void(const IpAddress&)> detectedIpCallback);
 };
 
 
@@ -260,14 +301,59 @@ public:
 
 
 
+enum class NeighbourhoodChangeType : uint8_t
+{
+    Added   = 0,
+    Updated = 1,
+    Removed = 2,
+};
+
+
+// Neighbourhood changes collected to be sent in a single notification. Changes of the same node
+// are collapsed into one, e.g. a node added and then removed is not notified at all.
+// NOTE changes are serialized when added and the bytes are shared by batches of all sessions,
+//      so composing the notification request only adds a small prefix to the shared changes.
+class NeighbourhoodChangeBatch
+{
+    struct Change
+    {
+        NeighbourhoodChangeType             changeType;
+        std::shared_ptr<const std::string>  bytes; // NOTE null if collapsed into nothing
+    };
+    
+    std::vector<Change>                     _changes;
+    std::unordered_map<NodeId, size_t>      _positions;
+    size_t                                  _size;
+    
+public:
+    
+    NeighbourhoodChangeBatch();
+    
+    void Add(NeighbourhoodChangeType changeType, const NodeDbEntry &node);
+    
+    size_t size() const;
+    bool empty() const;
+    
+    // Serialized request with a NeighbourhoodChanged notification of all changes
+    SerializedParts SerializeRequest() const;
+};
+
+
+
+class CoalescingNotificationQueue;
+
 // Listener implementation that translates node notifications to protobuf
 // and uses a dispatcher to send them and notify a remote peer.
+// Changes are collected for a short while to be sent in batches, see Config::notificationDelay().
 class ProtoBufTcpStreamChangeListener : public IChangeListener
 {
     SessionId                                   _sessionId;
     std::shared_ptr<ILocalServiceMethods>       _localService;
     // std::shared_ptr<IProtoBufRequestDispatcher> _dispatcher;
     std::shared_ptr<IProtoBufNetworkSession>    _session;
+    std::shared_ptr<CoalescingNotificationQueue> _notifications;
+    
+    void Notify(NeighbourhoodChangeType changeType, const NodeDbEntry &node);
     
 public:
     
@@ -0,0 +1,316 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <easylogging++.h>
+
+#include "snapshot.hpp"
+
+using namespace std;
+
+
+
+namespace LocNet
+{
+
+
+static const char SNAPSHOT_MAGIC[8] = { 'L', 'O', 'C', 'N', 'E', 'T', 'S', 'N' };
+
+const uint32_t NodeSnapshot::FORMAT_VERSION = 3;
+
+
+struct SnapshotHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t recordCount;
+    uint64_t generation;
+    uint32_t serviceCount;
+    uint32_t reserved;
+    uint64_t recordsOffset;
+    uint64_t servicesOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t fileSize;
+};
+
+struct SnapshotRecord
+{
+    int64_t  expiresAt;
+    float    latitude;
+    float    longitude;
+    uint32_t idOffset;
+    uint32_t addressOffset;
+    uint32_t firstService;
+    uint16_t idLength;
+    uint16_t addressLength;
+    uint16_t nodePort;
+    uint16_t clientPort;
+    uint16_t serviceCount;
+    uint8_t  relationType;
+    uint8_t  roleType;
+};
+
+struct SnapshotService
+{
+    uint32_t dataOffset;
+    uint32_t dataLength;
+    uint16_t port;
+    uint8_t  type;
+    uint8_t  reserved;
+};
+
+
+
+uint64_t AlignedSize(uint64_t size)
+    { return (size + 7) & ~uint64_t(7); }
+
+
+#ifndef _WIN32
+// Makes sure that written content of a file or a directory entry survives a crash
+void SyncToDisk(const string &path, int openFlags)
+{
+    int fileDescriptor = open( path.c_str(), openFlags );
+    if (fileDescriptor < 0)
+    {
+        LOG(ERROR) << "Failed to open for sync: " << path;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to open for sync: " + path);
+    }
+    scope_exit closeFile( [fileDescriptor] { close(fileDescriptor); } );
+
+    if ( fsync(fileDescriptor) != 0 )
+    {
+        LOG(ERROR) << "Failed to sync to disk: " << path;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to sync to disk: " + path);
+    }
+}
+#endif
+
+
+
+void NodeSnapshot::Write( const string &path, const vector<NodeSnapshotEntry> &entries,
+                          uint64_t generation )
+{
+    string strings;
+    auto addString = [&strings] (const string &value, uint32_t &offset)
+    {
+        offset = static_cast<uint32_t>( strings.size() );
+        strings += value;
+    };
+
+    vector<SnapshotRecord>  records( entries.size() );
+    vector<SnapshotService> services;
+    for (size_t recordIdx = 0; recordIdx < entries.size(); ++recordIdx)
+    {
+        const NodeDbEntry &entry = entries[recordIdx].entry;
+        const string addressBytes = entry.contact().AddressBytes();
+        if ( entry.id().size() > UINT16_MAX )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node data is too long for a snapshot"); }
+
+        SnapshotRecord &record = records[recordIdx];
+        memset( &record, 0, sizeof(record) );
+        record.expiresAt     = entries[recordIdx].expiresAt;
+        record.latitude      = entry.location().latitude();
+        record.longitude     = entry.location().longitude();
+        record.idLength      = static_cast<uint16_t>( entry.id().size() );
+        record.addressLength = static_cast<uint16_t>( addressBytes.size() );
+        record.nodePort      = entry.contact().nodePort();
+        record.clientPort    = entry.contact().clientPort();
+        record.relationType  = static_cast<uint8_t>( entry.relationType() );
+        record.roleType      = static_cast<uint8_t>( entry.roleType() );
+        record.firstService  = static_cast<uint32_t>( services.size() );
+        record.serviceCount  = static_cast<uint16_t>( entry.services().size() );
+        addString( entry.id(), record.idOffset );
+        addString( addressBytes, record.addressOffset );
+
+        for (const auto &serviceInfo : entry.services())
+        {
+            SnapshotService service;
+            memset( &service, 0, sizeof(service) );
+            service.type       = static_cast<uint8_t>( serviceInfo.type() );
+            service.port       = serviceInfo.port();
+            service.dataLength = static_cast<uint32_t>( serviceInfo.customData().size() );
+            addString( serviceInfo.customData(), service.dataOffset );
+            services.push_back(service);
+        }
+    }
+
+    SnapshotHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) );
+    header.version          = FORMAT_VERSION;
+    header.recordCount      = static_cast<uint32_t>( records.size() );
+    header.generation       = generation;
+    header.serviceCount     = static_cast<uint32_t>( services.size() );
+    header.recordsOffset    = AlignedSize( sizeof(header) );
+    header.servicesOffset   = AlignedSize( header.recordsOffset  + records.size()  * sizeof(SnapshotRecord) );
+    header.stringsOffset    = AlignedSize( header.servicesOffset + services.size() * sizeof(SnapshotService) );
+    header.stringsSize      = strings.size();
+    header.fileSize         = header.stringsOffset + strings.size();
+
+    string tempPath = path + ".tmp";
+    {
+        ofstream file(tempPath, ios::binary | ios::trunc);
+        auto writeSection = [&file] (uint64_t offset, const void *data, size_t size)
+        {
+            static const char padding[8] = {};
+            file.write( padding, offset - static_cast<uint64_t>( file.tellp() ) );
+            file.write( static_cast<const char*>(data), size );
+        };
+        writeSection( 0, &header, sizeof(header) );
+        writeSection( header.recordsOffset,    records.data(),    records.size()    * sizeof(SnapshotRecord) );
+        writeSection( header.servicesOffset,   services.data(),   services.size()   * sizeof(SnapshotService) );
+        writeSection( header.stringsOffset,    strings.data(),    strings.size() );
+        file.flush();
+        if (! file)
+        {
+            LOG(ERROR) << "Failed to write snapshot file " << tempPath;
+            throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to write snapshot file " + tempPath);
+        }
+    }
+
+#ifdef _WIN32
+    remove( path.c_str() ); // NOTE rename does not overwrite existing files on Windows
+#else
+    // NOTE content must be on disk before the rename, otherwise a crash may leave an empty or partial file
+    SyncToDisk(tempPath, O_WRONLY);
+#endif
+    if ( rename( tempPath.c_str(), path.c_str() ) != 0 )
+    {
+        LOG(ERROR) << "Failed to rename snapshot file " << tempPath;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to rename snapshot file " + tempPath);
+    }
+#ifndef _WIN32
+    size_t separatorPos = path.find_last_of('/');
+    string directory = separatorPos == string::npos ? "." :
+        separatorPos == 0 ? "/" : path.substr(0, separatorPos);
+    SyncToDisk(directory, O_RDONLY);
+#endif
+}
+
+
+
+NodeSnapshot::NodeSnapshot(const string &path) :
+    _data(nullptr), _size(0), _buffer(), _header(nullptr), _records(nullptr),
+    _services(nullptr), _strings(nullptr)
+{
+#ifdef _WIN32
+    ifstream file(path, ios::binary);
+    if (! file)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Failed to open snapshot file " + path); }
+    _buffer.assign( istreambuf_iterator<char>(file), istreambuf_iterator<char>() );
+    _data = _buffer.data();
+    _size = _buffer.size();
+#else
+    int fileDescriptor = open( path.c_str(), O_RDONLY );
+    if (fileDescriptor < 0)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Failed to open snapshot file " + path); }
+    scope_exit closeFile( [fileDescriptor] { close(fileDescriptor); } );
+
+    struct stat fileStatus;
+    if ( fstat(fileDescriptor, &fileStatus) != 0 )
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to query size of snapshot file " + path); }
+    _size = static_cast<size_t>(fileStatus.st_size);
+    if ( _size < sizeof(SnapshotHeader) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot file is truncated: " + path); }
+
+    void *mapping = mmap( nullptr, _size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0 );
+    if (mapping == MAP_FAILED)
+        { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to map snapshot file " + path); }
+    _data = static_cast<const char*>(mapping);
+#endif
+
+    scope_error unmap( [this] { Unmap(); } );
+    Validate();
+
+    _header     = reinterpret_cast<const SnapshotHeader*>(_data);
+    _records    = reinterpret_cast<const SnapshotRecord*> ( _data + _header->recordsOffset );
+    _services   = reinterpret_cast<const SnapshotService*>( _data + _header->servicesOffset );
+    _strings    = _data + _header->stringsOffset;
+}
+
+
+NodeSnapshot::~NodeSnapshot()
+    { Unmap(); }
+
+
+void NodeSnapshot::Unmap()
+{
+#ifndef _WIN32
+    if (_data != nullptr)
+        { munmap( const_cast<char*>(_data), _size ); }
+#endif
+    _data = nullptr;
+}
+
+
+// NOTE only the structure is checked, record contents are trusted as we have written them
+void NodeSnapshot::Validate() const
+{
+    if ( _size < sizeof(SnapshotHeader) )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot file is truncated"); }
+
+    const SnapshotHeader &header = *reinterpret_cast<const SnapshotHeader*>(_data);
+    if ( memcmp( header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) ) != 0 )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Not a snapshot file"); }
+    if (header.version != FORMAT_VERSION)
+        { throw LocationNetworkError(ErrorCode::ERROR_UNSUPPORTED, "Unsupported snapshot version " + to_string(header.version) ); }
+
+    if ( header.fileSize != _size || header.recordsOffset < sizeof(SnapshotHeader) ||
+         header.recordsOffset  + uint64_t(header.recordCount)  * sizeof(SnapshotRecord)  > header.servicesOffset ||
+         header.servicesOffset + uint64_t(header.serviceCount) * sizeof(SnapshotService) > header.stringsOffset ||
+         header.stringsOffset  + header.stringsSize != header.fileSize )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot file is corrupted"); }
+}
+
+
+string NodeSnapshot::String(uint32_t offset, uint32_t length) const
+{
+    if (uint64_t(offset) + length > _header->stringsSize)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot string is out of range"); }
+    return string(_strings + offset, length);
+}
+
+
+uint64_t NodeSnapshot::generation() const
+    { return _header->generation; }
+
+size_t NodeSnapshot::size() const
+    { return _header->recordCount; }
+
+
+NodeSnapshotEntry NodeSnapshot::Entry(size_t index) const
+{
+    if ( index >= size() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot record index is out of range"); }
+
+    const SnapshotRecord &record = _records[index];
+    if (uint64_t(record.firstService) + record.serviceCount > _header->serviceCount)
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Snapshot service index is out of range"); }
+
+    NodeInfo::Services services;
+    for (size_t serviceIdx = record.firstService; serviceIdx < record.firstService + record.serviceCount; ++serviceIdx)
+    {
+        const SnapshotService &service = _services[serviceIdx];
+        ServiceType type = static_cast<ServiceType>(service.type);
+        services.set( ServiceInfo( type, service.port, String(service.dataOffset, service.dataLength) ) );
+    }
+
+    return NodeSnapshotEntry{ NodeDbEntry(
+        NodeInfo( String(record.idOffset, record.idLength), GpsLocation(record.latitude, record.longitude),
+                  NodeContact( IpAddress::FromBytes( String(record.addressOffset, record.addressLength) ),
+                               record.nodePort, record.clientPort ),
+                  services ),
+        static_cast<NodeRelationType>(record.relationType), static_cast<NodeContactRoleType>(record.roleType) ),
+        static_cast<time_t>(record.expiresAt) };
+}
+
+
+} // namespace LocNet
@@ -0,0 +1,77 @@
+#ifndef __LOCNET_SNAPSHOT_H__
+#define __LOCNET_SNAPSHOT_H__
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "spatialdb.hpp"
+
+
+
+namespace LocNet
+{
+
+
+struct SnapshotHeader;
+struct SnapshotRecord;
+struct SnapshotService;
+
+
+// A node with its expiration time as saved into a snapshot
+struct NodeSnapshotEntry
+{
+    NodeDbEntry entry;
+    time_t      expiresAt;
+};
+
+
+// Compact, versioned binary image of the whole node map, mapped read-only into memory
+// so the in-memory engine can be filled without running any SQL query on startup.
+// NOTE queries are never served from the mapping, its records are only decoded once on loading.
+// File layout (native byte order, every section aligned to 8 bytes):
+//   header with section offsets and a generation number to check if it's up to date,
+//   fixed size node records,
+//   fixed size service records,
+//   string heap of node ids, binary ip addresses and service data referenced by records.
+class NodeSnapshot
+{
+    const char  *_data;
+    size_t       _size;
+    std::vector<char> _buffer; // NOTE used instead of a mapping where mmap is not available
+
+    const SnapshotHeader  *_header;
+    const SnapshotRecord  *_records;
+    const SnapshotService *_services;
+    const char            *_strings;
+
+    void Unmap();
+    void Validate() const;
+    std::string String(uint32_t offset, uint32_t length) const;
+
+public:
+
+    static const uint32_t FORMAT_VERSION;
+
+    // Writes a new snapshot file, replacing any existing one only after successfully written
+    static void Write( const std::string &path, const std::vector<NodeSnapshotEntry> &entries,
+                       uint64_t generation );
+
+    // Maps the given snapshot file, throws if it does not exist or is invalid
+    NodeSnapshot(const std::string &path);
+    ~NodeSnapshot();
+
+    NodeSnapshot(const NodeSnapshot &other) = delete;
+    NodeSnapshot& operator=(const NodeSnapshot &other) = delete;
+
+    uint64_t generation() const;
+    size_t size() const;
+
+    NodeSnapshotEntry Entry(size_t index) const;
+};
+
+
+} // namespace LocNet
+
+
+#endif // __LOCNET_SNAPSHOT_H__
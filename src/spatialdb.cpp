@@ -1,11 +1,15 @@
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <limits>
+#include <unordered_set>
 
 #include <easylogging++.h>
 #include <sqlite3.h>
 #include <spatialite.h>
 
+#include "geodesy.hpp"
+#include "snapshot.hpp"
 #include "spatialdb.hpp"
 
 using namespace std;
@@ -31,7 +35,8 @@ const vector<string> DatabaseInitCommands = {
     "  VALUES ('version', '1');"
     
     "CREATE TABLE IF NOT EXISTS nodes ( "
-    "  id           TEXT PRIMARY KEY, "
+    "  rid          INTEGER PRIMARY KEY, " // Stable alias of rowid, referenced by the spatial index
+    "  id           TEXT NOT NULL UNIQUE, "
     "  ipAddress    TEXT NOT NULL, "
     "  nodePort     INT NOT NULL, "
     "  clientPort   INT NOT NULL, "
@@ -53,6 +58,75 @@ const vector<string> DatabaseInitCommands = {
 "END TRANSACTION;" };
 
 
+// Nodes tables created before version 4 have no INTEGER PRIMARY KEY, so their implicit rowids
+// may be renumbered by VACUUM. They are rebuilt with an explicit key, the spatial index is recreated after.
+const vector<string> DatabaseRowIdMigrationCommands = {
+"BEGIN TRANSACTION;",
+    "DROP TRIGGER IF EXISTS nodes_rtree_insert;"
+    "DROP TRIGGER IF EXISTS nodes_rtree_update;"
+    "DROP TRIGGER IF EXISTS nodes_rtree_delete;"
+    "DROP TABLE IF EXISTS nodes_rtree;"
+    
+    "CREATE TABLE nodes_migrated ( "
+    "  rid          INTEGER PRIMARY KEY, "
+    "  id           TEXT NOT NULL UNIQUE, "
+    "  ipAddress    TEXT NOT NULL, "
+    "  nodePort     INT NOT NULL, "
+    "  clientPort   INT NOT NULL, "
+    "  relationType INT NOT NULL, "
+    "  roleType     INT NOT NULL, "
+    "  expiresAt    INT NOT NULL, "
+    "  location     POINT NOT NULL "
+    ");"
+    
+    "INSERT INTO nodes_migrated (id, ipAddress, nodePort, clientPort, relationType, roleType, expiresAt, location) "
+    "  SELECT id, ipAddress, nodePort, clientPort, relationType, roleType, expiresAt, location FROM nodes;"
+    "DROP TABLE nodes;"
+    "ALTER TABLE nodes_migrated RENAME TO nodes;"
+"END TRANSACTION;" };
+
+
+// Schema changes since version 1. All commands are idempotent and run on every startup
+// so both newly created and existing databases are upgraded to the current version.
+const vector<string> DatabaseUpgradeCommands = {
+"BEGIN TRANSACTION;",
+    // Spatial index of node locations, keyed by the explicit integer primary key of the nodes table
+    "CREATE VIRTUAL TABLE IF NOT EXISTS nodes_rtree USING rtree( "
+    "  id, minLon, maxLon, minLat, maxLat "
+    ");"
+    
+    "CREATE TRIGGER IF NOT EXISTS nodes_rtree_insert AFTER INSERT ON nodes "
+    "BEGIN "
+    "  INSERT INTO nodes_rtree (id, minLon, maxLon, minLat, maxLat) VALUES ( "
+    "    new.rid, X(new.location), X(new.location), Y(new.location), Y(new.location) ); "
+    "END;"
+    
+    "CREATE TRIGGER IF NOT EXISTS nodes_rtree_update AFTER UPDATE OF location ON nodes "
+    "  WHEN X(old.location) != X(new.location) OR Y(old.location) != Y(new.location) "
+    "BEGIN "
+    "  UPDATE nodes_rtree SET "
+    "    minLon = X(new.location), maxLon = X(new.location), "
+    "    minLat = Y(new.location), maxLat = Y(new.location) "
+    "  WHERE id = new.rid; "
+    "END;"
+    
+    "CREATE TRIGGER IF NOT EXISTS nodes_rtree_delete AFTER DELETE ON nodes "
+    "BEGIN "
+    "  DELETE FROM nodes_rtree WHERE id = old.rid; "
+    "END;"
+    
+    "INSERT INTO nodes_rtree (id, minLon, maxLon, minLat, maxLat) "
+    "  SELECT rid, X(location), X(location), Y(location), Y(location) FROM nodes "
+    "  WHERE rid NOT IN (SELECT id FROM nodes_rtree);"
+    
+    "CREATE INDEX IF NOT EXISTS nodes_relationType ON nodes (relationType);"
+    "CREATE INDEX IF NOT EXISTS nodes_roleType ON nodes (roleType);"
+    "CREATE INDEX IF NOT EXISTS nodes_expiresAt ON nodes (expiresAt);"
+    
+    "UPDATE metainfo SET value = '4' WHERE key = 'version';"
+"END TRANSACTION;" };
+
+
 
 
 NodeDbEntry::NodeDbEntry(const NodeDbEntry& other) :
@@ -76,19 +150,30 @@ bool NodeDbEntry::operator==(const NodeDbEntry& other) const
 
 
 
+ThreadSafeChangeListenerRegistry::ThreadSafeChangeListenerRegistry() :
+    _mutex(), _listeners( make_shared<Listeners>() ) {}
+
+
 void ThreadSafeChangeListenerRegistry::AddListener(shared_ptr<IChangeListener> listener)
 {
     lock_guard<mutex> lock(_mutex);
     if (listener == nullptr)
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Attempt to register listener instance null"); }
     
-    if ( _listeners.find( listener->sessionId() ) != _listeners.end() )
+    shared_ptr<const Listeners> current = atomic_load(&_listeners);
+    for (const auto &registered : *current)
     {
-        LOG(DEBUG) << "Session already have a registered listener, ignore request to add new one";
-        return;
+        if ( registered->sessionId() == listener->sessionId() )
+        {
+            LOG(DEBUG) << "Session already have a registered listener, ignore request to add new one";
+            return;
+        }
     }
     
-    _listeners[ listener->sessionId() ] = listener;
+    shared_ptr<Listeners> updated = make_shared<Listeners>(*current);
+    updated->push_back(listener);
+    atomic_store( &_listeners, shared_ptr<const Listeners>(updated) );
+    
     listener->OnRegistered();
     LOG(DEBUG) << "Registered ChangeListener for session " << listener->sessionId();
 }
@@ -97,18 +182,237 @@ void ThreadSafeChangeListenerRegistry::AddListener(shared_ptr<IChangeListener> l
 void ThreadSafeChangeListenerRegistry::RemoveListener(const SessionId& sessionId)
 {
     lock_guard<mutex> lock(_mutex);
-    _listeners.erase(sessionId);
+    shared_ptr<const Listeners> current = atomic_load(&_listeners);
+    shared_ptr<Listeners> updated = make_shared<Listeners>();
+    updated->reserve( current->size() );
+    for (const auto &registered : *current)
+    {
+        if ( registered->sessionId() != sessionId )
+            { updated->push_back(registered); }
+    }
+    atomic_store( &_listeners, shared_ptr<const Listeners>(updated) );
     LOG(DEBUG) << "Deregistered ChangeListener for session " << sessionId;
 }
 
 
-vector<shared_ptr<IChangeListener>> ThreadSafeChangeListenerRegistry::listeners() const
+shared_ptr<const ThreadSafeChangeListenerRegistry::Listeners> ThreadSafeChangeListenerRegistry::listeners() const
+    { return atomic_load(&_listeners); }
+
+
+
+NodeRelationIndex::NodeRelationIndex() :
+    _mutex(), _random( random_device()() ), _positions(), _ids() {}
+
+
+void NodeRelationIndex::Add(const NodeId &nodeId, NodeRelationType relationType)
+{
+    lock_guard<mutex> lock(_mutex);
+    auto position = _positions.find(nodeId);
+    if ( position != _positions.end() )
+    {
+        if (position->second.first == relationType)
+            { return; }
+        RemoveUnlocked(position);
+    }
+    
+    vector<NodeId> &ids = _ids[relationType];
+    _positions[nodeId] = make_pair( relationType, ids.size() );
+    ids.push_back(nodeId);
+}
+
+
+void NodeRelationIndex::Remove(const NodeId &nodeId)
+{
+    lock_guard<mutex> lock(_mutex);
+    auto position = _positions.find(nodeId);
+    if ( position != _positions.end() )
+        { RemoveUnlocked(position); }
+}
+
+
+void NodeRelationIndex::RemoveUnlocked(Positions::iterator position)
+{
+    vector<NodeId> &ids = _ids[position->second.first];
+    size_t index = position->second.second;
+    if ( index + 1 != ids.size() )
+    {
+        ids[index] = move( ids.back() );
+        _positions[ ids[index] ].second = index;
+    }
+    ids.pop_back();
+    _positions.erase(position);
+}
+
+
+size_t NodeRelationIndex::Count() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _positions.size();
+}
+
+
+size_t NodeRelationIndex::Count(NodeRelationType relationType) const
+{
+    lock_guard<mutex> lock(_mutex);
+    auto ids = _ids.find(relationType);
+    return ids == _ids.end() ? 0 : ids->second.size();
+}
+
+
+vector<NodeId> NodeRelationIndex::Ids(NodeRelationType relationType) const
+{
+    lock_guard<mutex> lock(_mutex);
+    auto ids = _ids.find(relationType);
+    return ids == _ids.end() ? vector<NodeId>() : ids->second;
+}
+
+
+vector<NodeId> NodeRelationIndex::RandomSample( size_t maxNodeCount,
+    const vector<NodeRelationType> &relationTypes ) const
+{
+    lock_guard<mutex> lock(_mutex);
+    
+    // Sample indexes are taken from the concatenation of id arrays of the given relation types
+    vector<const vector<NodeId>*> idArrays;
+    size_t totalCount = 0;
+    for (NodeRelationType relationType : relationTypes)
+    {
+        auto ids = _ids.find(relationType);
+        if ( ids == _ids.end() )
+            { continue; }
+        idArrays.push_back( &ids->second );
+        totalCount += ids->second.size();
+    }
+    
+    auto idAt = [&idArrays] (size_t index) -> const NodeId&
+    {
+        for (const auto *ids : idArrays)
+        {
+            if ( index < ids->size() )
+                { return (*ids)[index]; }
+            index -= ids->size();
+        }
+        throw LocationNetworkError(ErrorCode::ERROR_CONCEPTUAL, "Sample index out of range");
+    };
+    
+    vector<NodeId> result;
+    if (maxNodeCount >= totalCount)
+    {
+        result.reserve(totalCount);
+        for (size_t index = 0; index < totalCount; ++index)
+            { result.push_back( idAt(index) ); }
+    }
+    else
+    {
+        // Robert Floyd's algorithm for selecting distinct indexes in O(maxNodeCount) steps
+        unordered_set<size_t> selected;
+        result.reserve(maxNodeCount);
+        for (size_t upperBound = totalCount - maxNodeCount; upperBound < totalCount; ++upperBound)
+        {
+            size_t index = uniform_int_distribution<size_t>(0, upperBound)(_random);
+            if ( ! selected.insert(index).second )
+            {
+                index = upperBound;
+                selected.insert(index);
+            }
+            result.push_back( idAt(index) );
+        }
+    }
+    
+    shuffle( result.begin(), result.end(), _random );
+    return result;
+}
+
+
+
+NeighbourDistanceIndex::NeighbourDistanceIndex(const GpsLocation &origin) :
+    _mutex(), _origin(origin), _ordered(), _locations() {}
+
+
+NeighbourDistanceIndex::Key NeighbourDistanceIndex::KeyOf(
+    const NodeId &nodeId, const GpsLocation &location) const
+    { return Key( GeodesicDistanceKm(_origin, location), nodeId ); }
+
+
+void NeighbourDistanceIndex::origin(const GpsLocation &origin)
+{
+    lock_guard<mutex> lock(_mutex);
+    if (_origin == origin)
+        { return; }
+    
+    _origin = origin;
+    for (auto &key : _ordered)
+        { key.first = GeodesicDistanceKm( _origin, _locations.at(key.second) ); }
+    sort( _ordered.begin(), _ordered.end() );
+}
+
+
+void NeighbourDistanceIndex::Update(const NodeDbEntry &node)
+{
+    lock_guard<mutex> lock(_mutex);
+    RemoveUnlocked( node.id() );
+    if ( node.relationType() != NodeRelationType::Neighbour )
+        { return; }
+    
+    Key key = KeyOf( node.id(), node.location() );
+    _ordered.insert( lower_bound( _ordered.begin(), _ordered.end(), key ), key );
+    _locations.emplace( node.id(), node.location() );
+}
+
+
+void NeighbourDistanceIndex::Remove(const NodeId &nodeId)
+{
+    lock_guard<mutex> lock(_mutex);
+    RemoveUnlocked(nodeId);
+}
+
+
+void NeighbourDistanceIndex::RemoveUnlocked(const NodeId &nodeId)
+{
+    auto location = _locations.find(nodeId);
+    if ( location == _locations.end() )
+        { return; }
+    
+    auto position = lower_bound( _ordered.begin(), _ordered.end(), KeyOf(nodeId, location->second) );
+    if ( position != _ordered.end() && position->second == nodeId )
+        { _ordered.erase(position); }
+    _locations.erase(location);
+}
+
+
+size_t NeighbourDistanceIndex::Count() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _ordered.size();
+}
+
+
+size_t NeighbourDistanceIndex::Rank(const NodeId &nodeId) const
+{
+    lock_guard<mutex> lock(_mutex);
+    auto location = _locations.find(nodeId);
+    if ( location == _locations.end() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node is not a neighbour: " + nodeId); }
+    
+    auto position = lower_bound( _ordered.begin(), _ordered.end(), KeyOf(nodeId, location->second) );
+    return position - _ordered.begin();
+}
+
+
+NodeId NeighbourDistanceIndex::IdAt(size_t rank) const
+{
+    lock_guard<mutex> lock(_mutex);
+    return rank < _ordered.size() ? _ordered[rank].second : NodeId();
+}
+
+
+vector<NodeId> NeighbourDistanceIndex::Ids() const
 {
     lock_guard<mutex> lock(_mutex);
-    vector<shared_ptr<IChangeListener>> result;
-    for (const auto &listenerEntry : _listeners)
-        { result.push_back(listenerEntry.second); }
-    //LOG(DEBUG) << "Listener count " << result.size();
+    vector<NodeId> result;
+    result.reserve( _ordered.size() );
+    for (const auto &key : _ordered)
+        { result.push_back(key.second); }
     return result;
 }
 
@@ -149,6 +453,61 @@ void ExecuteSql(sqlite3 *dbHandle, const string &sql)
 }
 
 
+bool HasNodeRowIdColumn(sqlite3 *dbHandle)
+{
+    sqlite3_stmt *statement = nullptr;
+    if ( sqlite3_prepare_v2( dbHandle, "PRAGMA table_info(nodes)", -1, &statement, nullptr ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to prepare table info query: " << sqlite3_errmsg(dbHandle);
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare table info query");
+    }
+    scope_exit finalizeStatement( [statement] { sqlite3_finalize(statement); } );
+    
+    while ( sqlite3_step(statement) == SQLITE_ROW )
+    {
+        const char *columnName = reinterpret_cast<const char*>( sqlite3_column_text(statement, 1) );
+        if ( columnName != nullptr && string(columnName) == "rid" )
+            { return true; }
+    }
+    return false;
+}
+
+
+// Serializes writers and runs their statements in a single transaction.
+// Changes are rolled back unless explicitly committed, e.g. when an exception is thrown.
+class WriteTransaction
+{
+    unique_lock<mutex> _lock;
+    sqlite3                     *_dbHandle;
+    bool                         _committed;
+    
+public:
+    
+    WriteTransaction(mutex &writeMutex, sqlite3 *dbHandle) :
+        _lock(writeMutex), _dbHandle(dbHandle), _committed(false)
+    {
+        // NOTE IMMEDIATE takes the write lock right away instead of failing later with SQLITE_BUSY
+        ExecuteSql(_dbHandle, "BEGIN IMMEDIATE TRANSACTION;");
+    }
+    
+    ~WriteTransaction()
+    {
+        if (! _committed)
+        {
+            int rollbackResult = sqlite3_exec(_dbHandle, "ROLLBACK TRANSACTION;", nullptr, nullptr, nullptr);
+            if (rollbackResult != SQLITE_OK)
+                { LOG(ERROR) << "Failed to roll back transaction, error code: " << rollbackResult; }
+        }
+    }
+    
+    void Commit()
+    {
+        ExecuteSql(_dbHandle, "COMMIT TRANSACTION;");
+        _committed = true;
+    }
+};
+
+
 // void QuerySql(sqlite3 *dbHandle, const string &queryStr)
 // {
 //     char **results;
@@ -168,24 +527,161 @@ void ExecuteSql(sqlite3 *dbHandle, const string &sql)
 
 
 
-string LocationPointSql(const GpsLocation &location)
+SqlStatementCache::SqlStatementCache(sqlite3 *dbHandle) :
+    _dbHandle(dbHandle), _mutex(), _statements() {}
+
+
+SqlStatementCache::~SqlStatementCache()
+{
+    // NOTE all statements must be finalized before the connection can be closed
+    for (auto &entry : _statements)
+        { sqlite3_finalize(entry.second); }
+}
+
+
+shared_ptr<sqlite3_stmt> SqlStatementCache::Acquire(const string &sql)
+{
+    sqlite3_stmt *statement = nullptr;
+    {
+        lock_guard<mutex> lock(_mutex);
+        auto it = _statements.find(sql);
+        if ( it != _statements.end() )
+        {
+            statement = it->second;
+            _statements.erase(it);
+        }
+    }
+    
+    if (statement == nullptr)
+    {
+        int prepResult = sqlite3_prepare_v2( _dbHandle, sql.c_str(), -1, &statement, nullptr );
+        if (prepResult != SQLITE_OK)
+        {
+            LOG(ERROR) << "Failed to prepare statement: " << sql;
+            LOG(ERROR) << "Error was: " << sqlite3_errmsg(_dbHandle);
+            throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement");
+        }
+    }
+    
+    return shared_ptr<sqlite3_stmt>( statement,
+        [this, sql] (sqlite3_stmt *stmt) { Release(sql, stmt); } );
+}
+
+
+void SqlStatementCache::Release(const string &sql, sqlite3_stmt *statement)
+{
+    // NOTE reset must happen even after a failed step, otherwise the statement
+    //      may keep a read transaction open on the connection
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    
+    lock_guard<mutex> lock(_mutex);
+    _statements.emplace(sql, statement);
+}
+
+
+
+// Binds params firstIndex and firstIndex+1 for a "MakePoint(?, ?)" expression
+void BindLocation(sqlite3_stmt *statement, int firstIndex, const GpsLocation &location)
+{
+    if ( sqlite3_bind_double( statement, firstIndex,     location.longitude() ) != SQLITE_OK ||
+         sqlite3_bind_double( statement, firstIndex + 1, location.latitude()  ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to bind location params";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind location params");
+    }
+}
+
+
+
+SpatiaLiteConnection::SpatiaLiteConnection(const string &dbPath, int openFlags) :
+    _dbHandle(nullptr), _spatialiteConnection( spatialite_alloc_connection() ), _statements()
+{
+    int openResult = sqlite3_open_v2 ( dbPath.c_str(), &_dbHandle, openFlags, nullptr); // nullptr: no vFS module to use
+    if (openResult != SQLITE_OK)
+    {
+        LOG(ERROR) << "Failed to open/create SpatiaLite database file " << dbPath;
+        sqlite3_close(_dbHandle);
+        spatialite_cleanup_ex(_spatialiteConnection);
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to open SpatiaLite database");
+    }
+    scope_error closeDbOnError( [this] { sqlite3_close(_dbHandle); } );
+    
+#ifndef _WIN32
+    spatialite_init_ex(_dbHandle, _spatialiteConnection, 0);
+    scope_error cleanupOnError( [this] { spatialite_cleanup_ex(_spatialiteConnection); } );
+#else
+    sqlite3_enable_load_extension(_dbHandle, 1);
+    sqlite3_load_extension(_dbHandle, "mod_spatialite", nullptr, nullptr);
+#endif
+    
+    // Wait instead of failing immediately if the database is locked, e.g. during a WAL checkpoint
+    sqlite3_busy_timeout(_dbHandle, 5000);
+    _statements.reset( new SqlStatementCache(_dbHandle) );
+}
+
+
+SpatiaLiteConnection::~SpatiaLiteConnection()
+{
+    // NOTE all statements must be finalized before the connection can be closed
+    _statements.reset();
+    sqlite3_close(_dbHandle);
+#ifndef _WIN32
+    spatialite_cleanup_ex(_spatialiteConnection);
+#endif
+}
+
+
+sqlite3* SpatiaLiteConnection::handle()
+    { return _dbHandle; }
+
+SqlStatementCache& SpatiaLiteConnection::statements()
+    { return *_statements; }
+
+
+
+SpatiaLiteConnectionPool::SpatiaLiteConnectionPool(const string &dbPath, size_t connectionCount) :
+    _mutex(), _connectionReleased(), _connections(), _idleConnections()
+{
+    for (size_t idx = 0; idx < connectionCount; ++idx)
+    {
+        _connections.emplace_back( new SpatiaLiteConnection( dbPath,
+            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI ) );
+        _idleConnections.push_back( _connections.back().get() );
+    }
+    LOG(DEBUG) << "Opened " << connectionCount << " reader connections";
+}
+
+
+shared_ptr<SpatiaLiteConnection> SpatiaLiteConnectionPool::Acquire()
 {
-    // NOTE int-based numbers, no string or user input, so no SQL injection vulnerability
-    return string( "MakePoint(" +
-        to_string( location.longitude() ) + "," + 
-        to_string( location.latitude()  ) + ")" );
+    unique_lock<mutex> lock(_mutex);
+    _connectionReleased.wait( lock, [this] { return ! _idleConnections.empty(); } );
+    SpatiaLiteConnection *connection = _idleConnections.back();
+    _idleConnections.pop_back();
+    
+    return shared_ptr<SpatiaLiteConnection>( connection, [this] (SpatiaLiteConnection *released)
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _idleConnections.push_back(released);
+        }
+        _connectionReleased.notify_one();
+    } );
 }
 
 
 
-vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(const GpsLocation &fromLocation,
-    const string &whereCondition, const string orderBy, const string &limit) const
+vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(SpatiaLiteConnection &connection, const GpsLocation &fromLocation,
+    const string &whereCondition, const string orderBy, const string &limit,
+    ParamBinder bindParams, ServiceDetails services) const
 {
-    sqlite3_stmt *statement;
+    // NOTE conditions must not contain varying values, those are bound by bindParams
+    //      starting from index 3, so the query string and its cached statement can be reused
     string queryStr =
         "SELECT id, ipAddress, nodePort, clientPort, X(location), Y(location), "
             "relationType, roleType, expiresAt, "
-            "Distance(location, " + LocationPointSql(fromLocation) + ", 1) / 1000 AS dist_km "
+            "Distance(location, MakePoint(?, ?), 1) / 1000 AS dist_km "
         "FROM nodes " +
         whereCondition + " " +
         orderBy + " " +
@@ -193,14 +689,12 @@ vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(const GpsLocation &fromLoca
     
     //LOG(DEBUG) << "Running query: " << queryStr;
     
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to get neighbourhood");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    shared_ptr<sqlite3_stmt> statementGuard = connection.statements().Acquire(queryStr);
+    sqlite3_stmt *statement = statementGuard.get();
+    
+    BindLocation(statement, 1, fromLocation);
+    if (bindParams)
+        { bindParams(statement); }
     
     vector<NodeDbEntry> result;
     while ( sqlite3_step(statement) == SQLITE_ROW )
@@ -217,15 +711,15 @@ vector<NodeDbEntry> SpatiaLiteDatabase::QueryEntries(const GpsLocation &fromLoca
         
         NodeContact contact( reinterpret_cast<const char*>(ipAddrPtr),
                              static_cast<TcpPort>(nodePort), static_cast<TcpPort>(clientPort) );
-        string nodeId( reinterpret_cast<const char*>(idPtr) );
-        NodeInfo::Services services = LoadServices(nodeId);
-        NodeInfo info( nodeId, GpsLocation(latitude, longitude), contact, services );
+        NodeInfo info( reinterpret_cast<const char*>(idPtr), GpsLocation(latitude, longitude), contact, {} );
         result.emplace_back( info,
             // TODO use some kind of checked conversion function from int to enums
             static_cast<NodeRelationType>(relationType),
             static_cast<NodeContactRoleType>(roleType) );
     }
     
+    if (services == ServiceDetails::Included)
+        { LoadServices(connection, result); }
     return result;
 }
 
@@ -237,32 +731,17 @@ NodeDbEntry ThisNodeToDbEntry(const NodeInfo &thisNodeInfo)
 // SpatiaLite initialization/shutdown sequence is documented here:
 // https://groups.google.com/forum/#!msg/spatialite-users/83SOajOJ2JU/sgi5fuYAVVkJ
 SpatiaLiteDatabase::SpatiaLiteDatabase( const NodeInfo& myNodeInfo, const string &dbPath,
-                                        chrono::duration<uint32_t> entryExpirationPeriod ) :
-    _myNodeInfo(myNodeInfo), _dbHandle(nullptr), _entryExpirationPeriod(entryExpirationPeriod)
+                                        chrono::duration<uint32_t> entryExpirationPeriod,
+                                        size_t readerConnectionCount ) :
+    _myNodeInfo(myNodeInfo), _entryExpirationPeriod(entryExpirationPeriod),
+    _neighbourIndex( myNodeInfo.location() )
 {
-    _spatialiteConnection = spatialite_alloc_connection();
-    
+    bool inMemoryDb = dbPath == IN_MEMORY_DB;
     bool creatingDb = ! FileExist(dbPath);
     
-    // TODO SQLITE_OPEN_FULLMUTEX performs operations sequentially using a mutex.
-    //      We might have to change to a more performant but more complicated model here.
-    int openResult = sqlite3_open_v2 ( dbPath.c_str(), &_dbHandle,
-         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_URI, nullptr); // nullptr: no vFS module to use
-    if (openResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to open/create SpatiaLite database file " << dbPath;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to open SpatiaLite database");
-    }
-    scope_error closeDbOnError( [this] { sqlite3_close(_dbHandle); } );
+    _writer.reset( new SpatiaLiteConnection( dbPath,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX | SQLITE_OPEN_URI ) );
     
-#ifndef _WIN32
-    spatialite_init_ex(_dbHandle, _spatialiteConnection, 0);
-    scope_error cleanupOnError( [this] { spatialite_cleanup_ex(_spatialiteConnection); } );
-#else
-    sqlite3_enable_load_extension(_dbHandle, 1);
-    sqlite3_load_extension(_dbHandle, "mod_spatialite", nullptr, nullptr);
-#endif
-
     LOG(TRACE) << "SQLite version: " << sqlite3_libversion();
     LOG(TRACE) << "SpatiaLite version: " << spatialite_version();
     
@@ -270,13 +749,47 @@ SpatiaLiteDatabase::SpatiaLiteDatabase( const NodeInfo& myNodeInfo, const string
     {
         LOG(INFO) << "No SpatiaLite database found, generating: " << dbPath;
         for (const string &command : DatabaseInitCommands)
-            { ExecuteSql(_dbHandle, command); }
+            { ExecuteSql(_writer->handle(), command); }
         LOG(INFO) << "Database initialized";
     }
+    if (! HasNodeRowIdColumn( _writer->handle() ) )
+    {
+        LOG(INFO) << "Migrating nodes table to have an explicit integer primary key";
+        for (const string &command : DatabaseRowIdMigrationCommands)
+            { ExecuteSql(_writer->handle(), command); }
+    }
+    for (const string &command : DatabaseUpgradeCommands)
+        { ExecuteSql(_writer->handle(), command); }
     
-    LOG(DEBUG) << "Updating node information in database";
-    vector<NodeDbEntry> selfEntries = QueryEntries( _myNodeInfo.location(),
-        "WHERE relationType = " + to_string( static_cast<uint32_t>(NodeRelationType::Self) ) );
+    if (! inMemoryDb)
+    {
+        // NOTE with WAL readers see a consistent snapshot and don't block the writer or each other.
+        //      Synchronous NORMAL is durable enough here: a crash might lose only the last few
+        //      node updates which are anyway renewed periodically, but cannot corrupt the database.
+        ExecuteSql(_writer->handle(), "PRAGMA journal_mode = WAL;");
+        ExecuteSql(_writer->handle(), "PRAGMA synchronous = NORMAL;");
+        _readers.reset( new SpatiaLiteConnectionPool( dbPath, max<size_t>(readerConnectionCount, 1) ) );
+    }
+    
+    {
+        shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire("SELECT id, relationType FROM nodes");
+        sqlite3_stmt *statement = statementGuard.get();
+        while ( sqlite3_step(statement) == SQLITE_ROW )
+        {
+            const uint8_t *idPtr        = sqlite3_column_text(statement, 0);
+            int            relationType = sqlite3_column_int (statement, 1);
+            _relationIndex.Add( reinterpret_cast<const char*>(idPtr), static_cast<NodeRelationType>(relationType) );
+        }
+    }
+    
+    for ( const auto &neighbour : QueryEntries( *_writer, _myNodeInfo.location(),
+            "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Neighbour) ),
+            "", "", ParamBinder(), ServiceDetails::Excluded ) )
+        { _neighbourIndex.Update(neighbour); }
+    
+    LOG(DEBUG) << "Updating node information in database";
+    vector<NodeDbEntry> selfEntries = QueryEntries( *_writer, _myNodeInfo.location(),
+        "WHERE relationType = " + to_string( static_cast<uint32_t>(NodeRelationType::Self) ) );
     if ( selfEntries.size() > 1 )
         { throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Multiple self instances found, database may have been tampered with."); }
     if ( ! selfEntries.empty() && selfEntries.front().id() != _myNodeInfo.id() )
@@ -291,10 +804,9 @@ SpatiaLiteDatabase::SpatiaLiteDatabase( const NodeInfo& myNodeInfo, const string
 
 SpatiaLiteDatabase::~SpatiaLiteDatabase()
 {
-    sqlite3_close (_dbHandle);
-#ifndef _WIN32
-    spatialite_cleanup_ex(_spatialiteConnection);
-#endif
+    // NOTE readers must be closed first, the last connection closed checkpoints and removes the WAL file
+    _readers.reset();
+    _writer.reset();
     // TODO there is no free cache function in current version despite description
     // spatialite_free_internal_cache();
     // TODO is this needed?
@@ -302,87 +814,162 @@ SpatiaLiteDatabase::~SpatiaLiteDatabase()
 }
 
 
+shared_ptr<SpatiaLiteConnection> SpatiaLiteDatabase::AcquireReader() const
+{
+    if (_readers)
+        { return _readers->Acquire(); }
+    
+    // NOTE no pool available, share the writer. Reads on the same connection would see uncommitted
+    //      changes of a write transaction in progress, so they are serialized with writes.
+    _writeMutex.lock();
+    return shared_ptr<SpatiaLiteConnection>( _writer.get(),
+        [this] (SpatiaLiteConnection*) { _writeMutex.unlock(); } );
+}
+
+
+NodeInfo SpatiaLiteDatabase::myNodeInfo() const
+{
+    lock_guard<mutex> myNodeInfoGuard(_myNodeInfoMutex);
+    return _myNodeInfo;
+}
+
+
 IChangeListenerRegistry& SpatiaLiteDatabase::changeListenerRegistry()
     { return _listenerRegistry; }
 
 
 
 
-Distance SpatiaLiteDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
+string SpatiaLiteDatabase::GetMetaInfo(const string &key) const
 {
-    sqlite3_stmt *statement;
-    string queryStr(
-        "SELECT Distance(" +
-            LocationPointSql(one) + "," +
-            LocationPointSql(other) + "," +
-            "1" // Needed for GPS distance, without this SpatiaLite calculates only Euclidean distance
-        ") / 1000 AS dist_km;" );
-            
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for distance measurement");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    shared_ptr<SpatiaLiteConnection> reader = AcquireReader();
+    shared_ptr<sqlite3_stmt> statementGuard = reader->statements().Acquire(
+        "SELECT value FROM metainfo WHERE key=?" );
+    sqlite3_stmt *statement = statementGuard.get();
     
-    if ( sqlite3_step(statement) != SQLITE_ROW )
+    if ( sqlite3_bind_text( statement, 1, key.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
-        LOG(ERROR) << "Failed to run distance query";
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run distance query");
+        LOG(ERROR) << "Failed to bind metainfo query key param";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind metainfo query key param");
     }
     
-    double result = sqlite3_column_double(statement, 0);
-    return result;
+    if ( sqlite3_step(statement) != SQLITE_ROW )
+        { return string(); }
+    return reinterpret_cast<const char*>( sqlite3_column_text(statement, 0) );
 }
 
 
-
-// TODO now that we have services in a different table, probably all methods should change
-// to use transactions where node and related service entries are updated together
-NodeInfo::Services SpatiaLiteDatabase::LoadServices(const NodeId& nodeId) const
+void SpatiaLiteDatabase::SetMetaInfo(const string &key, const string &value)
 {
-    sqlite3_stmt *statement;
-    string queryStr =
-        "SELECT serviceType, port, data "
-        "FROM services WHERE nodeId=?";
+    WriteTransaction transaction( _writeMutex, _writer->handle() );
+    shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(
+        "INSERT OR REPLACE INTO metainfo (key, value) VALUES (?, ?)" );
+    sqlite3_stmt *statement = statementGuard.get();
     
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
+    if ( sqlite3_bind_text( statement, 1, key.c_str(),   -1, SQLITE_STATIC ) != SQLITE_OK ||
+         sqlite3_bind_text( statement, 2, value.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to load services");
+        LOG(ERROR) << "Failed to bind metainfo statement params";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind metainfo statement params");
     }
     
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
-    
-    if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
+    int execResult = sqlite3_step(statement);
+    if (execResult != SQLITE_DONE)
     {
-        LOG(ERROR) << "Failed to bind LoadServices query node id param";
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind LoadServices query node id param");
+        LOG(ERROR) << "Failed to run metainfo statement, error code: " << execResult;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run metainfo statement");
     }
+    transaction.Commit();
+}
+
+
+
+Distance SpatiaLiteDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
+    { return GeodesicDistanceKm(one, other); }
+
+
+
+// Number of node ids looked up by a single services query. Only a few fixed batch sizes are used
+// and unused params of a batch are left NULL, so lookups share a small set of cached statements.
+static const vector<size_t> LOAD_SERVICES_BATCH_SIZES = { 1, 8, 64 };
+
+string LoadServicesSql(size_t batchSize)
+{
+    string params = "?";
+    for (size_t idx = 1; idx < batchSize; ++idx)
+        { params += ", ?"; }
+    return "SELECT nodeId, serviceType, port, data "
+           "FROM services WHERE nodeId IN (" + params + ")";
+}
+
+void SpatiaLiteDatabase::LoadServices(SpatiaLiteConnection &connection, vector<NodeDbEntry> &entries) const
+{
+    static const vector<string> queryStrs = [] {
+        vector<string> result;
+        for (size_t batchSize : LOAD_SERVICES_BATCH_SIZES)
+            { result.push_back( LoadServicesSql(batchSize) ); }
+        return result;
+    } ();
     
-    NodeInfo::Services services;
-    while ( sqlite3_step(statement) == SQLITE_ROW )
+    // NOTE node data is immutable, services are collected first and set once per entry
+    unordered_map<NodeId, size_t> entryIndexes;
+    for (size_t idx = 0; idx < entries.size(); ++idx)
+        { entryIndexes[ entries[idx].id() ] = idx; }
+    vector<NodeInfo::Services> entryServices( entries.size() );
+    
+    size_t batchStart = 0;
+    while ( batchStart < entries.size() )
     {
-        int serviceType  = sqlite3_column_int  (statement, 0);
-        int port         = sqlite3_column_int  (statement, 1);
+        size_t remaining = entries.size() - batchStart;
+        size_t shapeIdx = 0;
+        while ( shapeIdx + 1 < LOAD_SERVICES_BATCH_SIZES.size() && LOAD_SERVICES_BATCH_SIZES[shapeIdx] < remaining )
+            { ++shapeIdx; }
+        
+        shared_ptr<sqlite3_stmt> statementGuard = connection.statements().Acquire( queryStrs[shapeIdx] );
+        sqlite3_stmt *statement = statementGuard.get();
+        
+        size_t batchEnd = min( entries.size(), batchStart + LOAD_SERVICES_BATCH_SIZES[shapeIdx] );
+        for (size_t idx = batchStart; idx < batchEnd; ++idx)
+        {
+            int paramIndex = static_cast<int>(idx - batchStart + 1);
+            if ( sqlite3_bind_text( statement, paramIndex, entries[idx].id().c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
+            {
+                LOG(ERROR) << "Failed to bind LoadServices query node id param";
+                throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind LoadServices query node id param");
+            }
+        }
         
-        string data;
-        if ( sqlite3_column_type(statement, 2) == SQLITE_BLOB )
+        while ( sqlite3_step(statement) == SQLITE_ROW )
         {
-            int dataBytesCnt = sqlite3_column_bytes(statement, 2);
-            const void *dataBytes  = sqlite3_column_blob (statement, 2);
-            if ( dataBytes != nullptr && dataBytesCnt > 0 )
-                { data = string( reinterpret_cast<const char*>(dataBytes), dataBytesCnt ); }
+            const uint8_t *idPtr = sqlite3_column_text(statement, 0);
+            int serviceType      = sqlite3_column_int (statement, 1);
+            int port             = sqlite3_column_int (statement, 2);
+            
+            string data;
+            if ( sqlite3_column_type(statement, 3) == SQLITE_BLOB )
+            {
+                int dataBytesCnt = sqlite3_column_bytes(statement, 3);
+                const void *dataBytes  = sqlite3_column_blob (statement, 3);
+                if ( dataBytes != nullptr && dataBytesCnt > 0 )
+                    { data = string( reinterpret_cast<const char*>(dataBytes), dataBytesCnt ); }
+            }
+            
+            auto entryIt = entryIndexes.find( reinterpret_cast<const char*>(idPtr) );
+            if ( entryIt == entryIndexes.end() )
+                { continue; }
+            
+            ServiceInfo service( static_cast<ServiceType>(serviceType), port, data );
+            entryServices[entryIt->second].set(service);
         }
         
-        ServiceInfo service( static_cast<ServiceType>(serviceType), port, data );
-        services[ service.type() ] = service;
+        batchStart = batchEnd;
     }
     
-    return services;
+    for (size_t idx = 0; idx < entries.size(); ++idx)
+    {
+        if ( ! entryServices[idx].empty() )
+            { entries[idx].services( entryServices[idx] ); }
+    }
 }
 
 
@@ -391,24 +978,17 @@ void SpatiaLiteDatabase::StoreServices(const NodeId& nodeId, const NodeInfo::Ser
 {
     RemoveServices(nodeId);
     
-    sqlite3_stmt *statement;
     string insertStr(
         "INSERT INTO services "
         "(nodeId, serviceType, port, data) "
         "VALUES (?, ?, ?, ?)" );
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for storing node services");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
     
-    for (const auto &servicePair : services)
+    shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(insertStr);
+    sqlite3_stmt *statement = statementGuard.get();
+    
+    for (const auto &service : services)
     {
         // TODO abstract bind checks away, probably with functions, or maybe macros
-        const ServiceInfo &service = servicePair.second;
         const char *blobData = service.customData().empty() ? nullptr : service.customData().data();
         int blobSize = service.customData().size();
         if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC )  != SQLITE_OK ||
@@ -440,17 +1020,10 @@ void SpatiaLiteDatabase::StoreServices(const NodeId& nodeId, const NodeInfo::Ser
 
 void SpatiaLiteDatabase::RemoveServices(const NodeId& nodeId)
 {
-    sqlite3_stmt *statement;
     string queryStr = "DELETE FROM services WHERE nodeId=?";
     
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to remove services");
-    }
-    
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(queryStr);
+    sqlite3_stmt *statement = statementGuard.get();
     
     if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
@@ -468,27 +1041,22 @@ void SpatiaLiteDatabase::RemoveServices(const NodeId& nodeId)
 
 
 
-// TODO ideally we would just call QueryEntries() here, but have to manually bind id param
-//      to avoid SQL injection attacks. We could deduplicate at least some parts like result processing.
-shared_ptr<NodeDbEntry> SpatiaLiteDatabase::Load(const NodeId& nodeId) const
+shared_ptr<NodeDbEntry> SpatiaLiteDatabase::Load(const NodeId& nodeId, ServiceDetails services) const
+    { return Load( *AcquireReader(), nodeId, services ); }
+
+
+// NOTE this does not call QueryEntries() to avoid a useless distance calculation
+shared_ptr<NodeDbEntry> SpatiaLiteDatabase::Load( SpatiaLiteConnection &connection,
+    const NodeId& nodeId, ServiceDetails services ) const
 {
-    sqlite3_stmt *statement;
     string queryStr =
         "SELECT id, ipAddress, nodePort, clientPort, X(location), Y(location), "
                "relationType, roleType "
         "FROM nodes "
         "WHERE id=?";
     
-    //LOG(DEBUG) << "Running query: " << queryStr;
-    
-    int prepResult = sqlite3_prepare_v2( _dbHandle, queryStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << queryStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement to load node");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    shared_ptr<sqlite3_stmt> statementGuard = connection.statements().Acquire(queryStr);
+    sqlite3_stmt *statement = statementGuard.get();
     
     if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
@@ -512,50 +1080,57 @@ shared_ptr<NodeDbEntry> SpatiaLiteDatabase::Load(const NodeId& nodeId) const
         NodeContact contact( reinterpret_cast<const char*>(ipAddrPtr),
                              static_cast<TcpPort>(nodePort), static_cast<TcpPort>(clientPort) );
         
-        NodeInfo::Services services = LoadServices(nodeId);
         result.reset( new NodeDbEntry(
-            NodeInfo( reinterpret_cast<const char*>(idPtr), GpsLocation(latitude, longitude), contact, services ),
+            NodeInfo( reinterpret_cast<const char*>(idPtr), GpsLocation(latitude, longitude), contact, {} ),
             static_cast<NodeRelationType>(relationType), static_cast<NodeContactRoleType>(roleType) ) );
     }
     
+    if (result != nullptr && services == ServiceDetails::Included)
+    {
+        vector<NodeDbEntry> entries { *result };
+        LoadServices(connection, entries);
+        result.reset( new NodeDbEntry( entries.front() ) );
+    }
     return result;
 }
 
 
 
+time_t SpatiaLiteDatabase::ExpiresAt(bool expires) const
+{
+    return expires ?
+        chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
+        numeric_limits<time_t>::max();
+}
+
+
+
 // TODO reduce SpatiaLite boilerplate in general as much as possible. Currently it's very repetitive.
-void SpatiaLiteDatabase::Store(const NodeDbEntry &node, bool expires)
+void SpatiaLiteDatabase::InsertNode(const NodeDbEntry &node, time_t expiresAt)
 {
-    sqlite3_stmt *statement;
     string insertStr(
         "INSERT INTO nodes "
         "(id, ipAddress, nodePort, clientPort, relationType, roleType, expiresAt, location) VALUES "
-        "(?, ?, ?, ?, ?, ?, ?, " + LocationPointSql( node.location() ) + ")" );
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for storing node entry");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+        "(?, ?, ?, ?, ?, ?, ?, MakePoint(?, ?))" );
+    
+    shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(insertStr);
+    sqlite3_stmt *statement = statementGuard.get();
     
-    time_t expiresAt = expires ?
-        chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
-        numeric_limits<time_t>::max();
     const NodeContact &contact = node.contact();
+    const Address address = contact.address();
     // TODO abstract long bind checks away, probably with functions, or maybe macros
     if ( sqlite3_bind_text( statement, 1, node.id().c_str(), -1, SQLITE_STATIC )        != SQLITE_OK ||
-         sqlite3_bind_text( statement, 2, contact.address().c_str(), -1, SQLITE_STATIC )!= SQLITE_OK ||
+         sqlite3_bind_text( statement, 2, address.c_str(), -1, SQLITE_STATIC )          != SQLITE_OK ||
          sqlite3_bind_int(  statement, 3, contact.nodePort() )                          != SQLITE_OK ||
          sqlite3_bind_int(  statement, 4, contact.clientPort() )                        != SQLITE_OK ||
          sqlite3_bind_int(  statement, 5, static_cast<int>( node.relationType() ) )     != SQLITE_OK ||
          sqlite3_bind_int(  statement, 6, static_cast<int>( node.roleType() ) )         != SQLITE_OK ||
-         sqlite3_bind_int(  statement, 7, expiresAt )                                   != SQLITE_OK )
+         sqlite3_bind_int64(statement, 7, expiresAt )                                   != SQLITE_OK )
     {
         LOG(ERROR) << "Failed to bind node store statement params";
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind node store statement params");
     }
+    BindLocation( statement, 8, node.location() );
     
     int execResult = sqlite3_step(statement);
     if (execResult != SQLITE_DONE)
@@ -565,48 +1140,47 @@ void SpatiaLiteDatabase::Store(const NodeDbEntry &node, bool expires)
     }
     
     StoreServices( node.id(), node.services() );
-    
-    for ( auto listenerEntry : _listenerRegistry.listeners() )
-    {
-        // if ( auto listener = listenerEntry.lock() )
-            { listenerEntry->AddedNode(node); }
-    }
 }
 
 
 
-void SpatiaLiteDatabase::Update(const NodeDbEntry& node, bool expires)
+bool SpatiaLiteDatabase::UpdateNode(const NodeDbEntry &node, const NodeDbEntry &storedNode, time_t expiresAt)
 {
-    sqlite3_stmt *statement;
+    bool servicesChanged = node.services() != storedNode.services();
+    if ( node.location()     == storedNode.location() &&
+         node.contact()      == storedNode.contact() &&
+         node.relationType() == storedNode.relationType() &&
+         node.roleType()     == storedNode.roleType() )
+    {
+        RenewNode( node.id(), expiresAt );
+        if (servicesChanged)
+            { StoreServices( node.id(), node.services() ); }
+        return servicesChanged;
+    }
+    
     string insertStr(
         "UPDATE nodes SET "
         "  ipAddress=?, nodePort=?, clientPort=?, relationType=?, roleType=?, expiresAt=?, "
-        "  location=" + LocationPointSql( node.location() ) + " "
+        "  location=MakePoint(?, ?) "
         "WHERE id=?");
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for updating node entry");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
     
-    time_t expiresAt = expires ?
-        chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
-        numeric_limits<time_t>::max();
+    shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(insertStr);
+    sqlite3_stmt *statement = statementGuard.get();
+    
     const NodeContact &contact = node.contact();
-    if ( sqlite3_bind_text( statement, 1, contact.address().c_str(), -1, SQLITE_STATIC )!= SQLITE_OK ||
+    const Address address = contact.address();
+    if ( sqlite3_bind_text( statement, 1, address.c_str(), -1, SQLITE_STATIC )          != SQLITE_OK ||
          sqlite3_bind_int(  statement, 2, contact.nodePort() )                          != SQLITE_OK ||
          sqlite3_bind_int(  statement, 3, contact.clientPort() )                        != SQLITE_OK ||
          sqlite3_bind_int(  statement, 4, static_cast<int>( node.relationType() ) )     != SQLITE_OK ||
          sqlite3_bind_int(  statement, 5, static_cast<int>( node.roleType() ) )         != SQLITE_OK ||
-         sqlite3_bind_int(  statement, 6, expiresAt )                                   != SQLITE_OK ||
-         sqlite3_bind_text( statement, 7, node.id().c_str(), -1, SQLITE_STATIC )        != SQLITE_OK )
+         sqlite3_bind_int64(statement, 6, expiresAt )                                   != SQLITE_OK ||
+         sqlite3_bind_text( statement, 9, node.id().c_str(), -1, SQLITE_STATIC )        != SQLITE_OK )
     {
         LOG(ERROR) << "Failed to bind node store statement params";
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind node store statement params");
     }
+    BindLocation( statement, 7, node.location() );
     
     int execResult = sqlite3_step(statement);
     if (execResult != SQLITE_DONE)
@@ -615,50 +1189,56 @@ void SpatiaLiteDatabase::Update(const NodeDbEntry& node, bool expires)
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node update statement");
     }
     
-    int affectedRows = sqlite3_changes(_dbHandle);
+    int affectedRows = sqlite3_changes( _writer->handle() );
     if (affectedRows != 1)
     {
         LOG(ERROR) << "Affected row count for update should be 1, got : " << affectedRows;
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Wrong affected row count for update");
     }
     
-    StoreServices( node.id(), node.services() );
+    if (servicesChanged)
+        { StoreServices( node.id(), node.services() ); }
+    return true;
+}
+
+
+
+void SpatiaLiteDatabase::RenewNode(const NodeId &nodeId, time_t expiresAt)
+{
+    string updateStr(
+        "UPDATE nodes SET expiresAt=? "
+        "WHERE id=?");
     
-    // update cached self node info
-    if ( node.relationType() == NodeRelationType::Self )
-        { _myNodeInfo = node; }
+    shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(updateStr);
+    sqlite3_stmt *statement = statementGuard.get();
     
-    for ( auto listenerEntry : _listenerRegistry.listeners() )
+    if ( sqlite3_bind_int64(statement, 1, expiresAt )                          != SQLITE_OK ||
+         sqlite3_bind_text( statement, 2, nodeId.c_str(), -1, SQLITE_STATIC )  != SQLITE_OK )
     {
-        // if ( auto listener = listenerEntry.lock() )
-            { listenerEntry->UpdatedNode(node); }
+        LOG(ERROR) << "Failed to bind node renewal statement params";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind node renewal statement params");
+    }
+    
+    int execResult = sqlite3_step(statement);
+    if (execResult != SQLITE_DONE)
+    {
+        LOG(ERROR) << "Failed to run node renewal statement, error code: " << execResult;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node renewal statement");
     }
 }
 
 
 
-void SpatiaLiteDatabase::Remove(const NodeId &nodeId)
+void SpatiaLiteDatabase::DeleteNode(const NodeId &nodeId)
 {
-    shared_ptr<NodeDbEntry> storedNode = Load(nodeId);
-    if (storedNode == nullptr)
-        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be removed is not present: " + nodeId); }
-    if ( storedNode->relationType() == NodeRelationType::Self )
-        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Attempt to delete self entry"); }
-    
     RemoveServices(nodeId);
     
-    sqlite3_stmt *statement;
     string insertStr(
         "DELETE FROM nodes "
         "WHERE id=?");
-    int prepResult = sqlite3_prepare_v2( _dbHandle, insertStr.c_str(), -1, &statement, nullptr );
-    if (prepResult != SQLITE_OK)
-    {
-        LOG(ERROR) << "Failed to prepare statement: " << insertStr;
-        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to prepare statement for deleting node entry");
-    }
-
-    scope_exit finalizeStmt( [&statement] { sqlite3_finalize(statement); } );
+    
+    shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(insertStr);
+    sqlite3_stmt *statement = statementGuard.get();
     
     if ( sqlite3_bind_text( statement, 1, nodeId.c_str(), -1, SQLITE_STATIC ) != SQLITE_OK )
     {
@@ -673,14 +1253,126 @@ void SpatiaLiteDatabase::Remove(const NodeId &nodeId)
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run node delete statement");
     }
     
-    int affectedRows = sqlite3_changes(_dbHandle);
+    int affectedRows = sqlite3_changes( _writer->handle() );
     if (affectedRows != 1)
     {
         LOG(ERROR) << "Affected row count for delete should be 1, got : " << affectedRows;
         throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Wrong affected row count for delete");
     }
+}
+
+
+
+void SpatiaLiteDatabase::Store(const NodeDbEntry &node, bool expires)
+    { StoreMany( { node }, expires ); }
+
+void SpatiaLiteDatabase::Update(const NodeDbEntry &node, bool expires)
+    { UpdateMany( { node }, expires ); }
+
+
+
+// NOTE node and service rows of all nodes are written in a single transaction, so a batch costs
+//      only a single commit. Cached counts are updated while still holding the write lock to be
+//      consistent with the database, but listeners are notified only after the lock is released.
+void SpatiaLiteDatabase::StoreMany(const vector<NodeDbEntry> &nodes, bool expires)
+{
+    {
+        time_t expiresAt = ExpiresAt(expires);
+        WriteTransaction transaction( _writeMutex, _writer->handle() );
+        for (const auto &node : nodes)
+            { InsertNode(node, expiresAt); }
+        transaction.Commit();
+        
+        for (const auto &node : nodes)
+        {
+            _relationIndex.Add( node.id(), node.relationType() );
+            _neighbourIndex.Update(node);
+        }
+    }
+    
+    auto listeners = _listenerRegistry.listeners();
+    for (const auto &node : nodes)
+    {
+        for ( const auto &listenerEntry : *listeners )
+        {
+            // if ( auto listener = listenerEntry.lock() )
+                { listenerEntry->AddedNode(node); }
+        }
+    }
+}
+
+
+
+// NOTE renewals mostly send unchanged node data, these only extend the expiration time
+//      without rewriting other columns and services and without notifying listeners
+void SpatiaLiteDatabase::UpdateMany(const vector<NodeDbEntry> &nodes, bool expires)
+{
+    vector<NodeDbEntry> changedNodes;
+    {
+        time_t expiresAt = ExpiresAt(expires);
+        WriteTransaction transaction( _writeMutex, _writer->handle() );
+        for (const auto &node : nodes)
+        {
+            shared_ptr<NodeDbEntry> storedNode = Load(*_writer, node.id(), ServiceDetails::Included);
+            if (storedNode == nullptr)
+            {
+                LOG(ERROR) << "Node to be updated is not present: " << node.id();
+                throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be updated is not present: " + node.id());
+            }
+            if ( UpdateNode(node, *storedNode, expiresAt) )
+                { changedNodes.push_back(node); }
+        }
+        transaction.Commit();
+        
+        for (const auto &node : changedNodes)
+        {
+            _relationIndex.Add( node.id(), node.relationType() );
+            _neighbourIndex.Update(node);
+            
+            // update cached self node info
+            if ( node.relationType() == NodeRelationType::Self )
+            {
+                {
+                    lock_guard<mutex> myNodeInfoGuard(_myNodeInfoMutex);
+                    _myNodeInfo = node;
+                }
+                _neighbourIndex.origin( node.location() );
+            }
+        }
+    }
+    
+    auto listeners = _listenerRegistry.listeners();
+    for (const auto &node : changedNodes)
+    {
+        for ( const auto &listenerEntry : *listeners )
+        {
+            // if ( auto listener = listenerEntry.lock() )
+                { listenerEntry->UpdatedNode(node); }
+        }
+    }
+}
+
+
+
+void SpatiaLiteDatabase::Remove(const NodeId &nodeId)
+{
+    shared_ptr<NodeDbEntry> storedNode;
+    {
+        WriteTransaction transaction( _writeMutex, _writer->handle() );
+        storedNode = Load(*_writer, nodeId, ServiceDetails::Included);
+        if (storedNode == nullptr)
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be removed is not present: " + nodeId); }
+        if ( storedNode->relationType() == NodeRelationType::Self )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Attempt to delete self entry"); }
+        
+        DeleteNode(nodeId);
+        transaction.Commit();
+        _relationIndex.Remove(nodeId);
+        _neighbourIndex.Remove(nodeId);
+    }
     
-    for ( auto listenerEntry : _listenerRegistry.listeners() )
+    auto listeners = _listenerRegistry.listeners();
+    for ( const auto &listenerEntry : *listeners )
     {
         // if ( auto listener = listenerEntry.lock() )
             { listenerEntry->RemovedNode(*storedNode); }
@@ -689,21 +1381,76 @@ void SpatiaLiteDatabase::Remove(const NodeId &nodeId)
 
 
 
+// NOTE expired rows are found through the expiresAt index and deleted by set-based statements
+//      in a single transaction. Entries passed to listeners do not contain services.
 void SpatiaLiteDatabase::ExpireOldNodes()
 {
-    // NOTE int-based number, no string or user input, so no SQL injection vulnerability
     time_t now = chrono::system_clock::to_time_t( chrono::system_clock::now() );
     string expiredCondition(
-        "WHERE expiresAt <= " + to_string(now) + " AND " +
+        "WHERE expiresAt <= ? AND " 
             "relationType != " + to_string( static_cast<uint32_t>(NodeRelationType::Self) ) );
     
-    vector<NodeDbEntry> expiredEntries = QueryEntries( _myNodeInfo.location(), expiredCondition );
+    vector<NodeDbEntry> expiredEntries;
+    {
+        WriteTransaction transaction( _writeMutex, _writer->handle() );
+        expiredEntries = QueryEntries( *_writer, myNodeInfo().location(), expiredCondition, "", "",
+            [now] (sqlite3_stmt *statement)
+        {
+            if ( sqlite3_bind_int64(statement, 3, now) != SQLITE_OK )
+            {
+                LOG(ERROR) << "Failed to bind expiration query time param";
+                throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind expiration query time param");
+            }
+        }, ServiceDetails::Excluded );
+        
+        if ( expiredEntries.empty() )
+            { return; }
+        
+        for ( const string &deleteStr : {
+            "DELETE FROM services WHERE nodeId IN (SELECT id FROM nodes " + expiredCondition + ")",
+            "DELETE FROM nodes " + expiredCondition } )
+        {
+            shared_ptr<sqlite3_stmt> statementGuard = _writer->statements().Acquire(deleteStr);
+            sqlite3_stmt *statement = statementGuard.get();
+            
+            if ( sqlite3_bind_int64(statement, 1, now) != SQLITE_OK )
+            {
+                LOG(ERROR) << "Failed to bind expiration delete time param";
+                throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind expiration delete time param");
+            }
+            
+            int execResult = sqlite3_step(statement);
+            if (execResult != SQLITE_DONE)
+            {
+                LOG(ERROR) << "Failed to run expiration delete statement, error code: " << execResult;
+                throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to run expiration delete statement");
+            }
+        }
+        
+        int affectedRows = sqlite3_changes( _writer->handle() );
+        if ( affectedRows != static_cast<int>( expiredEntries.size() ) )
+        {
+            LOG(ERROR) << "Affected row count for expiration should be " << expiredEntries.size() << ", got : " << affectedRows;
+            throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Wrong affected row count for expiration");
+        }
+        transaction.Commit();
+        
+        for (const auto &entry : expiredEntries)
+        {
+            _relationIndex.Remove( entry.id() );
+            _neighbourIndex.Remove( entry.id() );
+        }
+    }
     
+    LOG(DEBUG) << "Expired " << expiredEntries.size() << " nodes";
+    auto listeners = _listenerRegistry.listeners();
     for (const auto &entry : expiredEntries)
     {
-        Remove( entry.id() );
-        for ( auto listenerEntry : _listenerRegistry.listeners() )
-            { listenerEntry->RemovedNode(entry); }
+        for ( const auto &listenerEntry : *listeners )
+        {
+            // if ( auto listener = listenerEntry.lock() )
+                { listenerEntry->RemovedNode(entry); }
+        }
     }
 }
 
@@ -711,61 +1458,230 @@ void SpatiaLiteDatabase::ExpireOldNodes()
 
 vector<NodeDbEntry> SpatiaLiteDatabase::GetNodes(NodeContactRoleType roleType)
 {
-    return QueryEntries( _myNodeInfo.location(),
+    return QueryEntries( *AcquireReader(), myNodeInfo().location(),
         "WHERE roleType = " + to_string( static_cast<int>(roleType) ) );
 }
 
 
+vector<pair<NodeId, time_t>> SpatiaLiteDatabase::GetExpirations(NodeContactRoleType roleType) const
+{
+    shared_ptr<SpatiaLiteConnection> reader = AcquireReader();
+    shared_ptr<sqlite3_stmt> statementGuard = reader->statements().Acquire(
+        "SELECT id, expiresAt FROM nodes WHERE roleType=?" );
+    sqlite3_stmt *statement = statementGuard.get();
+    
+    if ( sqlite3_bind_int( statement, 1, static_cast<int>(roleType) ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to bind expiration query role param";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind expiration query role param");
+    }
+    
+    vector<pair<NodeId, time_t>> result;
+    int stepResult;
+    while ( ( stepResult = sqlite3_step(statement) ) == SQLITE_ROW )
+    {
+        const uint8_t *idPtr = sqlite3_column_text(statement, 0);
+        result.emplace_back( reinterpret_cast<const char*>(idPtr),
+                             static_cast<time_t>( sqlite3_column_int64(statement, 1) ) );
+    }
+    if (stepResult != SQLITE_DONE)
+    {
+        LOG(ERROR) << "Failed to query node expirations: " << stepResult;
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to query node expirations");
+    }
+    return result;
+}
+
+
 
+// NOTE counts are maintained in memory, they are updated only after a successful database change
 size_t SpatiaLiteDatabase::GetNodeCount() const
+    { return _relationIndex.Count(); }
+
+size_t SpatiaLiteDatabase::GetNodeCount(NodeRelationType relationType) const
+    { return _relationIndex.Count(relationType); }
+
+
+
+vector<NodeDbEntry> SpatiaLiteDatabase::GetNeighbourNodesByDistance() const
 {
-    // NOTE this would be better done by SELECT COUNT(*) but that would need a lot more boilerplate code again
-    vector<NodeDbEntry> nodes( QueryEntries( _myNodeInfo.location() ) );
-    return nodes.size();
+    GpsLocation myLocation = myNodeInfo().location();
+    vector<NodeDbEntry> result = QueryEntries( *AcquireReader(), myLocation,
+        "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Neighbour) ), "" );
+    
+    // NOTE ordered like the neighbour index instead of SQL Distance(), so positions match neighbour ranks
+    sort( result.begin(), result.end(), [&myLocation] (const NodeDbEntry &one, const NodeDbEntry &other)
+    {
+        return make_pair( GeodesicDistanceKm( myLocation, one.location() ),   one.id() ) <
+               make_pair( GeodesicDistanceKm( myLocation, other.location() ), other.id() );
+    } );
+    return result;
 }
 
 
 
-vector<NodeDbEntry> SpatiaLiteDatabase::GetNeighbourNodesByDistance() const
+size_t SpatiaLiteDatabase::GetNeighbourRank(const NodeId &nodeId) const
+    { return _neighbourIndex.Rank(nodeId); }
+
+shared_ptr<NodeDbEntry> SpatiaLiteDatabase::GetNeighbourByRank(size_t rank) const
 {
-    return QueryEntries( _myNodeInfo.location(),
-        "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Neighbour) ),
-        "ORDER BY dist_km" );
+    NodeId nodeId = _neighbourIndex.IdAt(rank);
+    if ( nodeId.empty() )
+        { return shared_ptr<NodeDbEntry>(); }
+    return Load(nodeId, ServiceDetails::Included);
 }
 
 
 
 vector<NodeDbEntry> SpatiaLiteDatabase::GetRandomNodes(size_t maxNodeCount, Neighbours filter) const
 {
-    string whereCondition = filter == Neighbours::Included ? "" :
-        "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Colleague) );
-    return QueryEntries( _myNodeInfo.location(), whereCondition,
-        "ORDER BY RANDOM()", "LIMIT " + to_string(maxNodeCount) );
+    vector<NodeRelationType> relationTypes = filter == Neighbours::Included ?
+        vector<NodeRelationType>{ NodeRelationType::Colleague, NodeRelationType::Neighbour, NodeRelationType::Self } :
+        vector<NodeRelationType>{ NodeRelationType::Colleague };
+    vector<NodeId> sampleIds = _relationIndex.RandomSample(maxNodeCount, relationTypes);
+    
+    shared_ptr<SpatiaLiteConnection> reader = AcquireReader();
+    vector<NodeDbEntry> result;
+    result.reserve( sampleIds.size() );
+    for (const auto &nodeId : sampleIds)
+    {
+        // NOTE node might have been removed concurrently since sampling
+        shared_ptr<NodeDbEntry> entry = Load(*reader, nodeId, ServiceDetails::Excluded);
+        if (entry != nullptr)
+            { result.push_back(*entry); }
+    }
+    LoadServices(*reader, result);
+    return result;
+}
+
+
+
+// Longitude/latitude bounding box in degrees for the spatial index
+struct BoundingBox
+{
+    double minLon;
+    double maxLon;
+    double minLat;
+    double maxLat;
+};
+
+
+// Radius of the first ring of a nearest neighbour search and its growth factor per step
+static const Distance KNN_INITIAL_RADIUS_KM = 100;
+static const Distance KNN_RADIUS_GROWTH     = 4;
+
+// Slightly smaller than the polar radius of the Earth so that boxes are always a bit larger
+// than needed and surely contain every point within the given geodesic distance.
+static const double   BOUNDING_EARTH_RADIUS_KM = 6300;
+
+
+// Bounding boxes (two, if crossing the antimeridian) of all points within radiusKm of center,
+// see http://janmatuschek.de/LatitudeLongitudeBoundingCoordinates for details.
+// Returns true if the boxes cover the whole world, i.e. widening the radius gains nothing more.
+bool GetBoundingBoxes(const GpsLocation &center, Distance radiusKm, BoundingBox &first, BoundingBox &second)
+{
+    // Use an empty box for the second one if not needed
+    second = BoundingBox{ 1000, 1000, 1000, 1000 };
+    
+    const double toRadians = M_PI / 180;
+    double angularRadius = radiusKm / BOUNDING_EARTH_RADIUS_KM;
+    if (angularRadius >= M_PI)
+    {
+        first = BoundingBox{ -180, 180, -90, 90 };
+        return true;
+    }
+    
+    double minLat = center.latitude() - angularRadius / toRadians;
+    double maxLat = center.latitude() + angularRadius / toRadians;
+    if (minLat <= -90 || maxLat >= 90)
+    {
+        // A pole is within the circle, so all longitudes are affected
+        first = BoundingBox{ -180, 180, max(minLat, -90.), min(maxLat, 90.) };
+        return minLat <= -90 && maxLat >= 90;
+    }
+    
+    double deltaLon = asin( sin(angularRadius) / cos(center.latitude() * toRadians) ) / toRadians;
+    double minLon = center.longitude() - deltaLon;
+    double maxLon = center.longitude() + deltaLon;
+    if (minLon < -180)
+    {
+        first  = BoundingBox{ -180, maxLon, minLat, maxLat };
+        second = BoundingBox{ minLon + 360, 180, minLat, maxLat };
+    }
+    else if (maxLon > 180)
+    {
+        first  = BoundingBox{ minLon, 180, minLat, maxLat };
+        second = BoundingBox{ -180, maxLon - 360, minLat, maxLat };
+    }
+    else { first = BoundingBox{ minLon, maxLon, minLat, maxLat }; }
+    return false;
 }
 
 
+// Binds params of a "minLon <= ? AND maxLon >= ? AND minLat <= ? AND maxLat >= ?" expression
+void BindBoundingBox(sqlite3_stmt *statement, int firstIndex, const BoundingBox &box)
+{
+    if ( sqlite3_bind_double( statement, firstIndex,     box.maxLon ) != SQLITE_OK ||
+         sqlite3_bind_double( statement, firstIndex + 1, box.minLon ) != SQLITE_OK ||
+         sqlite3_bind_double( statement, firstIndex + 2, box.maxLat ) != SQLITE_OK ||
+         sqlite3_bind_double( statement, firstIndex + 3, box.minLat ) != SQLITE_OK )
+    {
+        LOG(ERROR) << "Failed to bind bounding box params";
+        throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind bounding box params");
+    }
+}
 
+
+// Nearest neighbour search expanding in rings: nodes within the bounding box of the current ring
+// are looked up using the spatial index, then exact distances are calculated only for them.
+// Nodes within the ring are surely closer than any node outside, so the search is finished
+// when the ring contains enough nodes, otherwise it's repeated with a wider ring.
 vector<NodeDbEntry> SpatiaLiteDatabase::GetClosestNodesByDistance(
     const GpsLocation& location, Distance radiusKm, size_t maxNodeCount, Neighbours filter) const
 {
-    string whereCondition = "WHERE (dist_km IS NULL OR dist_km <= " + to_string(radiusKm) + ")";
+    string whereCondition =
+        "WHERE rid IN ( "
+        "    SELECT id FROM nodes_rtree WHERE minLon <= ? AND maxLon >= ? AND minLat <= ? AND maxLat >= ? "
+        "    UNION ALL "
+        "    SELECT id FROM nodes_rtree WHERE minLon <= ? AND maxLon >= ? AND minLat <= ? AND maxLat >= ? ) "
+        "  AND (dist_km IS NULL OR dist_km <= ?)";
     if (filter == Neighbours::Excluded)
     {
         whereCondition += " AND relationType = " +
             to_string( static_cast<int>(NodeRelationType::Colleague) );
     }
     
-    return QueryEntries(location,
-        whereCondition,
-        "ORDER BY dist_km",
-        "LIMIT " + to_string(maxNodeCount) );
+    shared_ptr<SpatiaLiteConnection> reader = AcquireReader();
+    Distance ringRadiusKm = min(KNN_INITIAL_RADIUS_KM, radiusKm);
+    while (true)
+    {
+        BoundingBox firstBox, secondBox;
+        bool coversWorld = GetBoundingBoxes(location, ringRadiusKm, firstBox, secondBox);
+        
+        vector<NodeDbEntry> result = QueryEntries(*reader, location, whereCondition, "ORDER BY dist_km", "LIMIT ?",
+            [&firstBox, &secondBox, ringRadiusKm, maxNodeCount] (sqlite3_stmt *statement)
+        {
+            BindBoundingBox(statement, 3, firstBox);
+            BindBoundingBox(statement, 7, secondBox);
+            if ( sqlite3_bind_double( statement, 11, ringRadiusKm ) != SQLITE_OK ||
+                 sqlite3_bind_int64(  statement, 12, static_cast<sqlite3_int64>(maxNodeCount) ) != SQLITE_OK )
+            {
+                LOG(ERROR) << "Failed to bind closest query params";
+                throw LocationNetworkError(ErrorCode::ERROR_INTERNAL, "Failed to bind closest query params");
+            }
+        } );
+        
+        if ( result.size() >= maxNodeCount || ringRadiusKm >= radiusKm || coversWorld )
+            { return result; }
+        ringRadiusKm = min(ringRadiusKm * KNN_RADIUS_GROWTH, radiusKm);
+    }
 }
 
 
 
 NodeDbEntry SpatiaLiteDatabase::ThisNode() const
 {
-    return ThisNodeToDbEntry(_myNodeInfo);
+    return ThisNodeToDbEntry( myNodeInfo() );
 //     string whereCondition = "WHERE relationType = " + to_string( static_cast<int>(NodeRelationType::Colleague) );
 //     vector<NodeDbEntry> result = QueryEntries( _myNodeInfo.location(), whereCondition );
 //     if ( result.empty() )
@@ -777,4 +1693,730 @@ NodeDbEntry SpatiaLiteDatabase::ThisNode() const
 
 
 
+ReadWriteLock::ReadWriteLock() :
+    _mutex(), _released(), _readerCount(0), _waitingWriterCount(0), _writerActive(false) {}
+
+
+void ReadWriteLock::lock()
+{
+    unique_lock<mutex> lock(_mutex);
+    ++_waitingWriterCount;
+    _released.wait( lock, [this] { return ! _writerActive && _readerCount == 0; } );
+    --_waitingWriterCount;
+    _writerActive = true;
+}
+
+
+void ReadWriteLock::unlock()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _writerActive = false;
+    }
+    _released.notify_all();
+}
+
+
+void ReadWriteLock::lock_shared()
+{
+    unique_lock<mutex> lock(_mutex);
+    _released.wait( lock, [this] { return ! _writerActive && _waitingWriterCount == 0; } );
+    ++_readerCount;
+}
+
+
+void ReadWriteLock::unlock_shared()
+{
+    bool lastReader;
+    {
+        lock_guard<mutex> lock(_mutex);
+        lastReader = --_readerCount == 0;
+    }
+    if (lastReader)
+        { _released.notify_all(); }
+}
+
+
+SharedLock::SharedLock(ReadWriteLock &lock) : _lock(lock)
+    { _lock.lock_shared(); }
+
+SharedLock::~SharedLock()
+    { _lock.unlock_shared(); }
+
+
+
+static const size_t GRID_LATITUDE_CELLS  = 180;
+static const size_t GRID_LONGITUDE_CELLS = 360;
+
+size_t GridLatitudeIndex(double latitude)
+{
+    double index = floor(latitude + 90);
+    return static_cast<size_t>( max( 0., min<double>(index, GRID_LATITUDE_CELLS - 1) ) );
+}
+
+size_t GridLongitudeIndex(double longitude)
+{
+    double index = floor(longitude + 180);
+    return static_cast<size_t>( max( 0., min<double>(index, GRID_LONGITUDE_CELLS - 1) ) );
+}
+
+
+NodeLocationGrid::NodeLocationGrid() :
+    _cells( CellCount() ) {}
+
+
+size_t NodeLocationGrid::CellCount()
+    { return GRID_LATITUDE_CELLS * GRID_LONGITUDE_CELLS; }
+
+size_t NodeLocationGrid::CellIndex(const GpsLocation &location)
+{
+    return GridLatitudeIndex( location.latitude() ) * GRID_LONGITUDE_CELLS +
+           GridLongitudeIndex( location.longitude() );
+}
+
+
+void NodeLocationGrid::Add(const NodeDbEntry *entry)
+    { _cells[ CellIndex( entry->location() ) ].push_back(entry); }
+
+
+void NodeLocationGrid::Remove(const NodeDbEntry *entry)
+{
+    vector<const NodeDbEntry*> &cell = _cells[ CellIndex( entry->location() ) ];
+    auto position = find( cell.begin(), cell.end(), entry );
+    if ( position == cell.end() )
+        { throw LocationNetworkError(ErrorCode::ERROR_CONCEPTUAL, "Entry to be removed is not in the grid"); }
+    *position = cell.back();
+    cell.pop_back();
+}
+
+
+void NodeLocationGrid::Collect( double minLon, double maxLon, double minLat, double maxLat,
+                                vector<const NodeDbEntry*> &result ) const
+{
+    if (minLat > maxLat || minLon > maxLon || minLat > 90 || minLon > 180)
+        { return; }
+    
+    size_t lastLatIdx = GridLatitudeIndex(maxLat);
+    size_t firstLonIdx = GridLongitudeIndex(minLon);
+    size_t lastLonIdx = GridLongitudeIndex(maxLon);
+    for (size_t latIdx = GridLatitudeIndex(minLat); latIdx <= lastLatIdx; ++latIdx)
+    {
+        for (size_t lonIdx = firstLonIdx; lonIdx <= lastLonIdx; ++lonIdx)
+        {
+            const vector<const NodeDbEntry*> &cell = _cells[latIdx * GRID_LONGITUDE_CELLS + lonIdx];
+            result.insert( result.end(), cell.begin(), cell.end() );
+        }
+    }
+}
+
+
+
+static const string SNAPSHOT_FILE_SUFFIX    = ".snapshot";
+static const string SNAPSHOT_GENERATION_KEY = "snapshotGeneration";
+
+
+MemorySpatialDatabase::MemorySpatialDatabase( const NodeInfo &myNodeInfo, const string &dbPath,
+        chrono::duration<uint32_t> expirationPeriod, chrono::milliseconds flushPeriod,
+        chrono::duration<uint32_t> snapshotPeriod ) :
+    _lock(), _myNodeInfo(myNodeInfo), _entryExpirationPeriod(expirationPeriod),
+    _records(), _grid(), _relationIndex(), _neighbourIndex( myNodeInfo.location() ),
+    _expirations(), _listenerRegistry(),
+    // NOTE queries are served from memory, the only reader of the database is this constructor
+    _persistentDb( new SpatiaLiteDatabase(myNodeInfo, dbPath, expirationPeriod, 1) ),
+    _persistedIds(), _flushMutex(),
+    _snapshotPath( dbPath == SpatiaLiteDatabase::IN_MEMORY_DB ? "" : dbPath + SNAPSHOT_FILE_SUFFIX ),
+    _snapshotValid(false), _snapshotPeriod(snapshotPeriod), _lastSnapshotTime( chrono::steady_clock::now() ),
+    _pendingMutex(), _shutdownRequested(), _pendingChanges(),
+    _shutdown(false), _flushPeriod(flushPeriod), _flushThread()
+{
+    if ( LoadSnapshot() )
+    {
+        // NOTE self info may have been changed since, the database has its current state
+        AddRecord( ThisNodeToDbEntry(_myNodeInfo), ExpiresAt(false) );
+        _persistedIds.insert( _myNodeInfo.id() );
+    }
+    else
+    {
+        // NOTE stored expiration times are kept, a restart must not extend the life of nodes
+        _persistentDb->ExpireOldNodes();
+        unordered_map<NodeId, time_t> storedExpirations;
+        for ( NodeContactRoleType roleType : { NodeContactRoleType::Initiator, NodeContactRoleType::Acceptor } )
+        {
+            for ( const auto &expiration : _persistentDb->GetExpirations(roleType) )
+                { storedExpirations.insert(expiration); }
+        }
+        
+        vector<NodeDbEntry> storedNodes = _persistentDb->GetRandomNodes(
+            numeric_limits<size_t>::max(), Neighbours::Included );
+        for (const auto &node : storedNodes)
+        {
+            auto storedExpiration = storedExpirations.find( node.id() );
+            AddRecord( node, storedExpiration != storedExpirations.end() ? storedExpiration->second :
+                ExpiresAt( node.relationType() != NodeRelationType::Self ) );
+            _persistedIds.insert( node.id() );
+        }
+    }
+    
+    _flushThread = thread( [this] { FlushPeriodically(); } );
+    LOG(DEBUG) << "In-memory database ready with node count: " << GetNodeCount();
+}
+
+
+MemorySpatialDatabase::~MemorySpatialDatabase()
+{
+    {
+        lock_guard<mutex> lock(_pendingMutex);
+        _shutdown = true;
+    }
+    _shutdownRequested.notify_all();
+    _flushThread.join();
+    
+    try
+    {
+        Flush();
+        if (! _snapshotValid)
+            { WriteSnapshot(); }
+    }
+    catch (exception &ex)
+        { LOG(ERROR) << "Failed to persist changes on shutdown: " << ex.what(); }
+}
+
+
+bool MemorySpatialDatabase::LoadSnapshot()
+{
+    if ( _snapshotPath.empty() )
+        { return false; }
+    
+    string generation = _persistentDb->GetMetaInfo(SNAPSHOT_GENERATION_KEY);
+    if ( generation.empty() )
+    {
+        LOG(INFO) << "Database was changed since the last snapshot, loading nodes from the database";
+        return false;
+    }
+    
+    vector<NodeSnapshotEntry> entries;
+    try
+    {
+        NodeSnapshot snapshot(_snapshotPath);
+        if ( to_string( snapshot.generation() ) != generation )
+        {
+            LOG(INFO) << "Snapshot is outdated, loading nodes from the database";
+            return false;
+        }
+        
+        entries.reserve( snapshot.size() );
+        for (size_t idx = 0; idx < snapshot.size(); ++idx)
+            { entries.push_back( snapshot.Entry(idx) ); }
+    }
+    catch (exception &ex)
+    {
+        LOG(WARNING) << "Failed to load snapshot, loading nodes from the database: " << ex.what();
+        return false;
+    }
+    
+    _records.reserve( entries.size() );
+    _persistedIds.reserve( entries.size() );
+    for (const auto &entry : entries)
+    {
+        if ( entry.entry.relationType() == NodeRelationType::Self )
+            { continue; }
+        AddRecord(entry.entry, entry.expiresAt);
+        _persistedIds.insert( entry.entry.id() );
+    }
+    _snapshotValid = true;
+    LOG(INFO) << "Loaded " << entries.size() << " nodes from snapshot";
+    return true;
+}
+
+
+void MemorySpatialDatabase::WriteSnapshot()
+{
+    if ( _snapshotPath.empty() )
+        { return; }
+    
+    // NOTE the database file does not change while holding the flush mutex. Records are copied
+    //      only if there are no pending changes, so the copy has the same content as the file.
+    lock_guard<mutex> flushLock(_flushMutex);
+    FlushUnlocked();
+    
+    vector<NodeSnapshotEntry> entries;
+    {
+        SharedLock lock(_lock);
+        {
+            lock_guard<mutex> pendingLock(_pendingMutex);
+            if ( ! _pendingChanges.empty() )
+            {
+                LOG(DEBUG) << "Not all changes are persisted yet, skip writing snapshot";
+                return;
+            }
+        }
+        
+        entries.reserve( _records.size() );
+        for (const auto &record : _records)
+            { entries.push_back( NodeSnapshotEntry{ record.second.entry, record.second.expiresAt } ); }
+    }
+    
+    uint64_t generation = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch() ).count();
+    NodeSnapshot::Write(_snapshotPath, entries, generation);
+    _persistentDb->SetMetaInfo( SNAPSHOT_GENERATION_KEY, to_string(generation) );
+    _snapshotValid = true;
+    _lastSnapshotTime = chrono::steady_clock::now();
+    LOG(DEBUG) << "Written snapshot of " << entries.size() << " nodes";
+}
+
+
+void MemorySpatialDatabase::FlushPeriodically()
+{
+    unique_lock<mutex> lock(_pendingMutex);
+    while (! _shutdown)
+    {
+        _shutdownRequested.wait_for( lock, _flushPeriod, [this] { return _shutdown; } );
+        if (_shutdown)
+            { break; }
+        
+        lock.unlock();
+        try
+        {
+            Flush();
+            if ( ! _snapshotValid && chrono::steady_clock::now() - _lastSnapshotTime >= _snapshotPeriod )
+                { WriteSnapshot(); }
+        }
+        catch (exception &ex)
+            { LOG(ERROR) << "Failed to persist changes: " << ex.what(); }
+        lock.lock();
+    }
+}
+
+
+void MemorySpatialDatabase::QueueChange(const NodeId &nodeId, const PendingChange &change, bool overwrite)
+{
+    lock_guard<mutex> lock(_pendingMutex);
+    if (overwrite)
+        { _pendingChanges[nodeId] = change; }
+    else { _pendingChanges.emplace(nodeId, change); }
+}
+
+
+// Pending changes of a node are coalesced, only its latest state is written.
+// Stores and updates are written in batches, a failed batch is queued again unless
+// the same node was changed meanwhile.
+void MemorySpatialDatabase::Flush()
+{
+    lock_guard<mutex> flushLock(_flushMutex);
+    FlushUnlocked();
+}
+
+
+void MemorySpatialDatabase::FlushUnlocked()
+{
+    PendingChanges changes;
+    {
+        lock_guard<mutex> lock(_pendingMutex);
+        changes.swap(_pendingChanges);
+    }
+    if ( changes.empty() )
+        { return; }
+    
+    // Invalidate the snapshot before changing the database, so it's surely not used after a crash
+    if (_snapshotValid)
+    {
+        try { _persistentDb->SetMetaInfo(SNAPSHOT_GENERATION_KEY, ""); }
+        catch (exception &ex)
+        {
+            for (const auto &change : changes)
+                { QueueChange(change.first, change.second, false); }
+            throw;
+        }
+        _snapshotValid = false;
+    }
+    
+    vector<NodeDbEntry> toStore[2];
+    vector<NodeDbEntry> toUpdate[2];
+    vector<NodeId>      toRemove;
+    for (const auto &change : changes)
+    {
+        bool persisted = _persistedIds.find(change.first) != _persistedIds.end();
+        if (change.second.entry == nullptr)
+        {
+            if (persisted)
+                { toRemove.push_back(change.first); }
+        }
+        else if (persisted)
+            { toUpdate[change.second.expires].push_back(*change.second.entry); }
+        else { toStore[change.second.expires].push_back(*change.second.entry); }
+    }
+    
+    auto requeue = [this, &changes] (const vector<NodeDbEntry> &nodes)
+    {
+        for (const auto &node : nodes)
+            { QueueChange( node.id(), changes[ node.id() ], false ); }
+    };
+    
+    for (bool expires : { false, true })
+    {
+        try
+        {
+            _persistentDb->StoreMany(toStore[expires], expires);
+            for (const auto &node : toStore[expires])
+                { _persistedIds.insert( node.id() ); }
+        }
+        catch (exception &ex)
+        {
+            LOG(ERROR) << "Failed to persist stored nodes: " << ex.what();
+            requeue(toStore[expires]);
+        }
+        
+        try { _persistentDb->UpdateMany(toUpdate[expires], expires); }
+        catch (exception &ex)
+        {
+            LOG(ERROR) << "Failed to persist updated nodes: " << ex.what();
+            requeue(toUpdate[expires]);
+        }
+    }
+    
+    for (const auto &nodeId : toRemove)
+    {
+        try
+        {
+            _persistentDb->Remove(nodeId);
+            _persistedIds.erase(nodeId);
+        }
+        catch (exception &ex)
+        {
+            LOG(ERROR) << "Failed to persist removed node " << nodeId << ": " << ex.what();
+            QueueChange( nodeId, changes[nodeId], false );
+        }
+    }
+}
+
+
+
+time_t MemorySpatialDatabase::ExpiresAt(bool expires) const
+{
+    return expires ?
+        chrono::system_clock::to_time_t( chrono::system_clock::now() + _entryExpirationPeriod ) :
+        numeric_limits<time_t>::max();
+}
+
+
+void MemorySpatialDatabase::AddRecord(const NodeDbEntry &node, time_t expiresAt)
+{
+    auto inserted = _records.emplace( node.id(), NodeRecord{ node, expiresAt } );
+    _grid.Add( &inserted.first->second.entry );
+    _relationIndex.Add( node.id(), node.relationType() );
+    _neighbourIndex.Update(node);
+    _expirations.emplace( expiresAt, node.id() );
+}
+
+
+void MemorySpatialDatabase::RemoveRecord(const NodeId &nodeId)
+{
+    auto record = _records.find(nodeId);
+    _grid.Remove( &record->second.entry );
+    _expirations.erase( make_pair( record->second.expiresAt, nodeId ) );
+    _records.erase(record);
+    _relationIndex.Remove(nodeId);
+    _neighbourIndex.Remove(nodeId);
+}
+
+
+
+Distance MemorySpatialDatabase::GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const
+    { return GeodesicDistanceKm(one, other); }
+
+
+shared_ptr<NodeDbEntry> MemorySpatialDatabase::Load(const NodeId &nodeId, ServiceDetails services) const
+{
+    SharedLock lock(_lock);
+    auto record = _records.find(nodeId);
+    if ( record == _records.end() )
+        { return shared_ptr<NodeDbEntry>(); }
+    
+    const NodeDbEntry &entry = record->second.entry;
+    if (services == ServiceDetails::Included)
+        { return make_shared<NodeDbEntry>(entry); }
+    return make_shared<NodeDbEntry>( NodeInfo( entry.id(), entry.location(), entry.contact(), {} ),
+        entry.relationType(), entry.roleType() );
+}
+
+
+void MemorySpatialDatabase::Store(const NodeDbEntry &node, bool expires)
+    { StoreMany( { node }, expires ); }
+
+void MemorySpatialDatabase::Update(const NodeDbEntry &node, bool expires)
+    { UpdateMany( { node }, expires ); }
+
+
+// NOTE all nodes are validated before changing anything, so either all or none of them are written
+void MemorySpatialDatabase::StoreMany(const vector<NodeDbEntry> &nodes, bool expires)
+{
+    {
+        lock_guard<ReadWriteLock> lock(_lock);
+        unordered_set<NodeId> batchIds;
+        for (const auto &node : nodes)
+        {
+            if ( _records.find( node.id() ) != _records.end() || ! batchIds.insert( node.id() ).second )
+            {
+                LOG(ERROR) << "Node to be stored is already present: " << node.id();
+                throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be stored is already present: " + node.id());
+            }
+        }
+        
+        time_t expiresAt = ExpiresAt(expires);
+        for (const auto &node : nodes)
+        {
+            AddRecord(node, expiresAt);
+            QueueChange( node.id(), PendingChange{ make_shared<NodeDbEntry>(node), expires } );
+        }
+    }
+    
+    auto listeners = _listenerRegistry.listeners();
+    for (const auto &node : nodes)
+    {
+        for ( const auto &listenerEntry : *listeners )
+            { listenerEntry->AddedNode(node); }
+    }
+}
+
+
+void MemorySpatialDatabase::UpdateMany(const vector<NodeDbEntry> &nodes, bool expires)
+{
+    vector<NodeDbEntry> changedNodes;
+    {
+        lock_guard<ReadWriteLock> lock(_lock);
+        for (const auto &node : nodes)
+        {
+            if ( _records.find( node.id() ) == _records.end() )
+            {
+                LOG(ERROR) << "Node to be updated is not present: " << node.id();
+                throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be updated is not present: " + node.id());
+            }
+        }
+        
+        time_t expiresAt = ExpiresAt(expires);
+        for (const auto &node : nodes)
+        {
+            QueueChange( node.id(), PendingChange{ make_shared<NodeDbEntry>(node), expires } );
+            NodeRecord &record = _records.at( node.id() );
+            if (record.entry == node)
+            {
+                // NOTE only expiration is renewed, no need to reindex the node or notify listeners
+                _expirations.erase( make_pair( record.expiresAt, node.id() ) );
+                record.expiresAt = expiresAt;
+                _expirations.emplace( expiresAt, node.id() );
+                continue;
+            }
+            
+            RemoveRecord( node.id() );
+            AddRecord(node, expiresAt);
+            changedNodes.push_back(node);
+            
+            // update cached self node info
+            if ( node.relationType() == NodeRelationType::Self )
+            {
+                _myNodeInfo = node;
+                _neighbourIndex.origin( node.location() );
+            }
+        }
+    }
+    
+    auto listeners = _listenerRegistry.listeners();
+    for (const auto &node : changedNodes)
+    {
+        for ( const auto &listenerEntry : *listeners )
+            { listenerEntry->UpdatedNode(node); }
+    }
+}
+
+
+void MemorySpatialDatabase::Remove(const NodeId &nodeId)
+{
+    shared_ptr<NodeDbEntry> removedNode;
+    {
+        lock_guard<ReadWriteLock> lock(_lock);
+        auto record = _records.find(nodeId);
+        if ( record == _records.end() )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node to be removed is not present: " + nodeId); }
+        if ( record->second.entry.relationType() == NodeRelationType::Self )
+            { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Attempt to delete self entry"); }
+        
+        removedNode = make_shared<NodeDbEntry>(record->second.entry);
+        RemoveRecord(nodeId);
+        QueueChange( nodeId, PendingChange{ shared_ptr<NodeDbEntry>(), true } );
+    }
+    
+    auto listeners = _listenerRegistry.listeners();
+    for ( const auto &listenerEntry : *listeners )
+        { listenerEntry->RemovedNode(*removedNode); }
+}
+
+
+void MemorySpatialDatabase::ExpireOldNodes()
+{
+    time_t now = chrono::system_clock::to_time_t( chrono::system_clock::now() );
+    vector<NodeDbEntry> expiredEntries;
+    {
+        lock_guard<ReadWriteLock> lock(_lock);
+        // NOTE self never expires, its expiration time is the maximum possible value
+        for ( auto expiration = _expirations.begin();
+              expiration != _expirations.end() && expiration->first <= now; ++expiration )
+            { expiredEntries.push_back( _records.at(expiration->second).entry ); }
+        
+        for (const auto &entry : expiredEntries)
+        {
+            RemoveRecord( entry.id() );
+            QueueChange( entry.id(), PendingChange{ shared_ptr<NodeDbEntry>(), true } );
+        }
+    }
+    
+    if ( expiredEntries.empty() )
+        { return; }
+    
+    LOG(DEBUG) << "Expired " << expiredEntries.size() << " nodes";
+    auto listeners = _listenerRegistry.listeners();
+    for (const auto &entry : expiredEntries)
+    {
+        for ( const auto &listenerEntry : *listeners )
+            { listenerEntry->RemovedNode(entry); }
+    }
+}
+
+
+IChangeListenerRegistry& MemorySpatialDatabase::changeListenerRegistry()
+    { return _listenerRegistry; }
+
+
+NodeDbEntry MemorySpatialDatabase::ThisNode() const
+{
+    SharedLock lock(_lock);
+    return ThisNodeToDbEntry(_myNodeInfo);
+}
+
+
+vector<NodeDbEntry> MemorySpatialDatabase::GetNodes(NodeContactRoleType roleType)
+{
+    SharedLock lock(_lock);
+    vector<NodeDbEntry> result;
+    for (const auto &record : _records)
+    {
+        if ( record.second.entry.roleType() == roleType )
+            { result.push_back(record.second.entry); }
+    }
+    return result;
+}
+
+
+vector<pair<NodeId, time_t>> MemorySpatialDatabase::GetExpirations(NodeContactRoleType roleType) const
+{
+    SharedLock lock(_lock);
+    vector<pair<NodeId, time_t>> result;
+    for (const auto &record : _records)
+    {
+        if ( record.second.entry.roleType() == roleType )
+            { result.emplace_back( record.first, record.second.expiresAt ); }
+    }
+    return result;
+}
+
+
+size_t MemorySpatialDatabase::GetNodeCount() const
+    { return _relationIndex.Count(); }
+
+size_t MemorySpatialDatabase::GetNodeCount(NodeRelationType relationType) const
+    { return _relationIndex.Count(relationType); }
+
+
+vector<NodeDbEntry> MemorySpatialDatabase::GetNeighbourNodesByDistance() const
+{
+    SharedLock lock(_lock);
+    vector<NodeDbEntry> result;
+    for ( const auto &nodeId : _neighbourIndex.Ids() )
+        { result.push_back( _records.at(nodeId).entry ); }
+    return result;
+}
+
+
+size_t MemorySpatialDatabase::GetNeighbourRank(const NodeId &nodeId) const
+    { return _neighbourIndex.Rank(nodeId); }
+
+
+shared_ptr<NodeDbEntry> MemorySpatialDatabase::GetNeighbourByRank(size_t rank) const
+{
+    SharedLock lock(_lock);
+    NodeId nodeId = _neighbourIndex.IdAt(rank);
+    if ( nodeId.empty() )
+        { return shared_ptr<NodeDbEntry>(); }
+    return make_shared<NodeDbEntry>( _records.at(nodeId).entry );
+}
+
+
+vector<NodeDbEntry> MemorySpatialDatabase::GetRandomNodes(size_t maxNodeCount, Neighbours filter) const
+{
+    vector<NodeRelationType> relationTypes = filter == Neighbours::Included ?
+        vector<NodeRelationType>{ NodeRelationType::Colleague, NodeRelationType::Neighbour, NodeRelationType::Self } :
+        vector<NodeRelationType>{ NodeRelationType::Colleague };
+    
+    SharedLock lock(_lock);
+    vector<NodeId> sampleIds = _relationIndex.RandomSample(maxNodeCount, relationTypes);
+    vector<NodeDbEntry> result;
+    result.reserve( sampleIds.size() );
+    for (const auto &nodeId : sampleIds)
+        { result.push_back( _records.at(nodeId).entry ); }
+    return result;
+}
+
+
+// Same ring expanding search as SpatiaLiteDatabase::GetClosestNodesByDistance(),
+// but candidates are collected from the grid instead of the R*Tree.
+vector<NodeDbEntry> MemorySpatialDatabase::GetClosestNodesByDistance(
+    const GpsLocation& location, Distance radiusKm, size_t maxNodeCount, Neighbours filter) const
+{
+    SharedLock lock(_lock);
+    vector<const NodeDbEntry*> candidates;
+    vector<GpsLocation> candidateLocations;
+    vector<pair<Distance, const NodeDbEntry*>> found;
+    
+    Distance ringRadiusKm = min(KNN_INITIAL_RADIUS_KM, radiusKm);
+    while (true)
+    {
+        BoundingBox firstBox, secondBox;
+        bool coversWorld = GetBoundingBoxes(location, ringRadiusKm, firstBox, secondBox);
+        
+        candidates.clear();
+        _grid.Collect( firstBox.minLon,  firstBox.maxLon,  firstBox.minLat,  firstBox.maxLat,  candidates );
+        _grid.Collect( secondBox.minLon, secondBox.maxLon, secondBox.minLat, secondBox.maxLat, candidates );
+        
+        candidateLocations.clear();
+        for (const auto *candidate : candidates)
+            { candidateLocations.push_back( candidate->location() ); }
+        vector<Distance> distances = GeodesicDistancesKm(location, candidateLocations);
+        
+        found.clear();
+        for (size_t idx = 0; idx < candidates.size(); ++idx)
+        {
+            if ( distances[idx] <= ringRadiusKm && ( filter == Neighbours::Included ||
+                 candidates[idx]->relationType() == NodeRelationType::Colleague ) )
+                { found.emplace_back( distances[idx], candidates[idx] ); }
+        }
+        
+        if ( found.size() >= maxNodeCount || ringRadiusKm >= radiusKm || coversWorld )
+            { break; }
+        ringRadiusKm = min(ringRadiusKm * KNN_RADIUS_GROWTH, radiusKm);
+    }
+    
+    size_t resultCount = min( found.size(), maxNodeCount );
+    partial_sort( found.begin(), found.begin() + resultCount, found.end(),
+        [] (const pair<Distance, const NodeDbEntry*> &one, const pair<Distance, const NodeDbEntry*> &other)
+            { return one.first < other.first || ( one.first == other.first && one.second->id() < other.second->id() ); } );
+    
+    vector<NodeDbEntry> result;
+    result.reserve(resultCount);
+    for (size_t idx = 0; idx < resultCount; ++idx)
+        { result.push_back( *found[idx].second ); }
+    return result;
+}
+
+
+
 } // namespace LocNet
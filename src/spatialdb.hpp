@@ -1,10 +1,18 @@
 #ifndef __LOCNET_SPATIAL_DATABASE_H__
 #define __LOCNET_SPATIAL_DATABASE_H__
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <random>
+#include <set>
 #include <sqlite3.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "basic.hpp"
@@ -40,6 +48,14 @@ enum class Neighbours : uint8_t
 };
 
 
+// Flag for node queries to specify if services are needed or only the network topology
+enum class ServiceDetails : uint8_t
+{
+    Included = 1,
+    Excluded = 2,
+};
+
+
 
 // Data holder class for full node information stored in the database.
 class NodeDbEntry : public NodeInfo
@@ -100,9 +116,13 @@ public:
     
     virtual Distance GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const = 0;
     
-    virtual std::shared_ptr<NodeDbEntry> Load(const NodeId &nodeId) const = 0;
+    virtual std::shared_ptr<NodeDbEntry> Load( const NodeId &nodeId,
+        ServiceDetails services = ServiceDetails::Included ) const = 0;
     virtual void Store (const NodeDbEntry &node, bool expires = true) = 0;
     virtual void Update(const NodeDbEntry &node, bool expires = true) = 0;
+    // Bulk variants writing all nodes at once, either all or none of them are written
+    virtual void StoreMany (const std::vector<NodeDbEntry> &nodes, bool expires = true) = 0;
+    virtual void UpdateMany(const std::vector<NodeDbEntry> &nodes, bool expires = true) = 0;
     virtual void Remove(const NodeId &nodeId) = 0;
     virtual void ExpireOldNodes() = 0;
     
@@ -110,9 +130,16 @@ public:
 
     virtual NodeDbEntry ThisNode() const = 0;
     virtual std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) = 0;
+    // Expiration times of nodes with the given role, non-expiring nodes have the maximum time_t value
+    virtual std::vector<std::pair<NodeId, time_t>> GetExpirations(NodeContactRoleType roleType) const = 0;
 
     virtual size_t GetNodeCount() const = 0;
+    virtual size_t GetNodeCount(NodeRelationType relationType) const = 0;
     virtual std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const = 0;
+    // Position of a neighbour in the list ordered by distance from this node, throws if it's not a neighbour
+    virtual size_t GetNeighbourRank(const NodeId &nodeId) const = 0;
+    // Neighbour at the given position of the list ordered by distance, empty if there are not that many
+    virtual std::shared_ptr<NodeDbEntry> GetNeighbourByRank(size_t rank) const = 0;
     
     virtual std::vector<NodeDbEntry> GetClosestNodesByDistance(
         const GpsLocation &location, Distance maxRadiusKm, size_t maxNodeCount, Neighbours filter) const = 0;
@@ -123,16 +150,27 @@ public:
 
 
 
-// A simple map implementation of a listener registry, protected by a lock to be threadsafe.
+// A listener registry to be threadsafe without locking on the notification path.
+// Listeners are kept in an immutable snapshot that is replaced as a whole on every
+// registration change, notifications just atomically acquire the current snapshot.
 class ThreadSafeChangeListenerRegistry : public IChangeListenerRegistry
 {
-    mutable std::mutex _mutex;
+public:
+    
+    typedef std::vector<std::shared_ptr<IChangeListener>> Listeners;
+    
+private:
+    
+    // NOTE serializes only registration changes, readers never take it
+    std::mutex _mutex;
     
-    std::unordered_map<SessionId, std::shared_ptr<IChangeListener>> _listeners;
+    std::shared_ptr<const Listeners> _listeners;
     
 public:
     
-    std::vector<std::shared_ptr<IChangeListener>> listeners() const;
+    ThreadSafeChangeListenerRegistry();
+    
+    std::shared_ptr<const Listeners> listeners() const;
     
     void AddListener(std::shared_ptr<IChangeListener> listener);
     void RemoveListener(const SessionId &sessionId);
@@ -140,39 +178,384 @@ public:
 
 
 
+// Cache of compiled SQL statements of a single database connection, keyed by the query string.
+// A statement is checked out for exclusive use and automatically reset and returned
+// to the cache when released, so concurrent callers never share the state of a statement.
+class SqlStatementCache
+{
+    sqlite3    *_dbHandle;
+    std::mutex  _mutex;
+    
+    std::unordered_multimap<std::string, sqlite3_stmt*> _statements;
+    
+    void Release(const std::string &sql, sqlite3_stmt *statement);
+    
+public:
+    
+    SqlStatementCache(sqlite3 *dbHandle);
+    ~SqlStatementCache();
+    
+    SqlStatementCache(const SqlStatementCache &other) = delete;
+    SqlStatementCache& operator=(const SqlStatementCache &other) = delete;
+    
+    std::shared_ptr<sqlite3_stmt> Acquire(const std::string &sql);
+};
+
+
+
+// A single SQLite database connection with its own SpatiaLite context and statement cache.
+class SpatiaLiteConnection
+{
+    sqlite3    *_dbHandle;
+    void       *_spatialiteConnection;
+    
+    std::unique_ptr<SqlStatementCache> _statements;
+    
+public:
+    
+    // Flags are passed to sqlite3_open_v2()
+    SpatiaLiteConnection(const std::string &dbPath, int openFlags);
+    ~SpatiaLiteConnection();
+    
+    SpatiaLiteConnection(const SpatiaLiteConnection &other) = delete;
+    SpatiaLiteConnection& operator=(const SpatiaLiteConnection &other) = delete;
+    
+    sqlite3* handle();
+    SqlStatementCache& statements();
+};
+
+
+
+// Pool of read-only connections. With WAL journaling readers do not block each other nor the writer,
+// a connection is used by only a single thread at a time and returned to the pool when released.
+class SpatiaLiteConnectionPool
+{
+    std::mutex              _mutex;
+    std::condition_variable _connectionReleased;
+    
+    std::vector<std::unique_ptr<SpatiaLiteConnection>> _connections;
+    std::vector<SpatiaLiteConnection*>                 _idleConnections;
+    
+public:
+    
+    SpatiaLiteConnectionPool(const std::string &dbPath, size_t connectionCount);
+    
+    std::shared_ptr<SpatiaLiteConnection> Acquire();
+};
+
+
+
+// In-memory index of node ids grouped by relation type, kept in sync with the database.
+// Ids are stored in dense arrays (removal swaps in the last element), so uniform random
+// sampling costs only the size of the sample instead of the number of all nodes.
+class NodeRelationIndex
+{
+    typedef std::unordered_map<NodeId, std::pair<NodeRelationType, size_t>> Positions;
+    
+    mutable std::mutex        _mutex;
+    mutable std::mt19937      _random;
+    
+    Positions _positions;
+    std::unordered_map<NodeRelationType, std::vector<NodeId>, EnumHasher> _ids;
+    
+    void RemoveUnlocked(Positions::iterator position);
+    
+public:
+    
+    NodeRelationIndex();
+    
+    void Add(const NodeId &nodeId, NodeRelationType relationType);
+    void Remove(const NodeId &nodeId);
+    
+    size_t Count() const;
+    size_t Count(NodeRelationType relationType) const;
+    std::vector<NodeId> Ids(NodeRelationType relationType) const;
+    
+    // Returns at most maxNodeCount different ids in random order having any of the given relation types
+    std::vector<NodeId> RandomSample( size_t maxNodeCount,
+        const std::vector<NodeRelationType> &relationTypes ) const;
+};
+
+
+
+// Neighbours ordered by distance from this node (ties broken by node id), kept up to date on every change.
+// Rank of a neighbour is found by binary search, the neighbour with a given rank is a direct lookup.
+// NOTE neighbourhoods are small, so a sorted array is cheaper than a balanced tree here.
+class NeighbourDistanceIndex
+{
+    typedef std::pair<Distance, NodeId> Key;
+    
+    mutable std::mutex  _mutex;
+    GpsLocation         _origin;
+    std::vector<Key>    _ordered;
+    std::unordered_map<NodeId, GpsLocation> _locations;
+    
+    Key KeyOf(const NodeId &nodeId, const GpsLocation &location) const;
+    void RemoveUnlocked(const NodeId &nodeId);
+    
+public:
+    
+    NeighbourDistanceIndex(const GpsLocation &origin);
+    
+    // Recalculates the order if location of this node is changed
+    void origin(const GpsLocation &origin);
+    
+    // Adds or moves the node if it's a neighbour, removes it otherwise
+    void Update(const NodeDbEntry &node);
+    void Remove(const NodeId &nodeId);
+    
+    size_t Count() const;
+    // Position in the ordered list, throws if the node is not a neighbour
+    size_t Rank(const NodeId &nodeId) const;
+    // Id at the given position in the ordered list, or empty if there are not that many neighbours
+    NodeId IdAt(size_t rank) const;
+    std::vector<NodeId> Ids() const;
+};
+
+
+
 // A spatial database implementation that uses the SpatiaLite embedded SQL engine.
 class SpatiaLiteDatabase : public ISpatialDatabase
 {
-    NodeInfo     _myNodeInfo;
-    sqlite3     *_dbHandle;
-    void        *_spatialiteConnection;
+public:
+    
+    // Binds additional query parameters, called after the location params are already bound
+    typedef std::function<void(sqlite3_stmt*)> ParamBinder;
+    
+private:
+    
+    // NOTE cached self node info is replaced by writers while read by queries on any thread
+    NodeInfo            _myNodeInfo;
+    mutable std::mutex  _myNodeInfoMutex;
+    
+    // NOTE all writes go through a single connection, queries use a pool of readers if possible.
+    //      In-memory databases cannot be shared between connections, they use the writer for everything.
+    std::unique_ptr<SpatiaLiteConnection>     _writer;
+    std::unique_ptr<SpatiaLiteConnectionPool> _readers;
+    // Serializes write transactions on the writer connection, and also reads if there are no readers
+    mutable std::mutex                        _writeMutex;
     
     std::chrono::duration<uint32_t> _entryExpirationPeriod;
     
     ThreadSafeChangeListenerRegistry _listenerRegistry;
+    NodeRelationIndex                _relationIndex;
+    NeighbourDistanceIndex           _neighbourIndex;
+    
+    std::shared_ptr<SpatiaLiteConnection> AcquireReader() const;
+    NodeInfo myNodeInfo() const;
     
-    std::vector<NodeDbEntry> QueryEntries(const GpsLocation &fromLocation,
+    std::vector<NodeDbEntry> QueryEntries(SpatiaLiteConnection &connection, const GpsLocation &fromLocation,
         const std::string &whereCondition = "", const std::string orderBy = "",
-        const std::string &limit = "") const;
+        const std::string &limit = "", ParamBinder bindParams = ParamBinder(),
+        ServiceDetails services = ServiceDetails::Included ) const;
+    
+    std::shared_ptr<NodeDbEntry> Load( SpatiaLiteConnection &connection,
+        const NodeId &nodeId, ServiceDetails services ) const;
     
-    NodeInfo::Services LoadServices(const NodeId &nodeId) const;
+    void LoadServices(SpatiaLiteConnection &connection, std::vector<NodeDbEntry> &entries) const;
     void StoreServices(const NodeId &nodeId, const NodeInfo::Services &services);
     void RemoveServices(const NodeId &nodeId);
     
+    // NOTE these only write the database, they must be called inside a transaction
+    void InsertNode(const NodeDbEntry &node, time_t expiresAt);
+    // Writes only the parts differing from the stored entry, returns if anything but expiration changed
+    bool UpdateNode(const NodeDbEntry &node, const NodeDbEntry &storedNode, time_t expiresAt);
+    void RenewNode(const NodeId &nodeId, time_t expiresAt);
+    void DeleteNode(const NodeId &nodeId);
+    time_t ExpiresAt(bool expires) const;
+    
 public:
     
     static const std::string IN_MEMORY_DB;
     
     
     SpatiaLiteDatabase(const NodeInfo &myNodeInfo, const std::string &dbPath,
-                       std::chrono::duration<uint32_t> expirationPeriod);
+                       std::chrono::duration<uint32_t> expirationPeriod,
+                       size_t readerConnectionCount = std::thread::hardware_concurrency() );
     virtual ~SpatiaLiteDatabase();
     
+    // Arbitrary key-value pairs stored along with the nodes, values are empty if not present
+    std::string GetMetaInfo(const std::string &key) const;
+    void SetMetaInfo(const std::string &key, const std::string &value);
+    
+    Distance GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const override;
+
+    std::shared_ptr<NodeDbEntry> Load( const NodeId &nodeId,
+        ServiceDetails services = ServiceDetails::Included ) const override;
+    void Store (const NodeDbEntry &node, bool expires = true) override;
+    void Update(const NodeDbEntry &node, bool expires = true) override;
+    void StoreMany (const std::vector<NodeDbEntry> &nodes, bool expires = true) override;
+    void UpdateMany(const std::vector<NodeDbEntry> &nodes, bool expires = true) override;
+    void Remove(const NodeId &nodeId) override;
+    void ExpireOldNodes() override;
+    
+    IChangeListenerRegistry& changeListenerRegistry() override;
+
+    NodeDbEntry ThisNode() const override;
+    std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) override;
+    std::vector<std::pair<NodeId, time_t>> GetExpirations(NodeContactRoleType roleType) const override;
+    
+    size_t GetNodeCount() const override;
+    size_t GetNodeCount(NodeRelationType relationType) const override;
+    std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const override;
+    size_t GetNeighbourRank(const NodeId &nodeId) const override;
+    std::shared_ptr<NodeDbEntry> GetNeighbourByRank(size_t rank) const override;
+    std::vector<NodeDbEntry> GetRandomNodes(
+        size_t maxNodeCount, Neighbours filter) const override;
+    
+    std::vector<NodeDbEntry> GetClosestNodesByDistance(const GpsLocation &location,
+        Distance radiusKm, size_t maxNodeCount, Neighbours filter) const override;
+};
+
+
+
+// Reader-writer lock: readers may hold it concurrently while a writer has exclusive access.
+// Waiting writers are preferred so a steady stream of queries cannot starve them.
+// NOTE std::shared_timed_mutex would do the same but needs C++14, methods are named
+//      like those of standard mutexes to be usable with std::unique_lock and std::lock_guard.
+class ReadWriteLock
+{
+    std::mutex              _mutex;
+    std::condition_variable _released;
+    size_t                  _readerCount;
+    size_t                  _waitingWriterCount;
+    bool                    _writerActive;
+    
+public:
+    
+    ReadWriteLock();
+    
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+};
+
+
+// Scope guard holding shared ownership of a ReadWriteLock
+class SharedLock
+{
+    ReadWriteLock &_lock;
+    
+public:
+    
+    SharedLock(ReadWriteLock &lock);
+    ~SharedLock();
+    
+    SharedLock(const SharedLock &other) = delete;
+    SharedLock& operator=(const SharedLock &other) = delete;
+};
+
+
+
+// Spatial index of node entries in a grid of one degree wide cells.
+// NOTE not thread safe, access must be synchronized by the owner.
+class NodeLocationGrid
+{
+    std::vector<std::vector<const NodeDbEntry*>> _cells;
+    
+public:
+    
+    NodeLocationGrid();
+    
+    static size_t CellCount();
+    static size_t CellIndex(const GpsLocation &location);
+    
+    // NOTE entries are stored by address, they must not move while present in the grid
+    void Add(const NodeDbEntry *entry);
+    void Remove(const NodeDbEntry *entry);
+    
+    // Appends all entries from cells overlapping the given box (in degrees) to result
+    void Collect( double minLon, double maxLon, double minLat, double maxLat,
+                  std::vector<const NodeDbEntry*> &result ) const;
+};
+
+
+
+// A spatial database implementation keeping all nodes in memory, serving queries without
+// any database round trip. Changes are persisted to a SpatiaLite database file in the background
+// (write-behind), the same file is used to load nodes on startup.
+// NOTE changes made in the last flush period before a crash are lost, which is acceptable
+//      as the node map is rebuilt from the network anyway.
+class MemorySpatialDatabase : public ISpatialDatabase
+{
+    struct NodeRecord
+    {
+        NodeDbEntry entry;
+        time_t      expiresAt;
+    };
+    
+    // Latest state of a node not yet persisted, entry is null if the node was removed
+    struct PendingChange
+    {
+        std::shared_ptr<NodeDbEntry> entry;
+        bool                         expires;
+    };
+    
+    typedef std::unordered_map<NodeId, PendingChange> PendingChanges;
+    
+    mutable ReadWriteLock _lock;
+    NodeInfo              _myNodeInfo;
+    std::chrono::duration<uint32_t> _entryExpirationPeriod;
+    
+    // NOTE pointers to map values are stable, the grid refers to entries of records
+    std::unordered_map<NodeId, NodeRecord> _records;
+    NodeLocationGrid                       _grid;
+    NodeRelationIndex                      _relationIndex;
+    NeighbourDistanceIndex                 _neighbourIndex;
+    std::set<std::pair<time_t, NodeId>>    _expirations;
+    
+    ThreadSafeChangeListenerRegistry _listenerRegistry;
+    
+    std::unique_ptr<SpatiaLiteDatabase> _persistentDb;
+    std::unordered_set<NodeId>          _persistedIds;
+    std::mutex                          _flushMutex;
+    
+    // NOTE the snapshot is valid only while it has the same content as the database file
+    std::string                           _snapshotPath;
+    std::atomic<bool>                     _snapshotValid;
+    std::chrono::duration<uint32_t>       _snapshotPeriod;
+    std::chrono::steady_clock::time_point _lastSnapshotTime;
+    
+    std::mutex                  _pendingMutex;
+    std::condition_variable     _shutdownRequested;
+    PendingChanges              _pendingChanges;
+    bool                        _shutdown;
+    std::chrono::milliseconds   _flushPeriod;
+    std::thread                 _flushThread;
+    
+    time_t ExpiresAt(bool expires) const;
+    void AddRecord(const NodeDbEntry &node, time_t expiresAt);
+    void RemoveRecord(const NodeId &nodeId);
+    
+    void QueueChange(const NodeId &nodeId, const PendingChange &change, bool overwrite = true);
+    void FlushPeriodically();
+    void FlushUnlocked();
+    bool LoadSnapshot();
+    
+public:
+    
+    // Nodes are loaded from the snapshot file next to the database file if it's up to date,
+    // from the database otherwise. A new snapshot is written periodically and on shutdown.
+    MemorySpatialDatabase( const NodeInfo &myNodeInfo, const std::string &dbPath,
+                           std::chrono::duration<uint32_t> expirationPeriod,
+                           std::chrono::milliseconds flushPeriod = std::chrono::seconds(1),
+                           std::chrono::duration<uint32_t> snapshotPeriod = std::chrono::minutes(10) );
+    virtual ~MemorySpatialDatabase();
+    
+    // Persists all changes right away instead of waiting for the next periodic flush
+    void Flush();
+    // Flushes all changes and writes a snapshot of all nodes, no-op for in-memory database files
+    void WriteSnapshot();
+    
     Distance GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const override;
 
-    std::shared_ptr<NodeDbEntry> Load(const NodeId &nodeId) const override;
+    std::shared_ptr<NodeDbEntry> Load( const NodeId &nodeId,
+        ServiceDetails services = ServiceDetails::Included ) const override;
     void Store (const NodeDbEntry &node, bool expires = true) override;
     void Update(const NodeDbEntry &node, bool expires = true) override;
+    void StoreMany (const std::vector<NodeDbEntry> &nodes, bool expires = true) override;
+    void UpdateMany(const std::vector<NodeDbEntry> &nodes, bool expires = true) override;
     void Remove(const NodeId &nodeId) override;
     void ExpireOldNodes() override;
     
@@ -180,9 +563,13 @@ public:
 
     NodeDbEntry ThisNode() const override;
     std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) override;
+    std::vector<std::pair<NodeId, time_t>> GetExpirations(NodeContactRoleType roleType) const override;
     
     size_t GetNodeCount() const override;
+    size_t GetNodeCount(NodeRelationType relationType) const override;
     std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const override;
+    size_t GetNeighbourRank(const NodeId &nodeId) const override;
+    std::shared_ptr<NodeDbEntry> GetNeighbourByRank(size_t rank) const override;
     std::vector<NodeDbEntry> GetRandomNodes(
         size_t maxNodeCount, Neighbours filter) const override;
     
@@ -0,0 +1,456 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <easylogging++.h>
+
+#include "messaging.hpp"
+#include "spatialdb.hpp"
+
+INITIALIZE_EASYLOGGINGPP
+
+using namespace std;
+using namespace LocNet;
+
+
+
+// Rough measurement of the hot paths of the node on large generated node sets.
+// Not part of the unit tests, run manually when touching performance related code.
+// Usage: benchmark [nodeCount ...]
+
+
+
+template <typename Operation>
+void Measure(const string &name, size_t iterations, Operation operation)
+{
+    auto start = chrono::steady_clock::now();
+    for (size_t idx = 0; idx < iterations; ++idx)
+        { operation(idx); }
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>( chrono::steady_clock::now() - start );
+
+    cout << "  " << left << setw(36) << name
+         << right << setw(8) << iterations << " ops "
+         << setw(12) << fixed << setprecision(2) << elapsed.count() / 1000. / iterations << " us/op" << endl;
+}
+
+
+
+vector<NodeDbEntry> GenerateNodes(size_t nodeCount)
+{
+    mt19937 random(42);
+    uniform_real_distribution<GpsCoordinate> latitudes(-90, 90);
+    uniform_real_distribution<GpsCoordinate> longitudes(-180, 180);
+
+    vector<NodeDbEntry> result;
+    result.reserve(nodeCount);
+    for (size_t idx = 0; idx < nodeCount; ++idx)
+    {
+        NodeInfo::Services services;
+        if (idx % 2 == 0)
+            { services.set( ServiceInfo(ServiceType::Profile, 16000, "profile") ); }
+
+        // NOTE neighbours are a small minority in a real world, most entries are colleagues
+        bool isNeighbour = idx % 100 == 0;
+        result.emplace_back(
+            NodeInfo( "BenchmarkNode" + to_string(idx),
+                      GpsLocation( latitudes(random), longitudes(random) ),
+                      NodeContact( "127.0.0.1", 16980, 16982 ), services ),
+            isNeighbour ? NodeRelationType::Neighbour : NodeRelationType::Colleague,
+            isNeighbour ? NodeContactRoleType::Initiator : NodeContactRoleType::Acceptor );
+    }
+    return result;
+}
+
+
+
+void BenchmarkSpatialDatabase(ISpatialDatabase &geodb, const string &engineName, size_t nodeCount)
+{
+    cout << engineName << " with " << nodeCount << " nodes" << endl;
+
+    const NodeInfo myNodeInfo = geodb.ThisNode();
+
+    vector<NodeDbEntry> nodes = GenerateNodes(nodeCount);
+    size_t sampleCount = min<size_t>(nodeCount, 1000);
+
+    Measure("Store", nodes.size(), [&] (size_t idx)
+        { geodb.Store( nodes[idx] ); } );
+
+    Measure("Update", sampleCount, [&] (size_t idx)
+        { geodb.Update( nodes[idx] ); } );
+
+    Measure("Load", sampleCount, [&] (size_t idx)
+        { geodb.Load( nodes[idx].id() ); } );
+
+    Measure("ThisNode", 10000, [&] (size_t)
+        { geodb.ThisNode(); } );
+
+    Measure("GetDistanceKm", 10000, [&] (size_t idx)
+        { geodb.GetDistanceKm( myNodeInfo.location(), nodes[idx % nodes.size()].location() ); } );
+
+    Measure("GetNodeCount", 3, [&] (size_t)
+        { geodb.GetNodeCount(); } );
+
+    Measure("GetNeighbourNodesByDistance", 10, [&] (size_t)
+        { geodb.GetNeighbourNodesByDistance(); } );
+
+    Measure("GetNeighbourByRank", 1000, [&] (size_t idx)
+        { geodb.GetNeighbourByRank( idx % 50 ); } );
+
+    Measure("GetClosestNodesByDistance 10", 20, [&] (size_t idx)
+        { geodb.GetClosestNodesByDistance( nodes[idx].location(), 20000, 10, Neighbours::Included ); } );
+
+    Measure("GetClosestNodesByDistance 2 excl", 20, [&] (size_t idx)
+        { geodb.GetClosestNodesByDistance( nodes[idx].location(), 20000, 2, Neighbours::Excluded ); } );
+
+    Measure("GetRandomNodes 10", 20, [&] (size_t)
+        { geodb.GetRandomNodes( 10, Neighbours::Excluded ); } );
+
+    Measure("ExpireOldNodes none expired", 20, [&] (size_t)
+        { geodb.ExpireOldNodes(); } );
+
+    Measure("Remove", sampleCount, [&] (size_t idx)
+        { geodb.Remove( nodes[idx].id() ); } );
+
+    cout << endl;
+}
+
+
+
+// Single writes versus batches committed in one transaction on a database file, like initial discovery
+void BenchmarkBulkWrites(size_t nodeCount)
+{
+    cout << "Bulk writes to a database file with " << nodeCount << " nodes" << endl;
+
+    const string dbPath = "benchmark_spatialdb.sqlite";
+    auto removeDbFiles = [dbPath] {
+        remove( dbPath.c_str() );
+        remove( (dbPath + "-wal").c_str() );
+        remove( (dbPath + "-shm").c_str() );
+    };
+
+    const NodeInfo myNodeInfo( "BenchmarkSelf", GpsLocation(47.4808706, 18.849426),
+        NodeContact("127.0.0.1", 16980, 16982), {} );
+    vector<NodeDbEntry> nodes = GenerateNodes(nodeCount);
+    const size_t batchSize = 1000;
+
+    {
+        removeDbFiles();
+        SpatiaLiteDatabase geodb( myNodeInfo, dbPath, chrono::hours(1) );
+        Measure("Store", nodes.size(), [&] (size_t idx)
+            { geodb.Store( nodes[idx] ); } );
+        Measure("Update", nodes.size(), [&] (size_t idx)
+            { geodb.Update( nodes[idx] ); } );
+    }
+
+    {
+        removeDbFiles();
+        SpatiaLiteDatabase geodb( myNodeInfo, dbPath, chrono::hours(1) );
+        Measure("StoreMany per node, batch " + to_string(batchSize), nodes.size(), [&] (size_t idx)
+        {
+            if (idx % batchSize == 0)
+            {
+                vector<NodeDbEntry> batch( nodes.begin() + idx,
+                    nodes.begin() + min( idx + batchSize, nodes.size() ) );
+                geodb.StoreMany(batch);
+            }
+        } );
+        Measure("UpdateMany per node, batch " + to_string(batchSize), nodes.size(), [&] (size_t idx)
+        {
+            if (idx % batchSize == 0)
+            {
+                vector<NodeDbEntry> batch( nodes.begin() + idx,
+                    nodes.begin() + min( idx + batchSize, nodes.size() ) );
+                geodb.UpdateMany(batch);
+            }
+        } );
+    }
+
+    removeDbFiles();
+    cout << endl;
+}
+
+
+
+// Throughput of concurrent client queries while a writer keeps updating nodes
+void MeasureConcurrentAccess(ISpatialDatabase &geodb, const vector<NodeDbEntry> &nodes, size_t maxThreadCount)
+{
+    for (size_t threadCount = 1; threadCount <= maxThreadCount; threadCount *= 2)
+    {
+        atomic<bool>   finished(false);
+        atomic<size_t> readCount(0);
+        atomic<size_t> writeCount(0);
+
+        thread writer( [&]
+        {
+            for (size_t idx = 0; ! finished; ++idx, ++writeCount)
+                { geodb.Update( nodes[idx % nodes.size()] ); }
+        } );
+
+        vector<thread> readers;
+        for (size_t threadIdx = 0; threadIdx < threadCount; ++threadIdx)
+        {
+            readers.emplace_back( [&, threadIdx]
+            {
+                for (size_t idx = threadIdx; ! finished; idx += 7, ++readCount)
+                {
+                    geodb.GetClosestNodesByDistance( nodes[idx % nodes.size()].location(),
+                        20000, 10, Neighbours::Included );
+                }
+            } );
+        }
+
+        const chrono::seconds duration(2);
+        this_thread::sleep_for(duration);
+        finished = true;
+        writer.join();
+        for (auto &reader : readers)
+            { reader.join(); }
+
+        cout << "  " << left << setw(2) << threadCount << " reader threads: "
+             << right << setw(8) << readCount / duration.count() << " queries/s, "
+             << setw(8) << writeCount / duration.count() << " updates/s" << endl;
+    }
+    cout << endl;
+}
+
+
+
+// Concurrent access of a database file with different engines and reader connection counts
+void BenchmarkConcurrentAccess(size_t nodeCount)
+{
+    const string dbPath = "benchmark_spatialdb.sqlite";
+    auto removeDbFiles = [dbPath] {
+        remove( dbPath.c_str() );
+        remove( (dbPath + "-wal").c_str() );
+        remove( (dbPath + "-shm").c_str() );
+    };
+
+    const NodeInfo myNodeInfo( "BenchmarkSelf", GpsLocation(47.4808706, 18.849426),
+        NodeContact("127.0.0.1", 16980, 16982), {} );
+    vector<NodeDbEntry> nodes = GenerateNodes(nodeCount);
+    size_t maxThreadCount = max<size_t>( thread::hardware_concurrency(), 2 );
+
+    for (size_t readerConnectionCount : { size_t(1), maxThreadCount })
+    {
+        cout << "Concurrent access with " << nodeCount << " nodes, "
+             << readerConnectionCount << " reader connections" << endl;
+
+        removeDbFiles();
+        SpatiaLiteDatabase geodb( myNodeInfo, dbPath, chrono::hours(1), readerConnectionCount );
+        geodb.StoreMany(nodes);
+        MeasureConcurrentAccess(geodb, nodes, maxThreadCount);
+    }
+
+    {
+        cout << "Concurrent access with " << nodeCount << " nodes, in-memory engine" << endl;
+
+        removeDbFiles();
+        MemorySpatialDatabase geodb( myNodeInfo, dbPath, chrono::hours(1) );
+        geodb.StoreMany(nodes);
+        MeasureConcurrentAccess(geodb, nodes, maxThreadCount);
+    }
+
+    removeDbFiles();
+}
+
+
+
+// Listener doing nothing, used to measure only the cost of notifications
+class NullChangeListener : public IChangeListener
+{
+    SessionId _sessionId;
+
+public:
+
+    NullChangeListener(const SessionId &sessionId) : _sessionId(sessionId) {}
+
+    const SessionId& sessionId() const override { return _sessionId; }
+
+    void OnRegistered() override {}
+    void AddedNode  (const NodeDbEntry&) override {}
+    void UpdatedNode(const NodeDbEntry&) override {}
+    void RemovedNode(const NodeDbEntry&) override {}
+};
+
+
+
+// Write path overhead of many registered listeners, e.g. lots of connected local services
+void BenchmarkListeners(size_t nodeCount)
+{
+    const NodeInfo myNodeInfo( "BenchmarkSelf", GpsLocation(47.4808706, 18.849426),
+        NodeContact("127.0.0.1", 16980, 16982), {} );
+    vector<NodeDbEntry> nodes = GenerateNodes(nodeCount);
+
+    for (size_t listenerCount : { 10, 1000, 5000 })
+    {
+        cout << "Change notifications with " << listenerCount << " listeners" << endl;
+
+        MemorySpatialDatabase geodb( myNodeInfo, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+        ThreadSafeChangeListenerRegistry registry;
+        for (size_t idx = 0; idx < listenerCount; ++idx)
+        {
+            shared_ptr<IChangeListener> listener( new NullChangeListener( "BenchmarkSession" + to_string(idx) ) );
+            registry.AddListener(listener);
+            geodb.changeListenerRegistry().AddListener(listener);
+        }
+
+        Measure("Acquire listeners", 100000, [&] (size_t)
+            { registry.listeners(); } );
+
+        Measure("Store with notifications", nodes.size(), [&] (size_t idx)
+            { geodb.Store( nodes[idx] ); } );
+
+        Measure("RemoveListener and AddListener", 100, [&] (size_t idx)
+        {
+            shared_ptr<IChangeListener> listener( new NullChangeListener( "BenchmarkSession" + to_string(idx) ) );
+            registry.RemoveListener( listener->sessionId() );
+            registry.AddListener(listener);
+        } );
+        cout << endl;
+    }
+}
+
+
+
+// Handling node data with a typical set of services, as done on every request and notification
+void BenchmarkNodeInfo()
+{
+    cout << "Node data with services" << endl;
+
+    const size_t iterations = 100000;
+    const NodeInfo::Services services{
+        ServiceInfo(ServiceType::Profile, 16000, "ProfileServerId"),
+        ServiceInfo(ServiceType::Proximity, 16001),
+        ServiceInfo(ServiceType::Relay, 16002) };
+    const NodeInfo node( "BenchmarkNode", GpsLocation(47.4808706, 18.849426),
+        NodeContact("127.0.0.1", 16980, 16982), services );
+    const NodeInfo sameNode( "BenchmarkNode", GpsLocation(47.4808706, 18.849426),
+        NodeContact("127.0.0.1", 16980, 16982), services );
+    iop::locnet::NodeInfo message;
+    size_t checksum = 0;
+
+    Measure("Services copy", iterations, [&] (size_t)
+        { NodeInfo::Services copy(services); checksum += copy.size(); } );
+
+    Measure("Services compare", iterations, [&] (size_t)
+        { checksum += node.services() == sameNode.services(); } );
+
+    Measure("NodeInfo create", iterations, [&] (size_t)
+    {
+        NodeInfo copy( node.id(), node.location(), node.contact(), node.services() );
+        checksum += copy.services().size();
+    } );
+
+    Measure("NodeInfo serialize", iterations, [&] (size_t)
+    {
+        message.Clear();
+        Converter::FillProtoBuf(&message, node);
+        checksum += message.services_size();
+    } );
+
+    Measure("NodeInfo deserialize", iterations, [&] (size_t)
+        { checksum += Converter::FromProtoBuf(message).services().size(); } );
+
+    cout << "  (checksum " << checksum << ")" << endl << endl;
+}
+
+
+
+// Time until the first query is answered after startup with a node database file
+void BenchmarkStartup(size_t nodeCount)
+{
+    cout << "Startup with " << nodeCount << " nodes in a database file" << endl;
+
+    const string dbPath = "benchmark_spatialdb.sqlite";
+    const string snapshotPath = dbPath + ".snapshot";
+    auto removeDbFiles = [dbPath, snapshotPath] {
+        remove( dbPath.c_str() );
+        remove( (dbPath + "-wal").c_str() );
+        remove( (dbPath + "-shm").c_str() );
+        remove( snapshotPath.c_str() );
+    };
+
+    const NodeInfo myNodeInfo( "BenchmarkSelf", GpsLocation(47.4808706, 18.849426),
+        NodeContact("127.0.0.1", 16980, 16982), {} );
+    vector<NodeDbEntry> nodes = GenerateNodes(nodeCount);
+
+    removeDbFiles();
+    {
+        SpatiaLiteDatabase geodb( myNodeInfo, dbPath, chrono::hours(1) );
+        geodb.StoreMany(nodes);
+    }
+
+    // NOTE shutdown is not measured, databases are destroyed outside of the measured operation
+    unique_ptr<ISpatialDatabase> geodb;
+    Measure("SpatiaLiteDatabase first query", 1, [&] (size_t)
+    {
+        geodb.reset( new SpatiaLiteDatabase( myNodeInfo, dbPath, chrono::hours(1) ) );
+        geodb->GetClosestNodesByDistance( myNodeInfo.location(), 20000, 10, Neighbours::Included );
+    } );
+    geodb.reset();
+
+    // NOTE the snapshot is written on shutdown and invalidated by any later write
+    remove( snapshotPath.c_str() );
+    Measure("MemorySpatialDatabase from SQLite", 1, [&] (size_t)
+    {
+        geodb.reset( new MemorySpatialDatabase( myNodeInfo, dbPath, chrono::hours(1) ) );
+        geodb->GetClosestNodesByDistance( myNodeInfo.location(), 20000, 10, Neighbours::Included );
+    } );
+    geodb.reset();
+
+    Measure("MemorySpatialDatabase from snapshot", 1, [&] (size_t)
+    {
+        geodb.reset( new MemorySpatialDatabase( myNodeInfo, dbPath, chrono::hours(1) ) );
+        geodb->GetClosestNodesByDistance( myNodeInfo.location(), 20000, 10, Neighbours::Included );
+    } );
+    geodb.reset();
+
+    removeDbFiles();
+    cout << endl;
+}
+
+
+
+int main(int argc, const char* const argv[])
+{
+    try
+    {
+        el::Loggers::reconfigureAllLoggers(el::ConfigurationType::Enabled, "false");
+
+        vector<size_t> nodeCounts;
+        for (int argIdx = 1; argIdx < argc; ++argIdx)
+            { nodeCounts.push_back( stoul( argv[argIdx] ) ); }
+        if ( nodeCounts.empty() )
+            { nodeCounts = { 10000, 100000 }; }
+
+        const NodeInfo myNodeInfo( "BenchmarkSelf", GpsLocation(47.4808706, 18.849426),
+            NodeContact("127.0.0.1", 16980, 16982), {} );
+        BenchmarkNodeInfo();
+        BenchmarkListeners( min<size_t>( nodeCounts.front(), 10000 ) );
+        for (size_t nodeCount : nodeCounts)
+        {
+            SpatiaLiteDatabase spatialiteDb( myNodeInfo, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+            BenchmarkSpatialDatabase(spatialiteDb, "SpatiaLiteDatabase", nodeCount);
+            
+            MemorySpatialDatabase memoryDb( myNodeInfo, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+            BenchmarkSpatialDatabase(memoryDb, "MemorySpatialDatabase", nodeCount);
+        }
+        BenchmarkBulkWrites( nodeCounts.front() );
+        BenchmarkConcurrentAccess( nodeCounts.front() );
+        BenchmarkStartup( nodeCounts.back() );
+
+        return 0;
+    }
+    catch (exception &e)
+    {
+        cerr << "Failed with exception: " << e.what() << endl;
+        return 1;
+    }
+}
@@ -1,6 +1,15 @@
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <unordered_set>
+
 #include <catch.hpp>
 #include <easylogging++.h>
+#include <spatialite.h>
 
+#include "geodesy.hpp"
+#include "snapshot.hpp"
 #include "testdata.hpp"
 #include "testimpls.hpp"
 
@@ -58,15 +67,87 @@ SCENARIO("Construction and behaviour of data holder types", "[basic][logic]")
         }
     }
     
-    GIVEN("A node info object") {
+    GIVEN("IP addresses") {
+        THEN("they are converted between text and binary formats") {
+            IpAddress ipv4 = IpAddress::FromString("1.2.3.4");
+            REQUIRE( ipv4.family() == AddressFamily::IPv4 );
+            REQUIRE( ipv4.Bytes() == string("\x01\x02\x03\x04") );
+            REQUIRE( ipv4.ToString() == "1.2.3.4" );
+            REQUIRE( IpAddress::FromBytes( ipv4.Bytes() ) == ipv4 );
+            
+            IpAddress ipv6 = IpAddress::FromString("2001:db8::1");
+            REQUIRE( ipv6.family() == AddressFamily::IPv6 );
+            REQUIRE( ipv6.Bytes().size() == 16 );
+            REQUIRE( ipv6.ToString() == "2001:db8::1" );
+            REQUIRE( IpAddress::FromString("2001:0db8:0:0::0001") == ipv6 );
+            REQUIRE( ipv6 != ipv4 );
+            
+            IpAddress empty = IpAddress::FromString("");
+            REQUIRE( empty.empty() );
+            REQUIRE( empty == IpAddress() );
+            REQUIRE( empty.Bytes().empty() );
+            REQUIRE( empty.ToString().empty() );
+        }
+        
+        THEN("invalid values are rejected") {
+            REQUIRE_THROWS( IpAddress::FromString("not.an.ip.address") );
+            REQUIRE_THROWS( IpAddress::FromBytes("\x01\x02\x03") );
+            REQUIRE_THROWS( NodeContact("localhost", 6666, 7777) );
+        }
+    }
+    
+    GIVEN("A service table") {
         NodeInfo::Services services{
-            { ServiceType::Profile, ServiceInfo(ServiceType::Profile, 1111) } };
+            ServiceInfo(ServiceType::Relay, 3333),
+            ServiceInfo(ServiceType::Profile, 1111, "ProfileServerId") };
+        THEN("it behaves like a map keyed by service type") {
+            REQUIRE( services.size() == 2 );
+            REQUIRE( ! services.empty() );
+            REQUIRE( services.at(ServiceType::Profile) == ServiceInfo(ServiceType::Profile, 1111, "ProfileServerId") );
+            REQUIRE( services.at(ServiceType::Relay) == ServiceInfo(ServiceType::Relay, 3333) );
+            REQUIRE_THROWS( services.at(ServiceType::Token) );
+            
+            vector<ServiceInfo> ordered( services.begin(), services.end() );
+            REQUIRE( ordered.size() == 2 );
+            REQUIRE( ordered[0].type() == ServiceType::Profile );
+            REQUIRE( ordered[1].type() == ServiceType::Relay );
+            
+            services.set( ServiceInfo(ServiceType::Profile, 1112) );
+            REQUIRE( services.size() == 2 );
+            REQUIRE( services.at(ServiceType::Profile).port() == 1112 );
+            REQUIRE( services.at(ServiceType::Profile).customData().empty() );
+            
+            services.erase(ServiceType::Relay);
+            services.erase(ServiceType::Token);
+            REQUIRE( services == NodeInfo::Services{ ServiceInfo(ServiceType::Profile, 1112) } );
+            services.erase(ServiceType::Profile);
+            REQUIRE( services.empty() );
+            REQUIRE( services.begin() == services.end() );
+        }
+        
+        THEN("equality does not depend on the order of additions") {
+            NodeInfo::Services reversed;
+            reversed.set( ServiceInfo(ServiceType::Profile, 1111, "ProfileServerId") );
+            reversed.set( ServiceInfo(ServiceType::Relay, 3333) );
+            REQUIRE( reversed == services );
+            reversed.set( ServiceInfo(ServiceType::Relay, 3333, "RelayData") );
+            REQUIRE( reversed != services );
+        }
+        
+        THEN("unknown service types are rejected") {
+            REQUIRE_THROWS( services.set( ServiceInfo(static_cast<ServiceType>(100), 1) ) );
+            REQUIRE( services.count( static_cast<ServiceType>(100) ) == 0 );
+        }
+    }
+    
+    GIVEN("A node info object") {
+        NodeInfo::Services services{ ServiceInfo(ServiceType::Profile, 1111) };
         NodeInfo node( "NodeId", loc, NodeContact("127.0.0.1", 6666, 7777), services );
         THEN("its fields are properly filled in") {
             REQUIRE( node.id() == "NodeId" );
             REQUIRE( node.location() == loc );
             
-            NodeContact &contact = node.contact();
+            NodeContact contact = node.contact();
             REQUIRE( contact.address() == "127.0.0.1" );
             REQUIRE( contact.nodeEndpoint().isLoopback() );
             REQUIRE( contact.nodePort() == 6666 );
@@ -75,6 +156,7 @@ SCENARIO("Construction and behaviour of data holder types", "[basic][logic]")
             REQUIRE( node.services() == services );
             REQUIRE( node.services().size() == 1 );
             REQUIRE( node.services().find(ServiceType::Profile) != node.services().end() );
+            REQUIRE( node.services().count(ServiceType::Relay) == 0 );
             const ServiceInfo &service = node.services().at(ServiceType::Profile);
             REQUIRE( service.type() == ServiceType::Profile );
             REQUIRE( service.port() == 1111 );
@@ -84,6 +166,100 @@ SCENARIO("Construction and behaviour of data holder types", "[basic][logic]")
             REQUIRE( contact.address() == "1.2.3.4" );
             REQUIRE( ! contact.nodeEndpoint().isLoopback() );
         }
+        
+        THEN("its copies share data until modified") {
+            NodeInfo copy(node);
+            REQUIRE( &copy.contact() == &node.contact() );
+            
+            NodeContact contact = copy.contact();
+            contact.address( Address("1.2.3.4") );
+            copy.contact(contact);
+            copy.services( NodeInfo::Services() );
+            
+            REQUIRE( copy.id() == node.id() );
+            REQUIRE( copy.contact().address() == "1.2.3.4" );
+            REQUIRE( copy.services().empty() );
+            REQUIRE( node.contact().address() == "127.0.0.1" );
+            REQUIRE( node.services() == services );
+            REQUIRE( copy != node );
+            
+            NodeDbEntry entry( node, NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+            REQUIRE( &entry.services() == &node.services() );
+        }
+    }
+}
+
+
+
+SCENARIO("Geodesic distances", "[geodesy][logic]")
+{
+    GIVEN("A SpatiaLite connection as a reference") {
+        sqlite3 *dbHandle = nullptr;
+        REQUIRE( sqlite3_open(":memory:", &dbHandle) == SQLITE_OK );
+        void *spatialiteConnection = spatialite_alloc_connection();
+        spatialite_init_ex(dbHandle, spatialiteConnection, 0);
+        scope_exit cleanup( [dbHandle, spatialiteConnection] {
+            sqlite3_close(dbHandle);
+            spatialite_cleanup_ex(spatialiteConnection); } );
+        
+        auto spatialiteDistanceKm = [dbHandle] (const GpsLocation &one, const GpsLocation &other)
+        {
+            sqlite3_stmt *statement = nullptr;
+            sqlite3_prepare_v2( dbHandle,
+                "SELECT Distance(MakePoint(?, ?), MakePoint(?, ?), 1) / 1000", -1, &statement, nullptr );
+            scope_exit finalizeStmt( [statement] { sqlite3_finalize(statement); } );
+            sqlite3_bind_double( statement, 1, one.longitude() );
+            sqlite3_bind_double( statement, 2, one.latitude() );
+            sqlite3_bind_double( statement, 3, other.longitude() );
+            sqlite3_bind_double( statement, 4, other.latitude() );
+            REQUIRE( sqlite3_step(statement) == SQLITE_ROW );
+            return sqlite3_column_double(statement, 0);
+        };
+        
+        mt19937 random(42);
+        uniform_real_distribution<GpsCoordinate> latitudes(-80, 80);
+        uniform_real_distribution<GpsCoordinate> longitudes(-180, 180);
+        vector<GpsLocation> locations = { TestData::Kecskemet, TestData::Wien,
+            TestData::London, TestData::NewYork, TestData::CapeTown };
+        for (size_t idx = 0; idx < 100; ++idx)
+            { locations.emplace_back( latitudes(random), longitudes(random) ); }
+        
+        THEN("ellipsoidal distances agree with SpatiaLite within a meter") {
+            for (const auto &location : locations)
+            {
+                double expected = spatialiteDistanceKm(TestData::Budapest, location);
+                REQUIRE( fabs( GeodesicDistanceKm(TestData::Budapest, location) - expected ) < 0.001 );
+            }
+        }
+        
+        THEN("spherical distances differ from SpatiaLite by at most 0.6%") {
+            for (const auto &location : locations)
+            {
+                double expected = spatialiteDistanceKm(TestData::Budapest, location);
+                REQUIRE( GeodesicDistanceKm(TestData::Budapest, location, GeodesicModel::Spherical) ==
+                         Approx(expected).epsilon(0.006) );
+            }
+        }
+        
+        THEN("batch results are the same as single ones") {
+            for ( auto model : { GeodesicModel::Spherical, GeodesicModel::Ellipsoidal } )
+            {
+                vector<Distance> distances = GeodesicDistancesKm(TestData::Budapest, locations, model);
+                REQUIRE( distances.size() == locations.size() );
+                for (size_t idx = 0; idx < locations.size(); ++idx)
+                    { REQUIRE( distances[idx] == GeodesicDistanceKm(TestData::Budapest, locations[idx], model) ); }
+            }
+        }
+    }
+    
+    GIVEN("Special point pairs") {
+        THEN("they are handled properly") {
+            REQUIRE( GeodesicDistanceKm(TestData::Budapest, TestData::Budapest) == 0 );
+            // Nearly antipodal points fall back to spherical distance
+            Distance antipodal = GeodesicDistanceKm( GpsLocation(0, 0), GpsLocation(0.5, 179.7) );
+            REQUIRE( antipodal == Approx(20000).epsilon(0.01) );
+            REQUIRE( GeodesicDistanceKm( GpsLocation(0, 0), GpsLocation(0, 90) ) == Approx(10018.75).epsilon(0.000001) );
+        }
     }
 }
 
@@ -121,10 +297,9 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
         
         WHEN("adding nodes") {
             NodeInfo::Services services1{
-                { ServiceType::Profile, ServiceInfo(ServiceType::Profile, 1111, "ProfileServerId") },
-                { ServiceType::Token, ServiceInfo(ServiceType::Token, 2222) } };
-            NodeInfo::Services services2{
-                { ServiceType::Relay, ServiceInfo(ServiceType::Relay, 3333) } };
+                ServiceInfo(ServiceType::Profile, 1111, "ProfileServerId"),
+                ServiceInfo(ServiceType::Token, 2222) };
+            NodeInfo::Services services2{ ServiceInfo(ServiceType::Relay, 3333) };
             NodeDbEntry entry1( NodeInfo( "ColleagueNodeId1", GpsLocation(1.0, 1.0),
                 NodeContact("127.0.0.1", 6666, 7777), services1 ),
                     NodeRelationType::Colleague, NodeContactRoleType::Initiator );
@@ -137,6 +312,9 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
             
             THEN("they can be queried and removed") {
                 REQUIRE( geodb.GetNodeCount() == 3 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Self) == 1 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Colleague) == 1 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Neighbour) == 1 );
                 REQUIRE( geodb.GetNeighbourNodesByDistance().size() == 1 );
                 REQUIRE_THROWS( geodb.Remove("NonExistingNodeId") );
                 
@@ -144,9 +322,21 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
                 REQUIRE( loaded1 != nullptr );
                 REQUIRE( loaded1->services() == services1 );
                 REQUIRE( loaded1->services().at(ServiceType::Profile).customData() == "ProfileServerId" );
-                
+
+                shared_ptr<NodeDbEntry> topology1 = geodb.Load("ColleagueNodeId1", ServiceDetails::Excluded);
+                REQUIRE( topology1 != nullptr );
+                REQUIRE( topology1->location() == entry1.location() );
+                REQUIRE( topology1->services().empty() );
+
+                vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                    GpsLocation(1.0, 1.0), 1000, 2, Neighbours::Included );
+                REQUIRE( closestNodes.size() == 2 );
+                REQUIRE( closestNodes[0].services() == services1 );
+                REQUIRE( closestNodes[1].services() == services2 );
+
                 geodb.Remove("ColleagueNodeId1");
                 REQUIRE( geodb.GetNodeCount() == 2 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Colleague) == 0 );
                 REQUIRE( geodb.GetNeighbourNodesByDistance().size() == 1 );
                 
                 shared_ptr<NodeDbEntry> loaded2 = geodb.Load("NeighbourNodeId2");
@@ -161,6 +351,108 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
             }
         }
         
+        WHEN("writing nodes in batches") {
+            shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
+            geodb.changeListenerRegistry().AddListener(listener);
+
+            geodb.StoreMany( { TestData::EntryKecskemet, TestData::EntryWien, TestData::EntryLondon } );
+
+            THEN("all of them are written at once") {
+                REQUIRE( geodb.GetNodeCount() == 4 );
+                REQUIRE( listener->addedCount == 3 );
+                REQUIRE( *geodb.Load( TestData::NodeWien.id() ) == TestData::EntryWien );
+
+                NodeDbEntry movedWien( NodeInfo( TestData::NodeWien.id(), TestData::NewYork,
+                    TestData::NodeWien.contact(), {} ), NodeRelationType::Colleague, NodeContactRoleType::Initiator );
+                geodb.UpdateMany( { TestData::EntryKecskemet, movedWien } );
+                // NOTE unchanged Kecskemet entry is only renewed without notification
+                REQUIRE( listener->updatedCount == 1 );
+                REQUIRE( *geodb.Load( TestData::NodeWien.id() ) == movedWien );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Colleague) == 2 );
+            }
+
+            THEN("a failing batch is rolled back as a whole") {
+                NodeDbEntry newNode( NodeInfo( "NewNodeId", TestData::CapeTown,
+                    NodeContact("127.0.0.1", 6666, 7777), {} ),
+                    NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+                REQUIRE_THROWS( geodb.StoreMany( { newNode, TestData::EntryLondon } ) );
+                REQUIRE( geodb.Load("NewNodeId") == nullptr );
+                REQUIRE( geodb.GetNodeCount() == 4 );
+                REQUIRE( listener->addedCount == 3 );
+
+                NodeDbEntry missingNode( NodeInfo( "MissingNodeId", TestData::CapeTown,
+                    NodeContact("127.0.0.1", 6666, 7777), {} ),
+                    NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+                NodeDbEntry movedLondon( NodeInfo( TestData::NodeLondon.id(), TestData::CapeTown,
+                    TestData::NodeLondon.contact(), {} ),
+                    NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+                REQUIRE_THROWS( geodb.UpdateMany( { movedLondon, missingNode } ) );
+                REQUIRE( *geodb.Load( TestData::NodeLondon.id() ) == TestData::EntryLondon );
+                REQUIRE( listener->updatedCount == 0 );
+            }
+        }
+
+        WHEN("having many nodes all around the world") {
+            mt19937 random(42);
+            uniform_real_distribution<GpsCoordinate> latitudes(-90, 90);
+            uniform_real_distribution<GpsCoordinate> longitudes(-180, 180);
+            for (size_t idx = 0; idx < 300; ++idx)
+            {
+                geodb.Store( NodeDbEntry( NodeInfo( "RandomNodeId" + to_string(idx),
+                    GpsLocation( latitudes(random), longitudes(random) ),
+                    NodeContact("127.0.0.1", 6666, 7777), {} ),
+                    NodeRelationType::Colleague, NodeContactRoleType::Acceptor ) );
+            }
+
+            vector<NodeDbEntry> allNodes = geodb.GetRandomNodes(1000, Neighbours::Included);
+            REQUIRE( allNodes.size() == 301 );
+
+            THEN("random samples have no duplicates and honour the filter") {
+                for (size_t sampleSize : { 1, 50, 299, 300 })
+                {
+                    vector<NodeDbEntry> sample = geodb.GetRandomNodes(sampleSize, Neighbours::Excluded);
+                    REQUIRE( sample.size() == sampleSize );
+
+                    unordered_set<NodeId> sampleIds;
+                    for (const auto &node : sample)
+                    {
+                        REQUIRE( node.relationType() == NodeRelationType::Colleague );
+                        sampleIds.insert( node.id() );
+                    }
+                    REQUIRE( sampleIds.size() == sampleSize );
+                }
+                REQUIRE( geodb.GetRandomNodes(1000, Neighbours::Excluded).size() == 300 );
+            }
+
+            THEN("indexed closest nodes are the same as with a full scan") {
+                // Including positions near poles and crossing the antimeridian
+                vector<GpsLocation> queryLocations = { TestData::Budapest, TestData::CapeTown,
+                    GpsLocation(89.9, 179.9), GpsLocation(-89.9, -10), GpsLocation(0, 179.99),
+                    GpsLocation(0, -179.99), GpsLocation(60, 0) };
+                for (const auto &location : queryLocations)
+                {
+                    for (Distance radiusKm : { 500.f, 3000.f, 25000.f })
+                    {
+                        vector<pair<Distance, NodeId>> expected;
+                        for (const auto &node : allNodes)
+                        {
+                            Distance distance = geodb.GetDistanceKm( location, node.location() );
+                            if (distance <= radiusKm)
+                                { expected.emplace_back( distance, node.id() ); }
+                        }
+                        sort( expected.begin(), expected.end() );
+                        expected.resize( min<size_t>( expected.size(), 10 ) );
+
+                        vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                            location, radiusKm, 10, Neighbours::Included );
+                        REQUIRE( closestNodes.size() == expected.size() );
+                        for (size_t idx = 0; idx < expected.size(); ++idx)
+                            { REQUIRE( closestNodes[idx].id() == expected[idx].second ); }
+                    }
+                }
+            }
+        }
+
         WHEN("when having several nodes") {
             shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
             geodb.changeListenerRegistry().AddListener(listener);
@@ -232,13 +524,35 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
                 REQUIRE( neighboursByDistance[0] == TestData::EntryKecskemet );
                 REQUIRE( neighboursByDistance[1] == TestData::EntryWien );
             }
+            THEN("Neighbour list positions match neighbour ranks") {
+                // NOTE nodes at the same place and stored in reverse order of their ids to have ties
+                for (const char *suffix : { "C", "B", "A" })
+                {
+                    geodb.Store( NodeDbEntry( NodeInfo( string("TiedNeighbour") + suffix, TestData::Wien,
+                            NodeContact("127.0.0.1", 6666, 7777), {} ),
+                        NodeRelationType::Neighbour, NodeContactRoleType::Acceptor ) );
+                }
+                
+                vector<NodeDbEntry> neighboursByDistance( geodb.GetNeighbourNodesByDistance() );
+                REQUIRE( neighboursByDistance.size() == 5 );
+                for (size_t rank = 0; rank < neighboursByDistance.size(); ++rank)
+                {
+                    REQUIRE( geodb.GetNeighbourRank( neighboursByDistance[rank].id() ) == rank );
+                    REQUIRE( *geodb.GetNeighbourByRank(rank) == neighboursByDistance[rank] );
+                }
+            }
             THEN("Data is properly updated and deleted") {
                 REQUIRE( geodb.GetNodeCount() == 6 );
                 REQUIRE( geodb.GetNeighbourNodesByDistance().size() == 2 );
                 
+                geodb.Update(TestData::EntryLondon);
+                REQUIRE( listener->updatedCount == 0 );
+                REQUIRE( *geodb.Load( TestData::NodeLondon.id() ) == TestData::EntryLondon );
+                
                 NodeDbEntry updatedLondonEntry(TestData::NodeLondon,
                     NodeRelationType::Neighbour, NodeContactRoleType::Initiator);
                 geodb.Update(updatedLondonEntry);
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Neighbour) == 3 );
                 
                 shared_ptr<NodeDbEntry> londonEntry = geodb.Load( TestData::NodeLondon.id() );
                 REQUIRE( *londonEntry == updatedLondonEntry );
@@ -249,11 +563,23 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
                 REQUIRE( neighboursByDistance[0] == TestData::EntryKecskemet );
                 REQUIRE( neighboursByDistance[1] == TestData::EntryWien );
                 REQUIRE( neighboursByDistance[2] == updatedLondonEntry );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeKecskemet.id() ) == 0 );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeLondon.id() ) == 2 );
+                REQUIRE( *geodb.GetNeighbourByRank(1) == TestData::EntryWien );
+                REQUIRE( geodb.GetNeighbourByRank(3) == nullptr );
+                REQUIRE_THROWS( geodb.GetNeighbourRank( TestData::NodeNewYork.id() ) );
 
                 REQUIRE( listener->addedCount == 5 );
                 REQUIRE( listener->updatedCount == 1 );
                 REQUIRE( listener->removedCount == 0 );
                 
+                NodeInfo servedLondon(TestData::NodeLondon);
+                servedLondon.services( { ServiceInfo(ServiceType::Profile, 1111, "ProfileServerId") } );
+                NodeDbEntry servedLondonEntry(servedLondon, NodeRelationType::Neighbour, NodeContactRoleType::Initiator);
+                geodb.Update(servedLondonEntry);
+                REQUIRE( listener->updatedCount == 2 );
+                REQUIRE( *geodb.Load( TestData::NodeLondon.id() ) == servedLondonEntry );
+                
                 geodb.Remove( TestData::NodeKecskemet.id() );
                 geodb.Remove( TestData::NodeLondon.id() );
                 geodb.Remove( TestData::NodeNewYork.id() );
@@ -261,11 +587,47 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
                 geodb.Remove( TestData::NodeCapeTown.id() );
                 
                 REQUIRE( listener->addedCount == 5 );
-                REQUIRE( listener->updatedCount == 1 );
+                REQUIRE( listener->updatedCount == 2 );
                 REQUIRE( listener->removedCount == 5 );
                 
                 REQUIRE( geodb.GetNodeCount() == 1 );
                 REQUIRE( geodb.GetNeighbourNodesByDistance().empty() );
+                REQUIRE( geodb.GetNeighbourByRank(0) == nullptr );
+            }
+        }
+    }
+
+    GIVEN("A spatial database with immediately expiring entries") {
+        SpatiaLiteDatabase geodb(TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::seconds(0) );
+        shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
+        geodb.changeListenerRegistry().AddListener(listener);
+
+        NodeDbEntry servedNode( NodeInfo( "ServedNodeId", TestData::London,
+            NodeContact("127.0.0.1", 6666, 7777),
+            { ServiceInfo(ServiceType::Profile, 1111) } ),
+            NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+        geodb.StoreMany( { TestData::EntryKecskemet, servedNode } );
+        geodb.Store( TestData::EntryWien, false );
+
+        WHEN("expiring old nodes") {
+            geodb.ExpireOldNodes();
+
+            THEN("only expired nodes are removed with a single notification each") {
+                REQUIRE( listener->removedCount == 2 );
+                REQUIRE( geodb.GetNodeCount() == 2 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Colleague) == 0 );
+                REQUIRE( geodb.Load( TestData::NodeKecskemet.id() ) == nullptr );
+                REQUIRE( geodb.Load( TestData::NodeBudapest.id() ) != nullptr );
+                REQUIRE( *geodb.Load( TestData::NodeWien.id() ) == TestData::EntryWien );
+
+                geodb.ExpireOldNodes();
+                REQUIRE( listener->removedCount == 2 );
+                REQUIRE( geodb.GetNodeCount() == 2 );
+
+                // services of expired nodes are removed as well
+                geodb.Store(servedNode);
+                REQUIRE( geodb.Load( servedNode.id() )->services() == servedNode.services() );
             }
         }
     }
@@ -273,6 +635,412 @@ SCENARIO("Spatial database", "[spatialdb][logic]")
 
 
 
+SCENARIO("Spatial database file with reader connections", "[spatialdb][logic]")
+{
+    GIVEN("A spatial database stored in a file") {
+        const string dbPath = "test_locnet_spatialdb.sqlite";
+        auto removeDbFiles = [dbPath] {
+            remove( dbPath.c_str() );
+            remove( (dbPath + "-wal").c_str() );
+            remove( (dbPath + "-shm").c_str() );
+        };
+        removeDbFiles();
+        scope_exit cleanup(removeDbFiles);
+
+        {
+            SpatiaLiteDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1), 4 );
+            geodb.Store(TestData::EntryKecskemet);
+            geodb.Store(TestData::EntryWien);
+
+            THEN("concurrent readers see committed data while writing") {
+                atomic<size_t> failureCount(0);
+                vector<thread> readers;
+                for (size_t threadIdx = 0; threadIdx < 8; ++threadIdx)
+                {
+                    readers.emplace_back( [&geodb, &failureCount]
+                    {
+                        for (size_t idx = 0; idx < 100; ++idx)
+                        {
+                            vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                                TestData::Budapest, 20000, 2, Neighbours::Included );
+                            if ( closestNodes.size() != 2 || ! (closestNodes[1] == TestData::EntryKecskemet) ||
+                                 geodb.Load( TestData::NodeWien.id() ) == nullptr )
+                                { ++failureCount; }
+                        }
+                    } );
+                }
+
+                geodb.Store(TestData::EntryLondon);
+                for (size_t idx = 0; idx < 100; ++idx)
+                    { geodb.Update(TestData::EntryLondon); }
+                geodb.Remove( TestData::NodeLondon.id() );
+
+                for (auto &reader : readers)
+                    { reader.join(); }
+                REQUIRE( failureCount == 0 );
+                REQUIRE( geodb.GetNodeCount() == 3 );
+            }
+        }
+
+        THEN("data is persisted") {
+            SpatiaLiteDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1), 2 );
+            REQUIRE( geodb.GetNodeCount() == 3 );
+            REQUIRE( geodb.GetNeighbourNodesByDistance().size() == 2 );
+            REQUIRE( *geodb.Load( TestData::NodeKecskemet.id() ) == TestData::EntryKecskemet );
+        }
+        
+        THEN("databases of old versions get a stable spatial index key") {
+            removeDbFiles();
+            {
+                sqlite3 *dbHandle = nullptr;
+                REQUIRE( sqlite3_open( dbPath.c_str(), &dbHandle ) == SQLITE_OK );
+                void *spatialiteConnection = spatialite_alloc_connection();
+                spatialite_init_ex(dbHandle, spatialiteConnection, 0);
+                scope_exit closeDb( [dbHandle, spatialiteConnection] {
+                    sqlite3_close(dbHandle);
+                    spatialite_cleanup_ex(spatialiteConnection); } );
+                
+                // Schema of version 1 without spatial index and explicit integer key, rowids with gaps
+                string nodeValues = "'" + TestData::NodeWien.contact().address() + "', " +
+                    to_string( TestData::NodeWien.contact().nodePort() ) + ", " +
+                    to_string( TestData::NodeWien.contact().clientPort() ) + ", " +
+                    to_string( static_cast<int>(NodeRelationType::Colleague) ) + ", " +
+                    to_string( static_cast<int>(NodeContactRoleType::Initiator) ) + ", 4102444800, ";
+                string oldDbCommands =
+                    "CREATE TABLE metainfo (key TEXT PRIMARY KEY, value TEXT NOT NULL);"
+                    "INSERT INTO metainfo (key, value) VALUES ('version', '1');"
+                    "CREATE TABLE nodes (id TEXT PRIMARY KEY, ipAddress TEXT NOT NULL, nodePort INT NOT NULL, "
+                    "  clientPort INT NOT NULL, relationType INT NOT NULL, roleType INT NOT NULL, "
+                    "  expiresAt INT NOT NULL, location POINT NOT NULL);"
+                    "CREATE TABLE services (nodeId TEXT NOT NULL, serviceType INT NOT NULL, port INT NOT NULL, "
+                    "  data BLOB, PRIMARY KEY(nodeId, serviceType), FOREIGN KEY(nodeId) REFERENCES nodes(id));"
+                    "INSERT INTO nodes (rowid, id, ipAddress, nodePort, clientPort, relationType, roleType, expiresAt, location) "
+                    "  VALUES (7, '" + TestData::NodeWien.id() + "', " + nodeValues +
+                    "MakePoint(" + to_string( TestData::Wien.longitude() ) + ", " + to_string( TestData::Wien.latitude() ) + "));";
+                REQUIRE( sqlite3_exec( dbHandle, oldDbCommands.c_str(), nullptr, nullptr, nullptr ) == SQLITE_OK );
+            }
+            
+            {
+                SpatiaLiteDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1), 2 );
+                REQUIRE( geodb.GetNodeCount() == 2 );
+                geodb.Store(TestData::EntryLondon);
+            }
+            
+            sqlite3 *dbHandle = nullptr;
+            REQUIRE( sqlite3_open( dbPath.c_str(), &dbHandle ) == SQLITE_OK );
+            REQUIRE( sqlite3_exec( dbHandle, "VACUUM;", nullptr, nullptr, nullptr ) == SQLITE_OK );
+            sqlite3_stmt *statement = nullptr;
+            REQUIRE( sqlite3_prepare_v2( dbHandle, "SELECT count(*) FROM nodes_rtree JOIN nodes ON nodes_rtree.id = nodes.rid",
+                -1, &statement, nullptr ) == SQLITE_OK );
+            REQUIRE( sqlite3_step(statement) == SQLITE_ROW );
+            REQUIRE( sqlite3_column_int(statement, 0) == 3 );
+            sqlite3_finalize(statement);
+            sqlite3_close(dbHandle);
+            
+            SpatiaLiteDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1), 2 );
+            vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                TestData::Wien, 100, 1, Neighbours::Included );
+            REQUIRE( closestNodes.size() == 1 );
+            REQUIRE( closestNodes[0].id() == TestData::NodeWien.id() );
+            closestNodes = geodb.GetClosestNodesByDistance( TestData::London, 100, 1, Neighbours::Included );
+            REQUIRE( closestNodes.size() == 1 );
+            REQUIRE( closestNodes[0] == TestData::EntryLondon );
+        }
+    }
+}
+
+
+
+SCENARIO("In-memory SpatiaLite database with concurrent readers", "[spatialdb][logic]")
+{
+    GIVEN("A SpatiaLite database without a file") {
+        SpatiaLiteDatabase geodb( TestData::NodeBudapest, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+        
+        const GpsLocation first(10.0, 10.0);
+        const GpsLocation second(-10.0, -10.0);
+        auto batchAt = [] (const GpsLocation &location)
+        {
+            vector<NodeDbEntry> batch;
+            for (size_t idx = 0; idx < 20; ++idx)
+            {
+                batch.push_back( NodeDbEntry( NodeInfo( "BatchNode" + to_string(idx),
+                        GpsLocation( location.latitude() + idx * 0.001, location.longitude() ),
+                        NodeContact( "127.0.0.1", 7000 + idx, 8000 + idx ), {} ),
+                    NodeRelationType::Colleague, NodeContactRoleType::Acceptor ) );
+            }
+            return batch;
+        };
+        geodb.StoreMany( batchAt(first) );
+        
+        THEN("readers never see uncommitted changes of a batch") {
+            atomic<bool> writing(true);
+            atomic<size_t> failureCount(0);
+            vector<thread> readers;
+            for (size_t threadIdx = 0; threadIdx < 4; ++threadIdx)
+            {
+                readers.emplace_back( [&]
+                {
+                    while (writing)
+                    {
+                        size_t count = geodb.GetClosestNodesByDistance( first, 100, 100, Neighbours::Included ).size();
+                        if (count != 0 && count != 20)
+                            { ++failureCount; }
+                    }
+                } );
+            }
+            
+            for (size_t idx = 0; idx < 50; ++idx)
+                { geodb.UpdateMany( batchAt( idx % 2 == 0 ? second : first ) ); }
+            writing = false;
+            for (auto &reader : readers)
+                { reader.join(); }
+            
+            REQUIRE( failureCount == 0 );
+        }
+    }
+}
+
+
+
+SCENARIO("In-memory spatial database", "[spatialdb][logic]")
+{
+    GIVEN("An in-memory spatial database persisted to a file") {
+        const string dbPath = "test_locnet_memspatialdb.sqlite";
+        const string snapshotPath = dbPath + ".snapshot";
+        auto removeDbFiles = [dbPath, snapshotPath] {
+            remove( dbPath.c_str() );
+            remove( (dbPath + "-wal").c_str() );
+            remove( (dbPath + "-shm").c_str() );
+            remove( snapshotPath.c_str() );
+        };
+        removeDbFiles();
+        scope_exit cleanup(removeDbFiles);
+
+        NodeInfo::Services services{ ServiceInfo(ServiceType::Profile, 1111, "ProfileServerId") };
+        NodeDbEntry servedNode( NodeInfo( "ServedNodeId", TestData::CapeTown,
+            NodeContact("127.0.0.1", 6666, 7777), services ),
+            NodeRelationType::Colleague, NodeContactRoleType::Acceptor );
+
+        {
+            MemorySpatialDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1) );
+            shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
+            geodb.changeListenerRegistry().AddListener(listener);
+
+            REQUIRE( geodb.GetNodeCount() == 1 );
+            REQUIRE( geodb.ThisNode() == TestData::EntryBudapest );
+
+            geodb.StoreMany( { TestData::EntryWien, TestData::EntryKecskemet, TestData::EntryLondon, servedNode } );
+            geodb.Flush();
+            geodb.Remove( TestData::NodeLondon.id() );
+
+            THEN("it behaves like the SpatiaLite implementation") {
+                REQUIRE( listener->addedCount == 4 );
+                REQUIRE( listener->removedCount == 1 );
+                REQUIRE( geodb.GetNodeCount() == 4 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Neighbour) == 2 );
+                REQUIRE( geodb.Load( TestData::NodeLondon.id() ) == nullptr );
+                REQUIRE_THROWS( geodb.Remove( TestData::NodeLondon.id() ) );
+                REQUIRE_THROWS( geodb.Remove( TestData::NodeBudapest.id() ) );
+                REQUIRE_THROWS( geodb.Store(TestData::EntryWien) );
+                REQUIRE_THROWS( geodb.UpdateMany( { TestData::EntryWien, TestData::EntryLondon } ) );
+                REQUIRE( listener->updatedCount == 0 );
+
+                REQUIRE( *geodb.Load( servedNode.id() ) == servedNode );
+                REQUIRE( geodb.Load( servedNode.id(), ServiceDetails::Excluded )->services().empty() );
+
+                vector<NodeDbEntry> neighbours = geodb.GetNeighbourNodesByDistance();
+                REQUIRE( neighbours.size() == 2 );
+                REQUIRE( neighbours[0] == TestData::EntryKecskemet );
+                REQUIRE( neighbours[1] == TestData::EntryWien );
+
+                vector<NodeDbEntry> closest = geodb.GetClosestNodesByDistance(
+                    TestData::Wien, 20000, 2, Neighbours::Excluded );
+                REQUIRE( closest.size() == 1 );
+                REQUIRE( closest[0] == servedNode );
+                REQUIRE( geodb.GetNodes(NodeContactRoleType::Initiator).size() == 2 );
+
+                NodeDbEntry movedWien( NodeInfo( TestData::NodeWien.id(), TestData::NewYork,
+                    TestData::NodeWien.contact(), {} ), NodeRelationType::Colleague, NodeContactRoleType::Initiator );
+                REQUIRE( geodb.GetNeighbourRank( TestData::NodeWien.id() ) == 1 );
+                geodb.Update(TestData::EntryWien);
+                REQUIRE( listener->updatedCount == 0 );
+                geodb.Update(movedWien);
+                REQUIRE( listener->updatedCount == 1 );
+                REQUIRE( geodb.GetNodeCount(NodeRelationType::Neighbour) == 1 );
+                REQUIRE_THROWS( geodb.GetNeighbourRank( TestData::NodeWien.id() ) );
+                REQUIRE( *geodb.GetNeighbourByRank(0) == TestData::EntryKecskemet );
+                closest = geodb.GetClosestNodesByDistance( TestData::NewYork, 100, 10, Neighbours::Included );
+                REQUIRE( closest.size() == 1 );
+                REQUIRE( closest[0] == movedWien );
+                REQUIRE( geodb.GetClosestNodesByDistance( TestData::Wien, 100, 10, Neighbours::Included ).empty() );
+                geodb.Update(TestData::EntryWien);
+            }
+        }
+
+        THEN("its changes are persisted") {
+            SpatiaLiteDatabase persistedDb( TestData::NodeBudapest, dbPath, chrono::hours(1), 1 );
+            REQUIRE( persistedDb.GetNodeCount() == 4 );
+            REQUIRE( *persistedDb.Load( TestData::NodeWien.id() ) == TestData::EntryWien );
+            REQUIRE( *persistedDb.Load( servedNode.id() ) == servedNode );
+        }
+
+        THEN("it loads persisted nodes on startup") {
+            MemorySpatialDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1) );
+            REQUIRE( geodb.GetNodeCount() == 4 );
+            REQUIRE( geodb.GetRandomNodes(10, Neighbours::Excluded).size() == 1 );
+            REQUIRE( *geodb.Load( TestData::NodeKecskemet.id() ) == TestData::EntryKecskemet );
+        }
+
+        THEN("persisted expiration times are kept when loading from the database") {
+            remove( snapshotPath.c_str() );
+            vector<pair<NodeId, time_t>> storedExpirations;
+            {
+                SpatiaLiteDatabase persistedDb( TestData::NodeBudapest, dbPath, chrono::hours(1), 1 );
+                storedExpirations = persistedDb.GetExpirations(NodeContactRoleType::Initiator);
+            }
+            REQUIRE( storedExpirations.size() == 2 );
+            
+            MemorySpatialDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(5) );
+            vector<pair<NodeId, time_t>> loadedExpirations = geodb.GetExpirations(NodeContactRoleType::Initiator);
+            sort( storedExpirations.begin(), storedExpirations.end() );
+            sort( loadedExpirations.begin(), loadedExpirations.end() );
+            REQUIRE( loadedExpirations == storedExpirations );
+        }
+        
+        THEN("a snapshot is written on shutdown") {
+            NodeSnapshot snapshot(snapshotPath);
+            REQUIRE( snapshot.size() == 4 );
+
+            size_t servedCount = 0;
+            for (size_t idx = 0; idx < snapshot.size(); ++idx)
+            {
+                if ( snapshot.Entry(idx).entry.id() == servedNode.id() )
+                {
+                    REQUIRE( snapshot.Entry(idx).entry == servedNode );
+                    ++servedCount;
+                }
+            }
+            REQUIRE( servedCount == 1 );
+        }
+
+        THEN("outdated or broken snapshots are ignored") {
+            NodeSnapshot::Write( snapshotPath, {}, 1 );
+            {
+                MemorySpatialDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1) );
+                REQUIRE( geodb.GetNodeCount() == 4 );
+            }
+
+            {
+                ofstream snapshotFile(snapshotPath, ios::binary | ios::in | ios::out);
+                snapshotFile.write("broken", 6);
+            }
+            REQUIRE_THROWS( NodeSnapshot{snapshotPath} );
+            MemorySpatialDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1) );
+            REQUIRE( geodb.GetNodeCount() == 4 );
+            REQUIRE( *geodb.Load( servedNode.id() ) == servedNode );
+        }
+
+        THEN("snapshots written while nodes change match the database") {
+            {
+                MemorySpatialDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1) );
+                thread writer( [&geodb]
+                {
+                    for (size_t idx = 0; idx < 50; ++idx)
+                    {
+                        geodb.Store( NodeDbEntry( NodeInfo( "ChangingNode" + to_string(idx),
+                                GpsLocation( -30.0 + idx * 0.1, 100.0 ), NodeContact( "127.0.0.1", 7000 + idx, 8000 + idx ), {} ),
+                            NodeRelationType::Colleague, NodeContactRoleType::Acceptor ) );
+                    }
+                } );
+                for (size_t idx = 0; idx < 5; ++idx)
+                    { geodb.WriteSnapshot(); }
+                writer.join();
+            }
+            
+            MemorySpatialDatabase geodb( TestData::NodeBudapest, dbPath, chrono::hours(1) );
+            REQUIRE( geodb.GetNodeCount() == 54 );
+            SpatiaLiteDatabase persistedDb( TestData::NodeBudapest, dbPath, chrono::hours(1), 1 );
+            REQUIRE( persistedDb.GetNodeCount() == 54 );
+        }
+    }
+
+    GIVEN("Many nodes all around the world") {
+        SpatiaLiteDatabase referenceDb( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+        MemorySpatialDatabase geodb( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) );
+
+        mt19937 random(42);
+        uniform_real_distribution<GpsCoordinate> latitudes(-90, 90);
+        uniform_real_distribution<GpsCoordinate> longitudes(-180, 180);
+        vector<NodeDbEntry> nodes;
+        for (size_t idx = 0; idx < 300; ++idx)
+        {
+            nodes.emplace_back( NodeInfo( "RandomNodeId" + to_string(idx),
+                GpsLocation( latitudes(random), longitudes(random) ),
+                NodeContact("127.0.0.1", 6666, 7777), {} ),
+                idx % 10 == 0 ? NodeRelationType::Neighbour : NodeRelationType::Colleague,
+                NodeContactRoleType::Acceptor );
+        }
+        referenceDb.StoreMany(nodes);
+        geodb.StoreMany(nodes);
+
+        THEN("closest nodes are the same as with SpatiaLite") {
+            vector<GpsLocation> queryLocations = { TestData::Budapest, TestData::CapeTown,
+                GpsLocation(89.9, 179.9), GpsLocation(-89.9, -10), GpsLocation(0, 179.99),
+                GpsLocation(0, -179.99), GpsLocation(60, 0) };
+            for (const auto &location : queryLocations)
+            {
+                for (Distance radiusKm : { 500.f, 3000.f, 25000.f })
+                {
+                    for ( Neighbours filter : { Neighbours::Included, Neighbours::Excluded } )
+                    {
+                        vector<NodeDbEntry> expected = referenceDb.GetClosestNodesByDistance(
+                            location, radiusKm, 10, filter );
+                        vector<NodeDbEntry> closestNodes = geodb.GetClosestNodesByDistance(
+                            location, radiusKm, 10, filter );
+                        REQUIRE( closestNodes.size() == expected.size() );
+                        for (size_t idx = 0; idx < expected.size(); ++idx)
+                            { REQUIRE( closestNodes[idx].id() == expected[idx].id() ); }
+                    }
+                }
+            }
+
+            REQUIRE( geodb.GetNeighbourNodesByDistance().size() == 30 );
+            vector<NodeDbEntry> neighbours = geodb.GetNeighbourNodesByDistance();
+            vector<NodeDbEntry> expectedNeighbours = referenceDb.GetNeighbourNodesByDistance();
+            for (size_t idx = 0; idx < expectedNeighbours.size(); ++idx)
+            {
+                REQUIRE( neighbours[idx].id() == expectedNeighbours[idx].id() );
+                REQUIRE( geodb.GetNeighbourRank( expectedNeighbours[idx].id() ) == idx );
+                REQUIRE( geodb.GetNeighbourByRank(idx)->id() == expectedNeighbours[idx].id() );
+            }
+            REQUIRE( geodb.GetRandomNodes(1000, Neighbours::Excluded).size() == 270 );
+        }
+    }
+
+    GIVEN("An in-memory spatial database with immediately expiring entries") {
+        MemorySpatialDatabase geodb( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::seconds(0) );
+        shared_ptr<ChangeCounter> listener( new ChangeCounter("TestListenerId") );
+        geodb.changeListenerRegistry().AddListener(listener);
+
+        geodb.StoreMany( { TestData::EntryKecskemet, TestData::EntryLondon } );
+        geodb.Store( TestData::EntryWien, false );
+        geodb.ExpireOldNodes();
+
+        THEN("only expired nodes are removed") {
+            REQUIRE( listener->removedCount == 2 );
+            REQUIRE( geodb.GetNodeCount() == 2 );
+            REQUIRE( geodb.Load( TestData::NodeKecskemet.id() ) == nullptr );
+            REQUIRE( geodb.GetClosestNodesByDistance( TestData::London, 100, 10, Neighbours::Included ).empty() );
+            REQUIRE( *geodb.Load( TestData::NodeWien.id() ) == TestData::EntryWien );
+        }
+    }
+}
+
+
+
 SCENARIO("Server registration", "[localservice][logic]")
 {
     GIVEN("The location based network") {
@@ -337,3 +1105,299 @@ SCENARIO("Server registration", "[localservice][logic]")
         }
     }
 }
+
+
+
+SCENARIO("Renewing node relations", "[relations][logic]")
+{
+    GIVEN("A node with colleagues of which only one is reachable") {
+        shared_ptr<InProcessNodeConnectionFactory> connectionFactory( new InProcessNodeConnectionFactory() );
+        
+        shared_ptr<ISpatialDatabase> wienDb( new SpatiaLiteDatabase( TestData::NodeWien,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        shared_ptr<Node> wienNode( new Node(wienDb, connectionFactory) );
+        connectionFactory->Add( TestData::NodeWien.contact().nodeEndpoint(), wienNode );
+        
+        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        Node geonet(geodb, connectionFactory);
+        geodb->Store( NodeDbEntry(TestData::NodeWien,     NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        geodb->Store( NodeDbEntry(TestData::NodeLondon,   NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        geodb->Store( NodeDbEntry(TestData::NodeNewYork,  NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        geodb->Store( NodeDbEntry(TestData::NodeCapeTown, NodeRelationType::Colleague, NodeContactRoleType::Acceptor) );
+        
+        WHEN("relations are renewed") {
+            RelationRenewalStats stats = geonet.RenewNodeRelations();
+            
+            THEN("only relations initiated by the node are contacted and reported") {
+                REQUIRE( stats.succeeded == 1 );
+                REQUIRE( stats.failed == 2 );
+                REQUIRE( stats.timedOut == 0 );
+                REQUIRE( wienDb->Load( TestData::NodeBudapest.id() ) != nullptr );
+            }
+        }
+    }
+    
+    GIVEN("A node with colleagues not answering in time") {
+        shared_ptr<InProcessNodeConnectionFactory> connectionFactory( new InProcessNodeConnectionFactory() );
+        connectionFactory->AddUnresponsive( TestData::NodeWien.contact().nodeEndpoint(), chrono::milliseconds(100) );
+        
+        shared_ptr<ISpatialDatabase> londonDb( new SpatiaLiteDatabase( TestData::NodeLondon,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        connectionFactory->Add( TestData::NodeLondon.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(londonDb, connectionFactory) ), chrono::hours(1) );
+        
+        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        Node geonet(geodb, connectionFactory);
+        vector<NodeDbEntry> colleagues{
+            NodeDbEntry(TestData::NodeWien,   NodeRelationType::Colleague, NodeContactRoleType::Initiator),
+            NodeDbEntry(TestData::NodeLondon, NodeRelationType::Colleague, NodeContactRoleType::Initiator) };
+        for (const auto &colleague : colleagues)
+            { geodb->Store(colleague); }
+        
+        WHEN("relations are renewed within a limited cycle") {
+            RelationRenewalStats stats = geonet.RenewNodeRelations( colleagues, chrono::milliseconds(1000) );
+            
+            THEN("both timeouts and renewals in progress at the deadline are reported as timed out") {
+                REQUIRE( stats.succeeded == 0 );
+                REQUIRE( stats.failed == 0 );
+                REQUIRE( stats.timedOut == 2 );
+                REQUIRE( stats.duration < chrono::seconds(5) );
+                REQUIRE( connectionFactory->pendingCount() == 0 );
+            }
+        }
+    }
+    
+    GIVEN("A node with relations about to expire") {
+        shared_ptr<InProcessNodeConnectionFactory> connectionFactory( new InProcessNodeConnectionFactory() );
+        
+        shared_ptr<ISpatialDatabase> wienDb( new SpatiaLiteDatabase( TestData::NodeWien,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        connectionFactory->Add( TestData::NodeWien.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(wienDb, connectionFactory) ) );
+        shared_ptr<ISpatialDatabase> londonDb( new SpatiaLiteDatabase( TestData::NodeLondon,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        connectionFactory->Add( TestData::NodeLondon.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(londonDb, connectionFactory) ) );
+        
+        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::seconds(30) ) );
+        shared_ptr<Node> geonet( new Node(geodb, connectionFactory) );
+        geodb->Store( NodeDbEntry(TestData::NodeWien,   NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        geodb->Store( NodeDbEntry(TestData::NodeLondon, NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        
+        RelationRenewalScheduler scheduler( geodb, geonet, chrono::seconds(60), 1 );
+        
+        THEN("relations within the renewal margin are renewed at the limited rate") {
+            chrono::milliseconds wait = scheduler.RenewDueRelations();
+            REQUIRE( scheduler.scheduledCount() == 1 );
+            REQUIRE( wait > chrono::milliseconds::zero() );
+            REQUIRE( wait <= chrono::seconds(1) );
+            REQUIRE( ( wienDb->Load( TestData::NodeBudapest.id() ) != nullptr ) !=
+                     ( londonDb->Load( TestData::NodeBudapest.id() ) != nullptr ) );
+            
+            scheduler.RenewDueRelations();
+            REQUIRE( scheduler.scheduledCount() == 0 );
+            REQUIRE( wienDb->Load( TestData::NodeBudapest.id() ) != nullptr );
+            REQUIRE( londonDb->Load( TestData::NodeBudapest.id() ) != nullptr );
+        }
+    }
+}
+
+
+
+SCENARIO("Bootstrapping from seed nodes", "[relations][logic]")
+{
+    GIVEN("A healthy seed node and a seed node that does not answer") {
+        shared_ptr<InProcessNodeConnectionFactory> connectionFactory( new InProcessNodeConnectionFactory() );
+        
+        shared_ptr<ISpatialDatabase> wienDb( new SpatiaLiteDatabase( TestData::NodeWien,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        wienDb->Store( NodeDbEntry(TestData::NodeLondon,   NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        wienDb->Store( NodeDbEntry(TestData::NodeNewYork,  NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        wienDb->Store( NodeDbEntry(TestData::NodeCapeTown, NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        connectionFactory->Add( TestData::NodeWien.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(wienDb, connectionFactory) ) );
+        
+        shared_ptr<ISpatialDatabase> kecskemetDb( new SpatiaLiteDatabase( TestData::NodeKecskemet,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        connectionFactory->Add( TestData::NodeKecskemet.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(kecskemetDb, connectionFactory) ), chrono::hours(1) );
+        
+        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        Node geonet(geodb, connectionFactory);
+        
+        THEN("the healthy seed is used without waiting for the other one") {
+            auto started = chrono::steady_clock::now();
+            REQUIRE( geonet.InitializeWorld( { TestData::NodeKecskemet.contact().nodeEndpoint(),
+                                               TestData::NodeWien.contact().nodeEndpoint() } ) );
+            REQUIRE( chrono::steady_clock::now() - started < chrono::seconds(5) );
+            REQUIRE( connectionFactory->pendingCount() == 0 );
+            
+            shared_ptr<NodeDbEntry> seedEntry = geodb->Load( TestData::NodeWien.id() );
+            REQUIRE( seedEntry != nullptr );
+            REQUIRE( seedEntry->relationType() == NodeRelationType::Colleague );
+            REQUIRE( geodb->Load( TestData::NodeKecskemet.id() ) == nullptr );
+        }
+    }
+}
+
+
+
+SCENARIO("Closest node lookup", "[relations][logic]")
+{
+    GIVEN("A node knowing only slow nodes and a faraway node that knows a closer one") {
+        shared_ptr<InProcessNodeConnectionFactory> connectionFactory( new InProcessNodeConnectionFactory() );
+        
+        for (const auto &slowNode : { TestData::NodeWien, TestData::NodeLondon, TestData::NodeNewYork })
+        {
+            shared_ptr<ISpatialDatabase> slowDb( new SpatiaLiteDatabase( slowNode,
+                SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+            connectionFactory->Add( slowNode.contact().nodeEndpoint(),
+                shared_ptr<Node>( new Node(slowDb, connectionFactory) ), chrono::hours(1) );
+        }
+        
+        shared_ptr<ISpatialDatabase> capeTownDb( new SpatiaLiteDatabase( TestData::NodeCapeTown,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        capeTownDb->Store( NodeDbEntry(TestData::NodeKecskemet, NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        connectionFactory->Add( TestData::NodeCapeTown.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(capeTownDb, connectionFactory) ) );
+        
+        shared_ptr<ISpatialDatabase> kecskemetDb( new SpatiaLiteDatabase( TestData::NodeKecskemet,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        connectionFactory->Add( TestData::NodeKecskemet.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(kecskemetDb, connectionFactory) ) );
+        
+        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        geodb->Store( NodeDbEntry(TestData::NodeWien,     NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        geodb->Store( NodeDbEntry(TestData::NodeLondon,   NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        geodb->Store( NodeDbEntry(TestData::NodeNewYork,  NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        geodb->Store( NodeDbEntry(TestData::NodeCapeTown, NodeRelationType::Colleague, NodeContactRoleType::Initiator) );
+        Node geonet(geodb, connectionFactory);
+        
+        THEN("the next candidate is asked instead of waiting for slow nodes and the lookup converges") {
+            auto started = chrono::steady_clock::now();
+            vector<NodeInfo> closestNodes = geonet.LookupClosestNodes(4);
+            REQUIRE( chrono::steady_clock::now() - started < chrono::seconds(5) );
+            REQUIRE( connectionFactory->pendingCount() == 0 );
+            
+            REQUIRE( closestNodes.size() == 4 );
+            REQUIRE( closestNodes[0] == TestData::NodeKecskemet );
+            REQUIRE( closestNodes[1] == TestData::NodeWien );
+            REQUIRE( closestNodes[2] == TestData::NodeLondon );
+            REQUIRE( closestNodes[3] == TestData::NodeNewYork );
+        }
+    }
+}
+
+
+
+SCENARIO("Parallel node admission", "[relations][logic]")
+{
+    GIVEN("A node receiving colleague requests of nearby nodes at the same time") {
+        shared_ptr<ISpatialDatabase> geodb( new SlowStoringSpatialDatabase(
+            TestData::NodeBudapest, chrono::milliseconds(50) ) );
+        shared_ptr<INodeConnectionFactory> connectionFactory( new DummyNodeConnectionFactory() );
+        Node geonet(geodb, connectionFactory);
+        
+        THEN("only one of the overlapping candidates is stored") {
+            atomic<bool> started(false);
+            atomic<size_t> acceptedCount(0);
+            vector<thread> candidates;
+            for (size_t idx = 0; idx < 16; ++idx)
+            {
+                NodeInfo candidate( "OverlappingNode" + to_string(idx),
+                    GpsLocation( TestData::NewYork.latitude() + idx * 0.01, TestData::NewYork.longitude() ),
+                    NodeContact( "127.0.0.1", 7000 + idx, 8000 + idx ), {} );
+                candidates.emplace_back( [&geonet, &started, &acceptedCount, candidate]
+                {
+                    while (! started)
+                        { this_thread::yield(); }
+                    if ( geonet.AcceptColleague(candidate) != nullptr )
+                        { ++acceptedCount; }
+                } );
+            }
+            
+            started = true;
+            for (auto &candidate : candidates)
+                { candidate.join(); }
+            
+            REQUIRE( acceptedCount == 1 );
+            REQUIRE( geodb->GetNodeCount(NodeRelationType::Colleague) == 1 );
+        }
+    }
+    
+    GIVEN("A node receiving neighbour requests of equally distant nodes at the same time") {
+        shared_ptr<ISpatialDatabase> geodb( new SlowStoringSpatialDatabase(
+            TestData::NodeBudapest, chrono::milliseconds(50) ) );
+        shared_ptr<INodeConnectionFactory> connectionFactory( new DummyNodeConnectionFactory() );
+        Node geonet(geodb, connectionFactory);
+        
+        THEN("no more candidates are stored than the neighbour limit of the test config") {
+            atomic<bool> started(false);
+            atomic<size_t> acceptedCount(0);
+            vector<thread> candidates;
+            for (size_t idx = 0; idx < 16; ++idx)
+            {
+                NodeInfo candidate( "EquallyDistantNode" + to_string(idx), TestData::Wien,
+                    NodeContact( "127.0.0.1", 7000 + idx, 8000 + idx ), {} );
+                candidates.emplace_back( [&geonet, &started, &acceptedCount, candidate]
+                {
+                    while (! started)
+                        { this_thread::yield(); }
+                    if ( geonet.AcceptNeighbour(candidate) != nullptr )
+                        { ++acceptedCount; }
+                } );
+            }
+            
+            started = true;
+            for (auto &candidate : candidates)
+                { candidate.join(); }
+            
+            REQUIRE( acceptedCount == 3 );
+            REQUIRE( geodb->GetNodeCount(NodeRelationType::Neighbour) == 3 );
+        }
+    }
+}
+
+
+
+SCENARIO("Neighbour renewal after service registration", "[localservice][relations][logic]")
+{
+    GIVEN("A node with a reachable neighbour") {
+        shared_ptr<InProcessNodeConnectionFactory> connectionFactory( new InProcessNodeConnectionFactory() );
+        
+        shared_ptr<ISpatialDatabase> wienDb( new SpatiaLiteDatabase( TestData::NodeWien,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        connectionFactory->Add( TestData::NodeWien.contact().nodeEndpoint(),
+            shared_ptr<Node>( new Node(wienDb, connectionFactory) ) );
+        
+        shared_ptr<ISpatialDatabase> geodb( new SpatiaLiteDatabase( TestData::NodeBudapest,
+            SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ) );
+        geodb->Store( NodeDbEntry(TestData::NodeWien, NodeRelationType::Neighbour, NodeContactRoleType::Initiator) );
+        Node geonet(geodb, connectionFactory);
+        
+        WHEN("services are registered and deregistered in a quick succession") {
+            geonet.RegisterService( ServiceInfo(ServiceType::Token, 1111) );
+            geonet.RegisterService( ServiceInfo(ServiceType::Minting, 2222) );
+            geonet.RegisterService( ServiceInfo(ServiceType::Profile, 3333, "ProfileServerId") );
+            geonet.DeregisterService(ServiceType::Minting);
+            
+            THEN("neighbours are not contacted while responding") {
+                REQUIRE( connectionFactory->connectionCount() == 0 );
+            }
+            THEN("neighbours are updated once in the background") {
+                this_thread::sleep_for( chrono::milliseconds(1500) );
+                REQUIRE( connectionFactory->connectionCount() == 1 );
+                
+                shared_ptr<NodeDbEntry> updatedInfo = wienDb->Load( TestData::NodeBudapest.id() );
+                REQUIRE( updatedInfo != nullptr );
+                REQUIRE( updatedInfo->services().size() == 2 );
+                REQUIRE( updatedInfo->services().find(ServiceType::Minting) == updatedInfo->services().end() );
+            }
+        }
+    }
+}
@@ -15,6 +15,140 @@ using namespace asio::ip;
 
 
 
+static string JoinParts(const SerializedParts &parts)
+{
+    string result;
+    for (const auto &part : parts)
+        { result += *part; }
+    return result;
+}
+
+
+SCENARIO("Message framing", "[messaging]")
+{
+    GIVEN("A serialized request") {
+        iop::locnet::Request request;
+        request.set_version({1,0,0});
+        Converter::FillProtoBuf( request.mutable_localservice()->mutable_neighbourhoodchanged()
+            ->add_changes()->mutable_addednodeinfo(), TestData::NodeKecskemet );
+        const string requestBytes = request.SerializeAsString();
+        
+        THEN("it is framed exactly as the whole message would be serialized") {
+            for ( uint32_t messageId : { 0u, 1u, 300u, 0xFFFFFFFFu } )
+            {
+                iop::locnet::MessageWithHeader message;
+                *message.mutable_body()->mutable_request() = request;
+                message.mutable_body()->set_id(messageId);
+                message.set_header(1);
+                message.set_header( message.ByteSizeLong() - 5 );
+                
+                string framedBytes = RequestMessagePrefix( messageId, requestBytes.size() ) + requestBytes;
+                REQUIRE( framedBytes == message.SerializeAsString() );
+            }
+        }
+    }
+    
+    GIVEN("A batch of neighbourhood changes") {
+        NeighbourhoodChangeBatch batch;
+        NodeDbEntry movedWien( NodeInfo( TestData::NodeWien.id(), TestData::NewYork,
+            TestData::NodeWien.contact(), {} ), NodeRelationType::Neighbour, NodeContactRoleType::Initiator );
+        
+        batch.Add( NeighbourhoodChangeType::Added, TestData::EntryKecskemet );
+        batch.Add( NeighbourhoodChangeType::Updated, TestData::EntryKecskemet );
+        batch.Add( NeighbourhoodChangeType::Updated, TestData::EntryWien );
+        batch.Add( NeighbourhoodChangeType::Updated, movedWien );
+        batch.Add( NeighbourhoodChangeType::Added, TestData::EntryLondon );
+        batch.Add( NeighbourhoodChangeType::Removed, TestData::EntryLondon );
+        batch.Add( NeighbourhoodChangeType::Removed, TestData::EntryCapeTown );
+        
+        THEN("changes of the same node are collapsed") {
+            REQUIRE( batch.size() == 3 );
+            
+            iop::locnet::Request request;
+            REQUIRE( request.ParseFromString( JoinParts( batch.SerializeRequest() ) ) );
+            REQUIRE( request.version() == string("\x01\x00\x00", 3) );
+            const iop::locnet::NeighbourhoodChangedNotificationRequest &notification =
+                request.localservice().neighbourhoodchanged();
+            REQUIRE( notification.changes_size() == 3 );
+            REQUIRE( Converter::FromProtoBuf( notification.changes(0).addednodeinfo() ) == TestData::NodeKecskemet );
+            REQUIRE( Converter::FromProtoBuf( notification.changes(1).updatednodeinfo() ) == movedWien );
+            REQUIRE( notification.changes(2).removednodeid() == TestData::NodeCapeTown.id() );
+        }
+        
+        THEN("the same serialized changes are shared between batches of all sessions") {
+            NeighbourhoodChangeBatch otherBatch;
+            otherBatch.Add( NeighbourhoodChangeType::Removed, TestData::EntryCapeTown );
+            
+            SerializedParts parts = batch.SerializeRequest();
+            SerializedParts otherParts = otherBatch.SerializeRequest();
+            REQUIRE( parts.size() == 4 );
+            REQUIRE( otherParts.size() == 2 );
+            REQUIRE( parts.back() == otherParts.back() );
+        }
+        
+        THEN("a node removed and added again is an update") {
+            batch.Add( NeighbourhoodChangeType::Added, TestData::EntryCapeTown );
+            REQUIRE( batch.size() == 3 );
+            
+            iop::locnet::Request request;
+            REQUIRE( request.ParseFromString( JoinParts( batch.SerializeRequest() ) ) );
+            const iop::locnet::NeighbourhoodChangedNotificationRequest &notification =
+                request.localservice().neighbourhoodchanged();
+            REQUIRE( Converter::FromProtoBuf( notification.changes(2).updatednodeinfo() ) == TestData::NodeCapeTown );
+        }
+    }
+}
+
+
+
+SCENARIO("Client session timeouts", "[messaging]")
+{
+    GIVEN("A listening socket that never answers") {
+        asio::io_service ioService;
+        tcp::acceptor acceptor( ioService, tcp::endpoint( address_v4::loopback(), 0 ) );
+        NetworkEndpoint endpoint( "127.0.0.1", acceptor.local_endpoint().port() );
+        
+        THEN("Waiting for a message fails after the timeout") {
+            ProtoBufTcpStreamSession session( endpoint, chrono::milliseconds(200) );
+            
+            auto started = chrono::steady_clock::now();
+            ErrorCode errorCode = ErrorCode::ERROR_INTERNAL;
+            try { session.ReceiveMessage(); }
+            catch (LocationNetworkError &ex) { errorCode = ex.code(); }
+            REQUIRE( errorCode == ErrorCode::ERROR_TIMEOUT );
+            REQUIRE( chrono::steady_clock::now() - started >= chrono::milliseconds(200) );
+            REQUIRE( chrono::steady_clock::now() - started < chrono::seconds(5) );
+        }
+        
+        THEN("All parts of a message must arrive within a single timeout") {
+            thread server( [&ioService, &acceptor]
+            {
+                tcp::socket socket(ioService);
+                acceptor.accept(socket);
+                
+                // NOTE both parts arrive within the timeout on their own, but not together
+                const char header[] = { 0x0D, 1, 0, 0, 0 };
+                asio::error_code ignored;
+                this_thread::sleep_for( chrono::milliseconds(250) );
+                asio::write( socket, asio::buffer(header, sizeof(header)), ignored );
+                this_thread::sleep_for( chrono::milliseconds(250) );
+                asio::write( socket, asio::buffer("\x0A", 1), ignored );
+            } );
+            scope_exit joinServer( [&server] { server.join(); } );
+            
+            ProtoBufTcpStreamSession session( endpoint, chrono::milliseconds(400) );
+            REQUIRE_THROWS_AS( session.ReceiveMessage(), const LocationNetworkError& );
+        }
+        
+        THEN("Host names are resolved within the timeout") {
+            NetworkEndpoint namedEndpoint( "localhost", endpoint.port() );
+            REQUIRE_NOTHROW( ProtoBufTcpStreamSession( namedEndpoint, chrono::seconds(5) ) );
+        }
+    }
+}
+
+
+
 SCENARIO("TCP networking", "[network]")
 {
     GIVEN("A configured Node and Tcp networking")
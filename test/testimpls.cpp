@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <limits>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <easylogging++.h>
 
 #include "testimpls.hpp"
@@ -22,11 +28,65 @@ void ChangeCounter::RemovedNode(const NodeDbEntry&) { ++removedCount; }
 
 
 
-shared_ptr<INodeMethods> DummyNodeConnectionFactory::ConnectTo(const NetworkEndpoint&)
+shared_ptr<INodeMethods> DummyNodeConnectionFactory::ConnectTo(const NetworkEndpoint&, shared_ptr<AbortSignal>)
 {
     return shared_ptr<INodeMethods>();
 }
 
+InProcessNodeConnectionFactory::InProcessNodeConnectionFactory() :
+    _nodes(), _connectionCount(0), _pendingCount(0) {}
+
+void InProcessNodeConnectionFactory::Add( const NetworkEndpoint &endpoint, shared_ptr<INodeMethods> node,
+                                          chrono::milliseconds connectDelay )
+    { _nodes.push_back( InProcessNode{ endpoint, node, connectDelay } ); }
+
+void InProcessNodeConnectionFactory::AddUnresponsive(const NetworkEndpoint &endpoint, chrono::milliseconds timeout)
+    { _nodes.push_back( InProcessNode{ endpoint, shared_ptr<INodeMethods>(), timeout } ); }
+
+size_t InProcessNodeConnectionFactory::connectionCount() const
+    { return _connectionCount; }
+
+size_t InProcessNodeConnectionFactory::pendingCount() const
+    { return _pendingCount; }
+
+shared_ptr<INodeMethods> InProcessNodeConnectionFactory::ConnectTo(
+    const NetworkEndpoint &endpoint, shared_ptr<AbortSignal> abort )
+{
+    ++_connectionCount;
+    ++_pendingCount;
+    scope_exit connectFinished( [this] { --_pendingCount; } );
+    
+    auto nodeIt = find_if( _nodes.begin(), _nodes.end(),
+        [&endpoint] (const InProcessNode &node) { return node.endpoint == endpoint; } );
+    if ( nodeIt == _nodes.end() )
+        { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "No node is listening on the endpoint"); }
+    
+    if ( nodeIt->connectDelay > chrono::milliseconds::zero() )
+    {
+        mutex delayMutex;
+        condition_variable abortRaised;
+        bool aborted = false;
+        size_t abortHandlerId = 0;
+        if (abort)
+        {
+            abortHandlerId = abort->AddHandler( [&]
+            {
+                lock_guard<mutex> delayGuard(delayMutex);
+                aborted = true;
+                abortRaised.notify_all();
+            } );
+        }
+        scope_exit removeAbortHandler( [&] { if (abort) { abort->RemoveHandler(abortHandlerId); } } );
+        
+        unique_lock<mutex> delayLock(delayMutex);
+        if ( abortRaised.wait_for( delayLock, nodeIt->connectDelay, [&aborted] { return aborted; } ) )
+            { throw LocationNetworkError(ErrorCode::ERROR_CONNECTION, "Connection attempt aborted"); }
+    }
+    if (! nodeIt->node)
+        { throw LocationNetworkError(ErrorCode::ERROR_TIMEOUT, "Connection attempt timed out"); }
+    return nodeIt->node;
+}
+
 shared_ptr<IChangeListener> DummyChangeListenerFactory::Create(shared_ptr<ILocalServiceMethods>)
 {
     return shared_ptr<IChangeListener>();
@@ -34,6 +94,18 @@ shared_ptr<IChangeListener> DummyChangeListenerFactory::Create(shared_ptr<ILocal
 
 
 
+SlowStoringSpatialDatabase::SlowStoringSpatialDatabase(const NodeInfo &myNodeInfo, chrono::milliseconds storeDelay) :
+    SpatiaLiteDatabase( myNodeInfo, SpatiaLiteDatabase::IN_MEMORY_DB, chrono::hours(1) ),
+    _storeDelay(storeDelay) {}
+
+void SlowStoringSpatialDatabase::Store(const NodeDbEntry &node, bool expires)
+{
+    this_thread::sleep_for(_storeDelay);
+    SpatiaLiteDatabase::Store(node, expires);
+}
+
+
+
 random_device InMemorySpatialDatabase::_randomDevice;
 
 
@@ -55,7 +127,7 @@ void InMemorySpatialDatabase::Store(const NodeDbEntry &node, bool)
 }
 
 
-shared_ptr<NodeDbEntry> InMemorySpatialDatabase::Load(const string &nodeId) const
+shared_ptr<NodeDbEntry> InMemorySpatialDatabase::Load(const string &nodeId, ServiceDetails) const
 {
     auto it = _nodes.find(nodeId);
     if ( it == _nodes.end() ) {
@@ -77,6 +149,20 @@ void InMemorySpatialDatabase::Update(const NodeDbEntry &node, bool)
 }
 
 
+void InMemorySpatialDatabase::StoreMany(const vector<NodeDbEntry> &nodes, bool expires)
+{
+    for (const auto &node : nodes)
+        { Store(node, expires); }
+}
+
+
+void InMemorySpatialDatabase::UpdateMany(const vector<NodeDbEntry> &nodes, bool expires)
+{
+    for (const auto &node : nodes)
+        { Update(node, expires); }
+}
+
+
 void InMemorySpatialDatabase::Remove(const string &nodeId)
 {
     auto it = _nodes.find(nodeId);
@@ -185,6 +271,13 @@ std::vector<NodeDbEntry> InMemorySpatialDatabase::GetNodes(NodeRelationType rela
 size_t InMemorySpatialDatabase::GetNodeCount() const
     { return _nodes.size(); }
 
+size_t InMemorySpatialDatabase::GetNodeCount(NodeRelationType relationType) const
+{
+    return count_if( _nodes.begin(), _nodes.end(),
+        [relationType] (const pair<const NodeId, NodeDbEntry> &entry)
+            { return entry.second.relationType() == relationType; } );
+}
+
 
 
 vector<NodeDbEntry> InMemorySpatialDatabase::GetNodes(NodeContactRoleType roleType)
@@ -199,6 +292,19 @@ vector<NodeDbEntry> InMemorySpatialDatabase::GetNodes(NodeContactRoleType roleTy
 }
 
 
+// NOTE entries of this test implementation never expire
+vector<pair<NodeId, time_t>> InMemorySpatialDatabase::GetExpirations(NodeContactRoleType roleType) const
+{
+    vector<pair<NodeId, time_t>> result;
+    for (auto const &entry : _nodes)
+    {
+        if ( entry.second.roleType() == roleType )
+            { result.emplace_back( entry.first, numeric_limits<time_t>::max() ); }
+    }
+    return result;
+}
+
+
 
 vector<NodeDbEntry> InMemorySpatialDatabase::GetNeighbourNodesByDistance() const
 {
@@ -209,6 +315,26 @@ vector<NodeDbEntry> InMemorySpatialDatabase::GetNeighbourNodesByDistance() const
                      GetDistanceKm( other.location(), _myLocation ); } );
     return neighbours;
 }
+
+
+size_t InMemorySpatialDatabase::GetNeighbourRank(const NodeId &nodeId) const
+{
+    vector<NodeDbEntry> neighbours( GetNeighbourNodesByDistance() );
+    auto neighbourIter = find_if( neighbours.begin(), neighbours.end(),
+        [&nodeId] (const NodeDbEntry &neighbour) { return neighbour.id() == nodeId; } );
+    if ( neighbourIter == neighbours.end() )
+        { throw LocationNetworkError(ErrorCode::ERROR_INVALID_VALUE, "Node is not a neighbour: " + nodeId); }
+    return distance( neighbours.begin(), neighbourIter );
+}
+
+
+shared_ptr<NodeDbEntry> InMemorySpatialDatabase::GetNeighbourByRank(size_t rank) const
+{
+    vector<NodeDbEntry> neighbours( GetNeighbourNodesByDistance() );
+    if ( rank >= neighbours.size() )
+        { return shared_ptr<NodeDbEntry>(); }
+    return make_shared<NodeDbEntry>( neighbours[rank] );
+}
     
     
 
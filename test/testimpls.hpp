@@ -1,6 +1,8 @@
 #ifndef __LOCNET_TEST_IMPLEMENTATIONS_H__
 #define __LOCNET_TEST_IMPLEMENTATIONS_H__
 
+#include <atomic>
+
 #include "locnet.hpp"
 
 
@@ -49,18 +51,25 @@ public:
     
     Distance GetDistanceKm(const GpsLocation &one, const GpsLocation &other) const override;
 
-    std::shared_ptr<NodeDbEntry> Load(const NodeId &nodeId) const override;
+    std::shared_ptr<NodeDbEntry> Load( const NodeId &nodeId,
+        ServiceDetails services = ServiceDetails::Included ) const override;
     void Store (const NodeDbEntry &node, bool expires = true) override;
     void Update(const NodeDbEntry &node, bool expires = true) override;
+    void StoreMany (const std::vector<NodeDbEntry> &nodes, bool expires = true) override;
+    void UpdateMany(const std::vector<NodeDbEntry> &nodes, bool expires = true) override;
     void Remove(const NodeId &nodeId) override;
     void ExpireOldNodes() override;
     
     IChangeListenerRegistry& changeListenerRegistry() override;
     
     std::vector<NodeDbEntry> GetNodes(NodeContactRoleType roleType) override;
+    std::vector<std::pair<NodeId, time_t>> GetExpirations(NodeContactRoleType roleType) const override;
     
     size_t GetNodeCount() const override;
+    size_t GetNodeCount(NodeRelationType relationType) const override;
     std::vector<NodeDbEntry> GetNeighbourNodesByDistance() const override;
+    size_t GetNeighbourRank(const NodeId &nodeId) const override;
+    std::shared_ptr<NodeDbEntry> GetNeighbourByRank(size_t rank) const override;
     std::vector<NodeDbEntry> GetRandomNodes(
         size_t maxNodeCount, Neighbours filter) const override;
     
@@ -70,11 +79,57 @@ public:
 
     
 
+// Waits before storing a node to widen the window between admission checks and storing
+class SlowStoringSpatialDatabase : public SpatiaLiteDatabase
+{
+    std::chrono::milliseconds _storeDelay;
+    
+public:
+    
+    SlowStoringSpatialDatabase(const NodeInfo &myNodeInfo, std::chrono::milliseconds storeDelay);
+    
+    void Store(const NodeDbEntry &node, bool expires = true) override;
+};
+
+
+
 class DummyNodeConnectionFactory: public INodeConnectionFactory
 {
 public:
     
-    std::shared_ptr<INodeMethods> ConnectTo(const NetworkEndpoint &endpoint) override;
+    std::shared_ptr<INodeMethods> ConnectTo( const NetworkEndpoint &endpoint,
+        std::shared_ptr<AbortSignal> abort = std::shared_ptr<AbortSignal>() ) override;
+};
+
+
+// Connects to in-process node objects registered by their endpoint, fails for any other endpoint.
+// Connecting to slow nodes takes the given delay unless aborted meanwhile,
+// unresponsive nodes time out after the given delay.
+class InProcessNodeConnectionFactory: public INodeConnectionFactory
+{
+    struct InProcessNode
+    {
+        NetworkEndpoint                 endpoint;
+        std::shared_ptr<INodeMethods>   node;
+        std::chrono::milliseconds       connectDelay;
+    };
+    
+    std::vector<InProcessNode> _nodes;
+    std::atomic<size_t> _connectionCount;
+    std::atomic<size_t> _pendingCount;
+    
+public:
+    
+    InProcessNodeConnectionFactory();
+    
+    void Add( const NetworkEndpoint &endpoint, std::shared_ptr<INodeMethods> node,
+              std::chrono::milliseconds connectDelay = std::chrono::milliseconds::zero() );
+    void AddUnresponsive(const NetworkEndpoint &endpoint, std::chrono::milliseconds timeout);
+    size_t connectionCount() const;
+    // Number of connection attempts still in progress
+    size_t pendingCount() const;
+    std::shared_ptr<INodeMethods> ConnectTo( const NetworkEndpoint &endpoint,
+        std::shared_ptr<AbortSignal> abort = std::shared_ptr<AbortSignal>() ) override;
 };
 
 